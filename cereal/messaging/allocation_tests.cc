@@ -0,0 +1,70 @@
+#include <cstdlib>
+
+#include "catch2/catch.hpp"
+#include "messaging.hpp"
+
+// Interposes on malloc through glibc internals, which would affect every other test in the same binary
+#ifdef __GLIBC__
+
+// Count heap allocations of the calling thread while enabled. operator new ends up in malloc as well.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t num, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static thread_local bool count_allocations = false;
+static thread_local size_t num_allocations = 0;
+
+extern "C" void *malloc(size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t num, size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+// Same as the publish loop of boardd: a can event built from a usb bulk read of num_msg frames
+static void publish_can(PubMaster &pm, ReusableMessageBuilder &msg, const uint32_t *data, int num_msg) {
+  auto event = msg.initEvent();
+  auto canData = event.initCan(num_msg);
+  for (int i = 0; i < num_msg; i++) {
+    canData[i].setAddress(data[i*4] >> 21);
+    canData[i].setBusTime(data[i*4+1] >> 16);
+    int len = data[i*4+1]&0xF;
+    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
+    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+  }
+  pm.send("can", msg);
+}
+
+TEST_CASE("boardd publish loop doesn't allocate in steady state"){
+  PubMaster pm({"can"});
+  ReusableMessageBuilder msg;
+
+  const int max_msgs = 256;
+  uint32_t data[max_msgs * 4];
+  for (int i = 0; i < max_msgs * 4; i++) {
+    data[i] = rand();
+  }
+
+  // The first segment grows to fit the largest message once
+  publish_can(pm, msg, data, max_msgs);
+  publish_can(pm, msg, data, max_msgs);
+
+  num_allocations = 0;
+  count_allocations = true;
+  for (int i = 0; i < 1000; i++) {
+    publish_can(pm, msg, data, i % (max_msgs + 1));
+  }
+  count_allocations = false;
+
+  REQUIRE(num_allocations == 0);
+}
+
+#endif
@@ -1,4 +1,14 @@
+// Forwards msgq services to ZMQ, or with --receive from a remote bridge back into msgq.
+// usage: bridge [--whitelist a,b,...] [--decimation a=N,...] [--batch] [--compress none|bz2]
+//        bridge --receive <address> [--whitelist a,b,...] [--prefix <msgq prefix>]
+// --batch coalesces the messages of a topic from one poll cycle into a single ZMQ message, which
+// only a receiving bridge understands. Without it every message is forwarded as is.
+// To try it locally: bridge --batch --compress bz2 & bridge --receive 127.0.0.1 --prefix remote_
+
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <cassert>
 #include <csignal>
@@ -10,31 +20,45 @@ typedef void (*sighandler_t)(int sig);
 
 #include "impl_msgq.hpp"
 #include "impl_zmq.hpp"
+#include "bridge_batch.h"
+
+struct Forward {
+  PubSocket *pub;
+  int decimation = 1;
+  uint64_t count = 0;
+};
 
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
-static std::vector<std::string> get_services() {
+static std::vector<std::string> split(const std::string &s, char delim) {
+  std::vector<std::string> parts;
+  std::stringstream ss(s);
+  std::string part;
+  while (std::getline(ss, part, delim)) {
+    if (!part.empty()) parts.push_back(part);
+  }
+  return parts;
+}
+
+static std::vector<std::string> get_services(const std::vector<std::string> &whitelist) {
   std::vector<std::string> name_list;
 
   for (const auto& it : services) {
     std::string name = it.name;
     if (name == "plusFrame" || name == "uiLayoutState") continue;
+    if (!whitelist.empty() && std::find(whitelist.begin(), whitelist.end(), name) == whitelist.end()) continue;
     name_list.push_back(name);
   }
 
   return name_list;
 }
 
-
-int main(void){
-  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
-
-  auto endpoints = get_services();
-
-  std::map<SubSocket*, PubSocket*> sub2pub;
+static void forward_to_zmq(const std::vector<std::string> &endpoints, const std::map<std::string, int> &decimation,
+                           bool batch, BridgeCodec codec) {
+  std::map<SubSocket*, Forward> forwards;
 
   Context *zmq_context = new ZMQContext();
   Context *msgq_context = new MSGQContext();
@@ -48,17 +72,136 @@ int main(void){
     PubSocket * zmq_sock = new ZMQPubSocket();
     zmq_sock->connect(zmq_context, endpoint);
 
-    sub2pub[msgq_sock] = zmq_sock;
+    Forward &f = forwards[msgq_sock];
+    f.pub = zmq_sock;
+    if (decimation.count(endpoint)) f.decimation = decimation.at(endpoint);
+  }
+
+  BridgeBatch msgs;
+  while (true){
+    for (auto sub_sock : poller->poll(100)){
+      Forward &f = forwards[sub_sock];
+      msgs.clear();
+
+      // Drain everything that arrived since the last poll. Batches borrow, adding to the batch is the only copy
+      while (Message * msg = batch ? sub_sock->borrow(true) : sub_sock->receive(true)){
+        if (f.count++ % f.decimation == 0){
+          if (batch){
+            // Receivers reject oversized batches, send what was collected so far
+            if (!msgs.fits(msg->getSize()) && msgs.numMessages() > 0){
+              auto packed = msgs.pack(codec);
+              f.pub->send((char *)packed.first, packed.second);
+              msgs.clear();
+            }
+            msgs.add(msg->getData(), msg->getSize());
+            // The publisher overwrote it while it was being copied
+            if (!msg->release()) msgs.removeLast();
+          } else {
+            f.pub->sendMessage(msg);
+          }
+        }
+        delete msg;
+      }
+
+      if (batch && msgs.numMessages() > 0){
+        auto packed = msgs.pack(codec);
+        f.pub->send((char *)packed.first, packed.second);
+      }
+    }
   }
+}
+
+static void receive_from_zmq(const std::vector<std::string> &endpoints, const std::string &address, const std::string &prefix) {
+  std::map<SubSocket*, PubSocket*> sub2pub;
+
+  Context *zmq_context = new ZMQContext();
+  Context *msgq_context = new MSGQContext();
+  Poller *poller = new ZMQPoller();
 
+  for (auto endpoint: endpoints){
+    SubSocket * zmq_sock = new ZMQSubSocket();
+    zmq_sock->connect(zmq_context, endpoint, address, false);
+    poller->registerSocket(zmq_sock);
+
+    PubSocket * msgq_sock = new MSGQPubSocket();
+    msgq_sock->connect(msgq_context, prefix + endpoint, prefix.empty());
+
+    sub2pub[zmq_sock] = msgq_sock;
+  }
 
+  BridgeBatch batch;
+  std::vector<std::pair<const char *, size_t>> msgs;
+  std::vector<kj::ArrayPtr<capnp::byte>> batch_msgs;
   while (true){
     for (auto sub_sock : poller->poll(100)){
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
-      delete msg;
+      PubSocket *pub_sock = sub2pub[sub_sock];
+
+      while (Message * msg = sub_sock->receive(true)){
+        if (!bridge_is_batch(msg->getData(), msg->getSize())){
+          pub_sock->sendMessage(msg);
+        } else if (batch.unpack(msg->getData(), msg->getSize(), msgs)){
+          batch_msgs.clear();
+          for (auto &m : msgs){
+            batch_msgs.push_back(kj::arrayPtr((capnp::byte *)m.first, m.second));
+          }
+          pub_sock->sendBatch(batch_msgs);
+        } else {
+          std::cout << "Dropping malformed batch of " << msg->getSize() << " bytes" << std::endl;
+        }
+        delete msg;
+      }
     }
   }
+}
+
+int main(int argc, char **argv){
+  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+
+  std::vector<std::string> whitelist;
+  std::map<std::string, int> decimation;
+  bool batch = false;
+  BridgeCodec codec = BridgeCodec::NONE;
+  std::string receive_address, prefix;
+
+  for (int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if (arg == "--whitelist" && has_value){
+      whitelist = split(argv[++i], ',');
+    } else if (arg == "--decimation" && has_value){
+      for (auto &d : split(argv[++i], ',')){
+        size_t eq = d.find('=');
+        int n = eq == std::string::npos ? 0 : atoi(d.c_str() + eq + 1);
+        if (n < 1){
+          std::cout << "Invalid decimation " << d << std::endl;
+          return 1;
+        }
+        decimation[d.substr(0, eq)] = n;
+      }
+    } else if (arg == "--batch"){
+      batch = true;
+    } else if (arg == "--compress" && has_value){
+      if (!bridge_parse_codec(argv[++i], codec)){
+        std::cout << "Unknown codec " << argv[i] << std::endl;
+        return 1;
+      }
+      batch = true;
+    } else if (arg == "--receive" && has_value){
+      receive_address = argv[++i];
+    } else if (arg == "--prefix" && has_value){
+      prefix = argv[++i];
+    } else {
+      std::cout << "Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  auto endpoints = get_services(whitelist);
+  if (receive_address.empty()){
+    forward_to_zmq(endpoints, decimation, batch, codec);
+  } else {
+    receive_from_zmq(endpoints, receive_address, prefix);
+  }
   return 0;
 }
@@ -0,0 +1,113 @@
+#include <cstring>
+
+#include <bzlib.h>
+
+#include "bridge_batch.h"
+
+bool bridge_parse_codec(const std::string &name, BridgeCodec &codec){
+  if (name == "none"){
+    codec = BridgeCodec::NONE;
+  } else if (name == "bz2"){
+    codec = BridgeCodec::BZ2;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool bridge_is_batch(const char *data, size_t size){
+  uint32_t magic;
+  if (size < sizeof(BridgeBatchHeader)) return false;
+  memcpy(&magic, data, sizeof(magic));
+  return magic == BRIDGE_BATCH_MAGIC;
+}
+
+void BridgeBatch::clear(){
+  raw.clear();
+  num_msgs = 0;
+}
+
+void BridgeBatch::add(const char *data, size_t size){
+  uint32_t sz = size;
+  last_offset = raw.size();
+  raw.insert(raw.end(), (const char *)&sz, (const char *)&sz + sizeof(sz));
+  raw.insert(raw.end(), data, data + size);
+  num_msgs++;
+}
+
+void BridgeBatch::removeLast(){
+  raw.resize(last_offset);
+  num_msgs--;
+}
+
+std::pair<const char *, size_t> BridgeBatch::pack(BridgeCodec codec){
+  BridgeBatchHeader header = {
+    .magic = BRIDGE_BATCH_MAGIC,
+    .codec = (uint32_t)codec,
+    .num_msgs = num_msgs,
+    .raw_size = (uint32_t)raw.size(),
+  };
+
+  size_t payload_size = raw.size();
+  packed.resize(sizeof(header) + raw.size());
+
+  if (codec == BridgeCodec::BZ2){
+    // Fast block size, the bridge runs in real time
+    unsigned int compressed_size = raw.size();
+    int bzerror = BZ2_bzBuffToBuffCompress(packed.data() + sizeof(header), &compressed_size,
+                                           raw.data(), raw.size(), 1, 0, 0);
+    if (bzerror == BZ_OK){
+      payload_size = compressed_size;
+    } else {
+      // BZ_OUTBUFF_FULL if it didn't get smaller
+      header.codec = (uint32_t)BridgeCodec::NONE;
+    }
+  }
+
+  if (header.codec == (uint32_t)BridgeCodec::NONE){
+    memcpy(packed.data() + sizeof(header), raw.data(), raw.size());
+  }
+  memcpy(packed.data(), &header, sizeof(header));
+
+  return {packed.data(), sizeof(header) + payload_size};
+}
+
+bool BridgeBatch::unpack(const char *data, size_t size, std::vector<std::pair<const char *, size_t>> &msgs){
+  msgs.clear();
+
+  BridgeBatchHeader header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != BRIDGE_BATCH_MAGIC) return false;
+
+  const char *payload = data + sizeof(header);
+  size_t payload_size = size - sizeof(header);
+
+  if (header.raw_size > BRIDGE_BATCH_MAX_RAW_SIZE) return false;
+
+  if (header.codec == (uint32_t)BridgeCodec::BZ2){
+    raw.resize(header.raw_size);
+    unsigned int raw_size = header.raw_size;
+    int bzerror = BZ2_bzBuffToBuffDecompress(raw.data(), &raw_size, (char *)payload, payload_size, 0, 0);
+    if (bzerror != BZ_OK || raw_size != header.raw_size) return false;
+
+    payload = raw.data();
+    payload_size = raw_size;
+  } else if (header.codec != (uint32_t)BridgeCodec::NONE || payload_size != header.raw_size){
+    return false;
+  }
+
+  size_t pos = 0;
+  for (uint32_t i = 0; i < header.num_msgs; i++){
+    uint32_t sz;
+    if (pos + sizeof(sz) > payload_size) return false;
+    memcpy(&sz, payload + pos, sizeof(sz));
+    pos += sizeof(sz);
+
+    if (pos + sz > payload_size) return false;
+    msgs.push_back({payload + pos, sz});
+    pos += sz;
+  }
+
+  return pos == payload_size;
+}
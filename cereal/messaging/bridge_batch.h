@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define BRIDGE_BATCH_MAGIC 0x48435442 // "BTCH"
+// Largest uncompressed payload, MAX_SEGMENT_SIZE in services.py. Received batches can claim anything
+#define BRIDGE_BATCH_MAX_RAW_SIZE (100 * 1024 * 1024)
+
+enum class BridgeCodec : uint32_t {
+  NONE = 0,
+  BZ2 = 1,
+};
+
+// Framing of the messages the bridge coalesced from one topic in a poll cycle.
+// The header is followed by the payload, compressed with codec:
+// for every message a uint32_t size followed by the data
+struct BridgeBatchHeader {
+  uint32_t magic;
+  uint32_t codec;
+  uint32_t num_msgs;
+  uint32_t raw_size; // size of the uncompressed payload
+};
+
+bool bridge_parse_codec(const std::string &name, BridgeCodec &codec);
+// A capnp message can't start with the magic, it would mean more than a billion segments
+bool bridge_is_batch(const char *data, size_t size);
+
+class BridgeBatch {
+public:
+  void clear();
+  void add(const char *data, size_t size);
+  // Takes back the last added message
+  void removeLast();
+  size_t numMessages() const { return num_msgs; }
+  // Whether a message of size still fits under BRIDGE_BATCH_MAX_RAW_SIZE
+  bool fits(size_t size) const { return raw.size() + sizeof(uint32_t) + size <= BRIDGE_BATCH_MAX_RAW_SIZE; }
+
+  // Serialized batch. Falls back to NONE when compressing doesn't make it smaller
+  std::pair<const char *, size_t> pack(BridgeCodec codec);
+
+  // Splits a received batch into its messages, which point into data or into this batch.
+  // Returns false if the batch is malformed
+  bool unpack(const char *data, size_t size, std::vector<std::pair<const char *, size_t>> &msgs);
+
+private:
+  std::vector<char> raw;
+  std::vector<char> packed;
+  size_t last_offset = 0;
+  uint32_t num_msgs = 0;
+};
@@ -0,0 +1,88 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "bridge_batch.h"
+
+TEST_CASE("BridgeBatch round trips messages"){
+  auto codec = GENERATE(BridgeCodec::NONE, BridgeCodec::BZ2);
+
+  BridgeBatch sender, receiver;
+  std::vector<std::string> sent;
+  for (int i = 0; i < 50; i++){
+    sent.push_back(std::string(i * 10, 'a' + i % 26));
+    sender.add(sent.back().data(), sent.back().size());
+  }
+  REQUIRE(sender.numMessages() == 50);
+
+  auto packed = sender.pack(codec);
+  if (codec == BridgeCodec::BZ2){
+    // Repeating data compresses well
+    REQUIRE(packed.second < sizeof(BridgeBatchHeader) + 50 * 4 + 10 * 49 * 50 / 2);
+  }
+  REQUIRE(bridge_is_batch(packed.first, packed.second));
+
+  std::vector<std::pair<const char *, size_t>> msgs;
+  REQUIRE(receiver.unpack(packed.first, packed.second, msgs));
+  REQUIRE(msgs.size() == sent.size());
+  for (size_t i = 0; i < sent.size(); i++){
+    REQUIRE(std::string(msgs[i].first, msgs[i].second) == sent[i]);
+  }
+}
+
+TEST_CASE("BridgeBatch falls back to no compression for incompressible data"){
+  BridgeBatch batch;
+  char data[256];
+  for (int i = 0; i < 256; i++) data[i] = rand();
+  batch.add(data, sizeof(data));
+
+  auto packed = batch.pack(BridgeCodec::BZ2);
+  BridgeBatchHeader header;
+  memcpy(&header, packed.first, sizeof(header));
+  REQUIRE(header.codec == (uint32_t)BridgeCodec::NONE);
+  REQUIRE(packed.second == sizeof(header) + sizeof(uint32_t) + sizeof(data));
+}
+
+TEST_CASE("BridgeBatch rejects malformed batches"){
+  BridgeBatch batch;
+  std::string msg = "hello";
+  batch.add(msg.data(), msg.size());
+  auto packed = batch.pack(BridgeCodec::NONE);
+  std::string good(packed.first, packed.second);
+  std::vector<std::pair<const char *, size_t>> msgs;
+
+  SECTION("truncated"){
+    REQUIRE_FALSE(batch.unpack(good.data(), good.size() - 1, msgs));
+    REQUIRE_FALSE(batch.unpack(good.data(), sizeof(BridgeBatchHeader) - 1, msgs));
+  }
+  SECTION("message size past the end"){
+    std::string bad = good;
+    uint32_t sz = 1000;
+    memcpy(&bad[sizeof(BridgeBatchHeader)], &sz, sizeof(sz));
+    REQUIRE_FALSE(batch.unpack(bad.data(), bad.size(), msgs));
+  }
+  SECTION("not a batch"){
+    std::string bad = good;
+    bad[0] = 0;
+    REQUIRE_FALSE(bridge_is_batch(bad.data(), bad.size()));
+    REQUIRE_FALSE(batch.unpack(bad.data(), bad.size(), msgs));
+  }
+  SECTION("corrupt compressed payload"){
+    std::string bad = good;
+    BridgeBatchHeader header;
+    memcpy(&header, bad.data(), sizeof(header));
+    header.codec = (uint32_t)BridgeCodec::BZ2;
+    memcpy(&bad[0], &header, sizeof(header));
+    REQUIRE_FALSE(batch.unpack(bad.data(), bad.size(), msgs));
+  }
+  SECTION("uncompressed size over the limit"){
+    std::string bad = good;
+    BridgeBatchHeader header;
+    memcpy(&header, bad.data(), sizeof(header));
+    header.codec = (uint32_t)BridgeCodec::BZ2;
+    header.raw_size = 0xFFFFFFFF;
+    memcpy(&bad[0], &header, sizeof(header));
+    REQUIRE_FALSE(batch.unpack(bad.data(), bad.size(), msgs));
+  }
+}
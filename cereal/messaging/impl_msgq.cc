@@ -25,14 +25,12 @@ static bool service_exists(std::string path){
   return false;
 }
 
+// Ring size from services.py, sized for the frequency and message size of the service
 static size_t get_size(std::string endpoint){
-  size_t sz = DEFAULT_SEGMENT_SIZE;
-
-  if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
-    sz *= 10;
+  for (const auto& it : services) {
+    if (it.name == endpoint) return it.segment_size;
   }
-
-  return sz;
+  return DEFAULT_SEGMENT_SIZE;
 }
 
 
@@ -69,6 +67,20 @@ MSGQMessage::~MSGQMessage() {
   this->close();
 }
 
+bool MSGQBorrowedMessage::release() {
+  bool intact = true;
+  if (size > 0){
+    msgq_msg_t msg = {size, data};
+    intact = msgq_msg_release(&msg, q) == 0;
+  }
+  size = 0;
+  return intact;
+}
+
+MSGQBorrowedMessage::~MSGQBorrowedMessage() {
+  this->close();
+}
+
 int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string address, bool conflate, bool check_endpoint){
   assert(context);
   assert(address == "127.0.0.1");
@@ -83,7 +95,10 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
     return r;
   }
 
-  msgq_init_subscriber(q);
+  r = msgq_init_subscriber(q);
+  if (r != 0){
+    return r;
+  }
 
   if (conflate){
     q->read_conflate = true;
@@ -95,7 +110,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+Message * MSGQSubSocket::receive(bool non_blocking, bool borrow){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -107,9 +122,10 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   msgq_msg_t msg;
 
-  MSGQMessage *r = NULL;
+  Message *r = NULL;
 
-  int rc = msgq_msg_recv(&msg, q);
+  auto recv = borrow ? msgq_msg_borrow : msgq_msg_recv;
+  int rc = recv(&msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -119,7 +135,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv(&msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -141,14 +157,18 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   if (rc > 0){
     if (msgq_do_exit){
-      msgq_msg_close(&msg); // Free unused message on exit
+      // Free unused message on exit
+      borrow ? msgq_msg_release(&msg, q) : msgq_msg_close(&msg);
+    } else if (borrow){
+      r = new MSGQBorrowedMessage(q, msg.data, msg.size);
     } else {
-      r = new MSGQMessage;
-      r->takeOwnership(msg.data, msg.size);
+      MSGQMessage *m = new MSGQMessage;
+      m->takeOwnership(msg.data, msg.size);
+      r = m;
     }
   }
 
-  return (Message*)r;
+  return r;
 }
 
 void MSGQSubSocket::setTimeout(int t){
@@ -196,6 +216,16 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs){
+  batch.resize(msgs.size());
+  for (size_t i = 0; i < msgs.size(); i++){
+    batch[i].data = (char*)msgs[i].begin();
+    batch[i].size = msgs[i].size();
+  }
+
+  return msgq_msg_send_batch(batch.data(), batch.size(), q);
+}
+
 MSGQPubSocket::~MSGQPubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
@@ -204,23 +234,28 @@ MSGQPubSocket::~MSGQPubSocket(){
 }
 
 
+MSGQPoller::MSGQPoller(){
+  msgq_poller_init(&poller);
+}
+
 void MSGQPoller::registerSocket(SubSocket * socket){
-  assert(num_polls + 1 < MAX_POLLERS);
-  polls[num_polls].q = (msgq_queue_t*)socket->getRawSocket();
+  assert(sockets.size() + 1 < MAX_POLLERS);
+  msgq_poller_add(&poller, (msgq_queue_t*)socket->getRawSocket());
 
   sockets.push_back(socket);
-  num_polls++;
 }
 
 std::vector<SubSocket*> MSGQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
 
-  msgq_poll(polls, num_polls, timeout);
-  for (size_t i = 0; i < num_polls; i++){
-    if (polls[i].revents){
-      r.push_back(sockets[i]);
-    }
+  msgq_poller_poll(&poller, ready, timeout);
+  for (int idx : ready){
+    r.push_back(sockets[idx]);
   }
 
   return r;
 }
+
+MSGQPoller::~MSGQPoller(){
+  msgq_poller_close(&poller);
+}
@@ -3,6 +3,7 @@
 #include "msgq.hpp"
 #include <zmq.h>
 #include <string>
+#include <cassert>
 
 #define MAX_POLLERS 128
 
@@ -29,36 +30,58 @@ public:
   ~MSGQMessage();
 };
 
+// Points directly into the msgq ring buffer, the lease is released on close
+class MSGQBorrowedMessage : public Message {
+private:
+  msgq_queue_t * q;
+  char * data;
+  size_t size;
+public:
+  MSGQBorrowedMessage(msgq_queue_t * q, char * data, size_t size) : q(q), data(data), size(size) {}
+  void init(size_t size) {assert(false);}
+  void init(char *data, size_t size) {assert(false);}
+  size_t getSize(){return size;}
+  char * getData(){return data;}
+  bool release();
+  void close() {release();}
+  ~MSGQBorrowedMessage();
+};
+
 class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  Message *receive(bool non_blocking, bool borrow);
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
-  Message *receive(bool non_blocking=false);
+  Message *receive(bool non_blocking=false) {return receive(non_blocking, false);}
+  Message *borrow(bool non_blocking=false) {return receive(non_blocking, true);}
   ~MSGQSubSocket();
 };
 
 class MSGQPubSocket : public PubSocket {
 private:
   msgq_queue_t * q = NULL;
+  std::vector<msgq_msg_t> batch;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs);
   ~MSGQPubSocket();
 };
 
 class MSGQPoller : public Poller {
 private:
   std::vector<SubSocket*> sockets;
-  msgq_pollitem_t polls[MAX_POLLERS];
-  size_t num_polls = 0;
+  msgq_poller_t poller;
+  std::vector<int> ready;
 
 public:
+  MSGQPoller();
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
-  ~MSGQPoller(){};
+  ~MSGQPoller();
 };
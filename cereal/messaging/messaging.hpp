@@ -1,6 +1,8 @@
 #pragma once
 #include <cstddef>
+#include <cstring>
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 #include <capnp/serialize.h>
@@ -28,6 +30,8 @@ public:
   virtual void close() = 0;
   virtual size_t getSize() = 0;
   virtual char * getData() = 0;
+  // Ends a borrow. Returns false if the data was overwritten while it was borrowed
+  virtual bool release() { return true; }
   virtual ~Message(){};
 };
 
@@ -37,6 +41,9 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Zero copy receive, the message may point into shared memory that the publisher keeps writing to.
+  // Only trust what was read from it if release() returns true. Release it before borrowing the next one.
+  virtual Message *borrow(bool non_blocking=false) { return receive(non_blocking); }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,6 +55,13 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Subscribers receive the batch as individual messages. Returns the number of messages sent, or -1 on error
+  virtual int sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs) {
+    for (size_t i = 0; i < msgs.size(); i++) {
+      if (send((char *)msgs[i].begin(), msgs[i].size()) < 0) return i > 0 ? (int)i : -1;
+    }
+    return msgs.size();
+  }
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
@@ -110,15 +124,79 @@ private:
   kj::Array<capnp::word> heapArray_;
 };
 
+// Builds every message into the same preallocated first segment, so a publisher that keeps one around
+// doesn't allocate once the segment has grown to fit its largest message.
+// initEvent starts a new message, anything obtained from the previous one must not be used anymore.
+class ReusableMessageBuilder {
+public:
+  ReusableMessageBuilder(size_t first_segment_words = 1024) { allocate(first_segment_words); }
+
+  capnp::MallocMessageBuilder &reset() {
+    size_t words = 0;
+    if (builder_) {
+      auto segments = builder_->getSegmentsForOutput();
+      for (auto &segment : segments) words += segment.size();
+      // The destructor zeroes the part of the first segment that was used
+      builder_.reset();
+    }
+    // Grow once a message didn't fit, so the next one is a single segment again
+    if (words > first_segment_.size() - 1) {
+      allocate(words);
+    }
+    builder_.emplace(first_segment_.slice(1, first_segment_.size()));
+    return *builder_;
+  }
+
+  cereal::Event::Builder initEvent(bool valid = true) {
+    cereal::Event::Builder event = reset().initRoot<cereal::Event>();
+    struct timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    event.setLogMonoTime(t.tv_sec * 1000000000ULL + t.tv_nsec);
+    event.setValid(valid);
+    return event;
+  }
+
+  // Serialized message. A single segment message is framed in place, without copying it
+  kj::ArrayPtr<capnp::byte> toBytes() {
+    auto segments = builder_->getSegmentsForOutput();
+    if (segments.size() == 1 && segments[0].begin() == first_segment_.begin() + 1) {
+      // Segment table: number of segments - 1, then the size of the segment in words
+      uint32_t *table = (uint32_t *)first_segment_.begin();
+      table[0] = 0;
+      table[1] = segments[0].size();
+      return first_segment_.slice(0, segments[0].size() + 1).asBytes();
+    }
+    flatArray_ = capnp::messageToFlatArray(segments);
+    return flatArray_.asBytes();
+  }
+
+private:
+  void allocate(size_t words) {
+    builder_.reset();
+    // one extra word in front for the segment table
+    first_segment_ = kj::heapArray<capnp::word>(words + 1);
+    memset(first_segment_.begin(), 0, first_segment_.size() * sizeof(capnp::word));
+  }
+
+  kj::Array<capnp::word> first_segment_;
+  std::optional<capnp::MallocMessageBuilder> builder_;
+  kj::Array<capnp::word> flatArray_;
+};
+
 class PubMaster {
 public:
   PubMaster(const std::initializer_list<const char *> &service_list);
-  inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
+  inline int send(const char *name, capnp::byte *data, size_t size) { return socket(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  int send(const char *name, ReusableMessageBuilder &msg);
+  int send(const char *name, kj::ArrayPtr<MessageBuilder> msgs);
   ~PubMaster();
 
 private:
-  std::map<std::string, PubSocket *> sockets_;
+  PubSocket *socket(const char *name);
+  // transparent comparator, so a lookup by name doesn't construct a std::string
+  std::map<std::string, PubSocket *, std::less<>> sockets_;
+  std::vector<kj::ArrayPtr<capnp::byte>> batch_;
 };
 
 class AlignedBuffer {
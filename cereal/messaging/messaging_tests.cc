@@ -0,0 +1,35 @@
+#include <cstring>
+
+#include "catch2/catch.hpp"
+#include "messaging.hpp"
+
+TEST_CASE("ReusableMessageBuilder grows to fit and frames messages in place"){
+  ReusableMessageBuilder msg(16);
+  MessageBuilder expected;
+
+  // The second message doesn't fit the first segment, the third one does after growing it
+  for (int num_msg : {1, 100, 100}) {
+    for (bool reusable : {true, false}) {
+      cereal::Event::Builder event = reusable ? msg.initEvent() : expected.initEvent();
+      event.setLogMonoTime(1234);
+      auto can = event.initCan(num_msg);
+      for (int i = 0; i < num_msg; i++) {
+        can[i].setAddress(i);
+        can[i].setDat(kj::arrayPtr((uint8_t*)&i, sizeof(i)));
+      }
+    }
+
+    auto bytes = msg.toBytes();
+    capnp::FlatArrayMessageReader reader(kj::arrayPtr((const capnp::word *)bytes.begin(), bytes.size() / sizeof(capnp::word)));
+    auto event = reader.getRoot<cereal::Event>();
+    REQUIRE(event.getLogMonoTime() == 1234);
+    REQUIRE(event.getCan().size() == num_msg);
+    REQUIRE(event.getCan()[num_msg - 1].getAddress() == num_msg - 1);
+  }
+
+  // Single segment, same as messageToFlatArray
+  auto bytes = msg.toBytes();
+  auto expected_bytes = expected.toBytes();
+  REQUIRE(bytes.size() == expected_bytes.size());
+  REQUIRE(memcmp(bytes.begin(), expected_bytes.begin(), bytes.size()) == 0);
+}
@@ -7,6 +7,7 @@
 #include <chrono>
 #include <algorithm>
 #include <cstdlib>
+#include <climits>
 #include <csignal>
 #include <random>
 
@@ -19,26 +20,97 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.hpp"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
+static uint32_t msgq_get_tid(void){
+  #ifdef __APPLE__
+    // TODO: this doesn't work
+    return getpid();
+  #else
+    return syscall(SYS_gettid);
+  #endif
 }
 
 uint64_t msgq_get_uid(void){
   std::random_device rd("/dev/urandom");
   std::uniform_int_distribution<uint64_t> distribution(0,std::numeric_limits<uint32_t>::max());
 
-  #ifdef __APPLE__
-    // TODO: this doesn't work
-    uint64_t uid = distribution(rd) << 32 | getpid();
+  uint64_t uid = distribution(rd) << 32 | msgq_get_tid();
+  return uid;
+}
+
+static uint64_t msgq_nanos_monotonic(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static msgq_wakeup_t * msgq_wakeup_table(void){
+  // Shared by all processes, mapped once per process
+  static msgq_wakeup_t * table = [](){
+    const char * path = "/dev/shm/msgq_wakeup";
+    const size_t size = NUM_WAKEUP_SLOTS * sizeof(msgq_wakeup_t);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0777);
+    assert(fd >= 0);
+
+    int rc = ftruncate(fd, size);
+    assert(rc == 0);
+
+    void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(mem != MAP_FAILED);
+
+    return (msgq_wakeup_t *)mem;
+  }();
+
+  return table;
+}
+
+static msgq_wakeup_t * msgq_wakeup_slot(uint32_t tid){
+  return &msgq_wakeup_table()[tid % NUM_WAKEUP_SLOTS];
+}
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, struct timespec *ts){
+  #ifdef __linux__
+    // Returns immediately if *addr != val, so a wakeup between reading val and sleeping is never lost
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, ts, NULL, 0);
   #else
-    uint64_t uid = distribution(rd) << 32 | syscall(SYS_gettid);
+    struct timespec max_ts = {0, 1000 * 1000};
+    nanosleep((ts->tv_sec > 0 || ts->tv_nsec > max_ts.tv_nsec) ? &max_ts : ts, NULL);
   #endif
+}
 
-  return uid;
+static void futex_wake(std::atomic<uint32_t> *addr){
+  #ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  #endif
+}
+
+static void thread_wakeup(uint32_t tid, uint64_t poll_bit) {
+  msgq_wakeup_t *w = msgq_wakeup_slot(tid);
+  std::atomic<uint32_t> *seq = reinterpret_cast<std::atomic<uint32_t>*>(&w->seq);
+  std::atomic<uint32_t> *num_waiters = reinterpret_cast<std::atomic<uint32_t>*>(&w->num_waiters);
+  std::atomic<uint32_t> *owner_tid = reinterpret_cast<std::atomic<uint32_t>*>(&w->owner_tid);
+
+  // Mark the queue in the ready set before bumping seq, the poller reads seq before collecting the ready set
+  if (poll_bit != 0 && *owner_tid == tid){
+    uint64_t bit = poll_bit - 1;
+    reinterpret_cast<std::atomic<uint64_t>*>(&w->ready[bit / 64])->fetch_or(1ULL << (bit % 64));
+  }
+
+  seq->fetch_add(1);
+
+  // Only pay for the syscall if somebody is blocked on this slot
+  if (*num_waiters > 0){
+    futex_wake(seq);
+  }
 }
 
 int msgq_msg_init_size(msgq_msg_t * msg, size_t size){
@@ -69,8 +141,8 @@ int msgq_msg_close(msgq_msg_t * msg){
 
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
-  q->read_valids[id]->store(true);
-  q->read_pointers[id]->store(*q->write_pointer);
+  q->read_valids[id].store(true);
+  q->read_pointers[id].store(*q->write_pointer);
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -82,9 +154,11 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
+  assert(max_readers > 0 && max_readers < 0xFFFFFFFF);
+  msgq_wakeup_table();
+  q->mmap_p = NULL;
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -99,35 +173,58 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+  size_t header_size = ALIGN(MSGQ_HEADER_SIZE(max_readers));
+
+  int rc = ftruncate(fd, size + header_size);
   if (rc < 0){
     close(fd);
     return -1;
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, size + header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
-  if (mem == NULL){
+  if (mem == MAP_FAILED){
     return -1;
   }
-  q->mmap_p = mem;
 
   msgq_header_t *header = (msgq_header_t *)mem;
 
+  // The first one to open the queue decides the size of the reader table,
+  // everybody else needs to agree on the layout
+  uint64_t expected_readers = 0;
+  std::atomic<uint64_t> *header_max_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_readers);
+  if (!header_max_readers->compare_exchange_strong(expected_readers, max_readers) && expected_readers != max_readers){
+    std::cout << "Error, " << path << " was created with " << expected_readers << " reader slots, expected " << max_readers << std::endl;
+    munmap(mem, size + header_size);
+    return -1;
+  }
+
+  q->mmap_p = mem;
+
   // Setup pointers to header segment
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+  q->free_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->free_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
-
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
-  }
-
-  q->data = mem + sizeof(msgq_header_t);
+  q->write_seq = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_seq);
+
+  std::atomic<uint64_t> *reader_table = reinterpret_cast<std::atomic<uint64_t>*>(mem + sizeof(msgq_header_t));
+  q->read_pointers = reader_table;
+  q->read_valids = reader_table + max_readers;
+  q->read_uids = reader_table + 2 * max_readers;
+  q->read_next_free = reader_table + 3 * max_readers;
+  q->read_leases = reader_table + 4 * max_readers;
+  q->read_poll_bits = reader_table + 5 * max_readers;
+  q->read_stats = reinterpret_cast<msgq_reader_stats_t*>(mem + MSGQ_READER_STATS_OFFSET(max_readers));
+
+  q->data = mem + header_size;
   q->size = size;
+  q->header_size = header_size;
+  q->max_readers = max_readers;
   q->reader_id = -1;
+  q->read_lease_local = 0;
+  q->read_poll_bit_local = 0;
+  q->read_seq_local = 0;
 
   q->endpoint = path;
   q->read_conflate = false;
@@ -135,9 +232,35 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   return 0;
 }
 
+static void msgq_release_reader(msgq_queue_t *q){
+  int id = q->reader_id;
+
+  // Slot was already taken away by a publisher reset
+  uint64_t uid = q->read_uid_local;
+  if (!q->read_uids[id].compare_exchange_strong(uid, 0)){
+    return;
+  }
+  q->read_valids[id] = false;
+  q->read_leases[id] = 0;
+  q->read_poll_bits[id] = 0;
+  q->read_lease_local = 0;
+  q->read_stats[id].uid = 0;
+
+  // Push slot on the free list. The tag in the upper half protects against ABA
+  uint64_t head = *q->free_readers;
+  uint64_t new_head;
+  do {
+    q->read_next_free[id] = head & 0xFFFFFFFF;
+    PACK64(new_head, ((head >> 32) + 1), (id + 1));
+  } while (!q->free_readers->compare_exchange_weak(head, new_head));
+}
+
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    if (q->reader_id >= 0){
+      msgq_release_reader(q);
+    }
+    munmap(q->mmap_p, q->size + q->header_size);
   }
 }
 
@@ -148,93 +271,139 @@ void msgq_init_publisher(msgq_queue_t * q) {
 
   *q->write_uid = uid;
   *q->num_readers = 0;
+  *q->free_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    *q->read_valids[i] = false;
-    *q->read_uids[i] = 0;
+  for (size_t i = 0; i < q->max_readers; i++){
+    q->read_valids[i] = false;
+    q->read_uids[i] = 0;
+    q->read_leases[i] = 0;
+    q->read_poll_bits[i] = 0;
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
+static bool thread_alive(uint32_t tid) {
+  // kill accepts thread ids on linux
+  return kill(tid, 0) == 0 || errno != ESRCH;
+}
+
+static int msgq_claim_reader(msgq_queue_t * q, uint64_t uid) {
+  // Reuse a released slot
+  uint64_t head = *q->free_readers;
+  while ((head & 0xFFFFFFFF) != 0){
+    uint32_t id = (head & 0xFFFFFFFF) - 1;
+    uint64_t new_head;
+    PACK64(new_head, ((head >> 32) + 1), q->read_next_free[id]);
+    if (q->free_readers->compare_exchange_weak(head, new_head)){
+      q->read_uids[id] = uid;
+      return id;
+    }
+  }
+
+  // Take a slot that was never used before.
+  // Use atomic compare and swap to handle race condition
+  // where two subscribers start at the same time
+  uint64_t cur_num_readers = *q->num_readers;
+  while (cur_num_readers < q->max_readers){
+    if (q->num_readers->compare_exchange_weak(cur_num_readers, cur_num_readers + 1)){
+      q->read_uids[cur_num_readers] = uid;
+      return cur_num_readers;
+    }
+  }
+
+  // Table is full, take over a slot from a reader that died without closing the queue
+  for (size_t i = 0; i < q->max_readers; i++){
+    uint64_t old_uid = q->read_uids[i];
+    if (old_uid != 0 && !thread_alive(old_uid & 0xFFFFFFFF) && q->read_uids[i].compare_exchange_strong(old_uid, uid)){
+      return i;
+    }
+  }
+
+  return -1;
 }
 
-void msgq_init_subscriber(msgq_queue_t * q) {
+int msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
 
   uint64_t uid = msgq_get_uid();
 
   // Get reader id
-  while (true){
-    uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
+  int id = msgq_claim_reader(q, uid);
+  if (id < 0){
+    std::cout << "Error, all " << q->max_readers << " reader slots of " << q->endpoint << " are in use" << std::endl;
+    errno = ENOSPC;
+    return -1;
+  }
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
-      std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
+  q->reader_id = id;
+  q->read_uid_local = uid;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
+  // We start with read_valid = false,
+  // on the first read the read pointer will be synchronized with the write pointer
+  q->read_valids[id] = false;
+  q->read_pointers[id] = 0;
+  q->read_leases[id] = 0;
+  q->read_lease_local = 0;
 
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
+  // Keep notifying the poller this queue was added to when the reader reconnects
+  q->read_poll_bits[id] = q->read_poll_bit_local;
 
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
-      }
+  memset(&q->read_stats[id], 0, sizeof(msgq_reader_stats_t));
+  q->read_stats[id].uid = uid;
 
-      continue;
-    }
+  //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
+  msgq_reset_reader(q);
+  return 0;
+}
 
-    // Use atomic compare and swap to handle race condition
-    // where two subscribers start at the same time
-    if (std::atomic_compare_exchange_strong(q->num_readers,
-                                            &cur_num_readers,
-                                            new_num_readers)){
-      q->reader_id = cur_num_readers;
-      q->read_uid_local = uid;
-
-      // We start with read_valid = false,
-      // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
-      break;
+static void msgq_break_leases(msgq_queue_t *q, uint64_t num_readers, uint32_t write_cycles, uint64_t start, uint64_t end){
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint64_t lease = q->read_leases[i];
+    if (lease == 0) continue;
+
+    uint32_t lease_cycles, lease_pointer;
+    UNPACK64(lease_cycles, lease_pointer, lease);
+    lease_pointer &= ~1;
+
+    if ((lease_pointer < start) || (lease_pointer >= end) || (lease_cycles == write_cycles)) continue;
+
+    // Never wait for a reader, take the message back. The reader finds out when releasing
+    if (q->read_leases[i].compare_exchange_strong(lease, 0)){
+      q->read_valids[i] = false;
     }
   }
-
-  //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
-  msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+static bool msgq_check_publisher(msgq_queue_t *q){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
     errno = EADDRINUSE;
-    return -1;
+    return false;
   }
+  return true;
+}
+
+static void msgq_notify_readers(msgq_queue_t *q, uint64_t num_readers){
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint64_t reader_uid = q->read_uids[i];
+    if (reader_uid != 0){
+      thread_wakeup(reader_uid & 0xFFFFFFFF, q->read_poll_bits[i]);
+    }
+  }
+}
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+// Writes the message into the ring at the local write pointer, without publishing it to the readers.
+// The shared write pointer is only updated when wrapping around.
+static void msgq_msg_write(msgq_msg_t *msg, msgq_queue_t *q, uint64_t num_readers, uint64_t publish_ns, uint32_t &write_cycles, uint32_t &write_pointer){
+  uint64_t total_msg_size = ALIGN(msg->size + sizeof(msgq_msg_header_t));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
   assert(3 * total_msg_size <= q->size);
 
-  uint64_t num_readers = *q->num_readers;
-
-  uint32_t write_cycles, write_pointer;
-  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
-
   char *p = q->data + write_pointer; // add base offset
 
   // Check remaining space
@@ -247,12 +416,12 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     // Invalidate all readers that are beyond the write pointer
     // TODO: should we handle the case where a new reader shows up while this is running?
     for (uint64_t i = 0; i < num_readers; i++){
-      uint64_t read_pointer = *q->read_pointers[i];
+      uint64_t read_pointer = q->read_pointers[i];
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
       if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
+        q->read_valids[i] = false;
       }
     }
 
@@ -267,59 +436,133 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = ALIGN(start + sizeof(msgq_msg_header_t) + msg->size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
-    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+    UNPACK64(read_cycles, read_pointer, q->read_pointers[i]);
 
     if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+      q->read_valids[i] = false;
     }
   }
 
+  // Borrowed messages in the way are overwritten, their readers see a broken lease
+  msgq_break_leases(q, num_readers, write_cycles, start, end);
 
-  // Write size tag
-  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+  // Write size tag and header
+  msgq_msg_header_t *header = (msgq_msg_header_t *)p;
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(&header->size);
   *size_p = msg->size;
+  header->seq = *q->write_seq + 1;
+  header->publish_ns = publish_ns;
+  *q->write_seq = header->seq;
 
   // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+  memcpy(p + sizeof(msgq_msg_header_t), msg->data, msg->size);
   __sync_synchronize();
 
+  write_pointer = ALIGN(write_pointer + msg->size + sizeof(msgq_msg_header_t));
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)) return -1;
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  msgq_msg_write(msg, q, num_readers, msgq_nanos_monotonic(), write_cycles, write_pointer);
+
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
-  PACK64(*q->write_pointer, write_cycles, new_ptr);
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
 
-  // Notify readers
-  for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
-  }
+  msgq_notify_readers(q, num_readers);
 
   return msg->size;
 }
 
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t num_msgs, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)) return -1;
+  if (num_msgs == 0) return 0;
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  uint64_t publish_ns = msgq_nanos_monotonic();
+  uint64_t pending = 0;
+  for (size_t i = 0; i < num_msgs; i++){
+    // A message takes at most its own size plus the end of the ring it skips when wrapping around.
+    // Publish what was written so far before the batch could overwrite its own start
+    uint64_t max_used = 2 * ALIGN(msgs[i].size + sizeof(msgq_msg_header_t)) + sizeof(int64_t);
+    if (pending + max_used > q->size){
+      PACK64(*q->write_pointer, write_cycles, write_pointer);
+      msgq_notify_readers(q, num_readers);
+      pending = 0;
+    }
+    pending += max_used;
+
+    msgq_msg_write(&msgs[i], q, num_readers, publish_ns, write_cycles, write_pointer);
+  }
+
+  // Publish the whole batch at once
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
+
+  msgq_notify_readers(q, num_readers);
+
+  return num_msgs;
+}
+
+
+static void msgq_reader_overrun(msgq_queue_t *q){
+  // The publisher invalidated the reader, everything up to the write pointer is skipped.
+  // The lost messages show up as a gap in the sequence numbers on the next read
+  q->read_stats[q->reader_id].overruns++;
+  msgq_reset_reader(q);
+}
+
+static void msgq_update_read_stats(msgq_queue_t *q, uint64_t seq, uint64_t publish_ns){
+  msgq_reader_stats_t *stats = &q->read_stats[q->reader_id];
+
+  // A publisher restart can't go backwards in seq, so anything else is a new reader or garbage from an overrun
+  if (q->read_seq_local != 0 && seq > q->read_seq_local + 1){
+    stats->dropped += seq - q->read_seq_local - 1;
+  }
+  q->read_seq_local = seq;
+  stats->received++;
+
+  uint64_t now = msgq_nanos_monotonic();
+  uint64_t latency_ns = now > publish_ns ? now - publish_ns : 0;
+  stats->latency_sum_ns += latency_ns;
+  stats->latency_max_ns = std::max(stats->latency_max_ns, latency_ns);
+
+  uint64_t us = latency_ns / 1000;
+  int bucket = (us < 2) ? 0 : std::min(63 - __builtin_clzll(us), MSGQ_LATENCY_BUCKETS - 1);
+  stats->latency_hist[bucket]++;
+}
 
 int msgq_msg_ready(msgq_queue_t * q){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
-  if (q->read_uid_local != *q->read_uids[id]){
+  if (q->read_uid_local != q->read_uids[id]){
     std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    if (msgq_init_subscriber(q) < 0) return 0;
     goto start;
   }
 
   // Check valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->read_valids[id]){
+    msgq_reader_overrun(q);
     goto start;
   }
 
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, q->read_pointers[id]);
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -328,25 +571,25 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+static int msgq_msg_read(msgq_msg_t * msg, msgq_queue_t * q, bool borrow){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
-  if (q->read_uid_local != *q->read_uids[id]){
+  if (q->read_uid_local != q->read_uids[id]){
     std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    if (msgq_init_subscriber(q) < 0) return -1;
     goto start;
   }
 
   // Check valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->read_valids[id]){
+    msgq_reader_overrun(q);
     goto start;
   }
 
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, q->read_pointers[id]);
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -364,15 +607,15 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   std::int64_t size = *size_p;
 
   // Check if the size that was read is valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->read_valids[id]){
+    msgq_reader_overrun(q);
     goto start;
   }
 
   // If size is -1 the buffer was full, and we need to wrap around
   if (size == -1){
     read_cycles++;
-    PACK64(*q->read_pointers[id], read_cycles, 0);
+    PACK64(q->read_pointers[id], read_cycles, 0);
     goto start;
   }
 
@@ -381,74 +624,319 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   assert((uint64_t)size < q->size);
   assert(size > 0);
 
-  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(msgq_msg_header_t) + size);
+  msgq_msg_header_t *header = (msgq_msg_header_t *)p;
 
   // If conflate is true, check if this is the latest message, else start over
   if (q->read_conflate){
     if (new_read_pointer != write_pointer){
+      q->read_stats[id].conflated++;
+      q->read_seq_local = header->seq;
+
       // Update read pointer
-      PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      PACK64(q->read_pointers[id], read_cycles, new_read_pointer);
       goto start;
     }
   }
 
+  if (borrow){
+    uint64_t lease;
+    PACK64(lease, read_cycles, (read_pointer | 1));
+
+    // A lease on an older message also holds the publisher back from this one,
+    // move it over in one step so there is no gap in protection
+    uint64_t prev_lease = q->read_lease_local;
+    if (prev_lease != 0){
+      if (!q->read_valids[id]){
+        msgq_reader_overrun(q);
+        goto start;
+      }
+      if (!q->read_leases[id].compare_exchange_strong(prev_lease, lease)){
+        prev_lease = 0; // Publisher broke the old lease, take a new one below
+      }
+    }
+
+    if (prev_lease == 0){
+      // Take lease before validating, the publisher checks leases after invalidating readers
+      q->read_leases[id] = lease;
+      if (!q->read_valids[id]){
+        q->read_leases[id].compare_exchange_strong(lease, 0);
+        q->read_lease_local = 0;
+        msgq_reader_overrun(q);
+        goto start;
+      }
+    }
+
+    q->read_lease_local = lease;
+    msg->size = size;
+    msg->data = p + sizeof(msgq_msg_header_t);
+    msgq_update_read_stats(q, header->seq, header->publish_ns);
+
+    // Update read pointer
+    PACK64(q->read_pointers[id], read_cycles, new_read_pointer);
+    return msg->size;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
 
   __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
+  uint64_t seq = header->seq, publish_ns = header->publish_ns;
+  memcpy(msg->data, p + sizeof(msgq_msg_header_t), size);
   __sync_synchronize();
 
   // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  PACK64(q->read_pointers[id], read_cycles, new_read_pointer);
 
   // Check if the actual data that was copied is valid
-  if (!*q->read_valids[id]){
+  if (!q->read_valids[id]){
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
-
+  msgq_update_read_stats(q, seq, publish_ns);
   return msg->size;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_read(msg, q, false);
+}
+
+int msgq_msg_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_read(msg, q, true);
+}
+
+int msgq_msg_release(msgq_msg_t * msg, msgq_queue_t * q){
+  uint64_t lease = q->read_lease_local;
+  uint32_t lease_pointer = (lease & 0xFFFFFFFF) & ~1;
+
+  // Lease was already broken, or moved to a newer message and nothing protected this one since
+  if (lease == 0 || q->data + lease_pointer + sizeof(msgq_msg_header_t) != msg->data) return -1;
+
+  q->read_lease_local = 0;
+  return q->read_leases[q->reader_id].compare_exchange_strong(lease, 0) ? 0 : -1;
+}
+
 
 
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
   int num = 0;
 
-  // Check if messages ready
-  for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
-  }
+  // Publishers bump the futex word of every reader thread after writing,
+  // register as a waiter so they know to issue the wakeup syscall
+  msgq_wakeup_t *w = msgq_wakeup_slot(msgq_get_tid());
+  std::atomic<uint32_t> *seq = reinterpret_cast<std::atomic<uint32_t>*>(&w->seq);
+  std::atomic<uint32_t> *num_waiters = reinterpret_cast<std::atomic<uint32_t>*>(&w->num_waiters);
+  num_waiters->fetch_add(1);
 
   int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
-
+  uint64_t deadline = msgq_nanos_monotonic() + ms * 1000000ULL;
 
-  while (num == 0) {
-    int ret;
-
-    ret = nanosleep(&ts, &ts);
+  while (true) {
+    // Read sequence number before checking, so a message sent in between is not missed
+    uint32_t cur_seq = *seq;
 
     // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
-      }
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    if (num > 0) {
       break;
     }
+
+    // Without a timeout keep waiting in 100 ms chunks
+    uint64_t now = msgq_nanos_monotonic();
+    if (now >= deadline) {
+      if (timeout != -1) {
+        break;
+      }
+      deadline = now + ms * 1000000ULL;
+    }
+
+    uint64_t remaining = deadline - now;
+    struct timespec ts;
+    ts.tv_sec = remaining / 1000000000ULL;
+    ts.tv_nsec = remaining % 1000000000ULL;
+
+    futex_wait(seq, cur_seq, &ts);
   }
 
+  num_waiters->fetch_sub(1);
   return num;
 }
+
+// Ready bits handed out to the pollers of this thread
+static thread_local uint64_t poll_bits_used[MSGQ_POLL_READY_BITS / 64];
+static thread_local int num_pollers = 0;
+
+void msgq_poller_init(msgq_poller_t *p){
+  p->tid = msgq_get_tid();
+  p->w = msgq_wakeup_slot(p->tid);
+  p->owner = false;
+  p->last_full_scan = msgq_nanos_monotonic();
+  p->bit_items.assign(MSGQ_POLL_READY_BITS, -1);
+  memset(p->mask, 0, sizeof(p->mask));
+
+  // Claim the ready set of the wakeup slot, unless a live thread with a colliding tid already uses it
+  std::atomic<uint32_t> *owner_tid = reinterpret_cast<std::atomic<uint32_t>*>(&p->w->owner_tid);
+  uint32_t cur = *owner_tid;
+  while (cur != p->tid && (cur == 0 || !thread_alive(cur))){
+    if (owner_tid->compare_exchange_weak(cur, p->tid)){
+      for (auto &word : p->w->ready){
+        reinterpret_cast<std::atomic<uint64_t>*>(&word)->store(0);
+      }
+      memset(poll_bits_used, 0, sizeof(poll_bits_used));
+      break;
+    }
+  }
+  p->owner = (*owner_tid == p->tid);
+  num_pollers++;
+}
+
+void msgq_poller_close(msgq_poller_t *p){
+  for (size_t i = 0; i < MSGQ_POLL_READY_BITS / 64; i++){
+    poll_bits_used[i] &= ~p->mask[i];
+  }
+  memset(p->mask, 0, sizeof(p->mask));
+
+  if (--num_pollers == 0 && p->owner){
+    uint32_t tid = p->tid;
+    reinterpret_cast<std::atomic<uint32_t>*>(&p->w->owner_tid)->compare_exchange_strong(tid, 0);
+  }
+
+  p->items.clear();
+  p->bits.clear();
+  p->scanned.clear();
+  p->pending.clear();
+}
+
+int msgq_poller_add(msgq_poller_t *p, msgq_queue_t *q){
+  assert(q->reader_id >= 0); // Make sure subscriber is initialized
+  int idx = p->items.size();
+
+  // Publishers wake up the thread that subscribed, only that thread can use the ready set
+  int bit = -1;
+  if (p->owner && (q->read_uid_local & 0xFFFFFFFF) == p->tid){
+    for (int b = 0; b < MSGQ_POLL_READY_BITS; b++){
+      if ((poll_bits_used[b / 64] & (1ULL << (b % 64))) == 0){
+        bit = b;
+        break;
+      }
+    }
+  }
+
+  p->items.push_back(q);
+  p->bits.push_back(bit);
+  p->checked.push_back(false);
+
+  if (bit >= 0){
+    poll_bits_used[bit / 64] |= 1ULL << (bit % 64);
+    p->mask[bit / 64] |= 1ULL << (bit % 64);
+    p->bit_items[bit] = idx;
+
+    q->read_poll_bit_local = bit + 1;
+    q->read_poll_bits[q->reader_id] = bit + 1;
+  } else {
+    p->scanned.push_back(idx);
+  }
+
+  // A message may have been sent before the bit was registered
+  p->pending.push_back(idx);
+  return idx;
+}
+
+static void msgq_poller_collect(msgq_poller_t *p, bool full_scan, std::vector<int> &ready){
+  std::vector<int> &candidates = p->candidates;
+  candidates.clear();
+
+  if (full_scan){
+    for (size_t i = 0; i < p->items.size(); i++){
+      candidates.push_back(i);
+    }
+  } else {
+    // Level triggered: items that were ready last time are reported again until they are drained
+    candidates.insert(candidates.end(), p->pending.begin(), p->pending.end());
+    candidates.insert(candidates.end(), p->scanned.begin(), p->scanned.end());
+
+    if (p->owner){
+      for (size_t i = 0; i < MSGQ_POLL_READY_BITS / 64; i++){
+        if (p->mask[i] == 0) continue;
+
+        std::atomic<uint64_t> *word = reinterpret_cast<std::atomic<uint64_t>*>(&p->w->ready[i]);
+        uint64_t bits = word->fetch_and(~p->mask[i]) & p->mask[i];
+        while (bits){
+          int b = __builtin_ctzll(bits);
+          bits &= bits - 1;
+          candidates.push_back(p->bit_items[i * 64 + b]);
+        }
+      }
+    }
+  }
+
+  for (int idx : candidates){
+    if (p->checked[idx]) continue;
+    p->checked[idx] = true;
+    if (msgq_msg_ready(p->items[idx])){
+      ready.push_back(idx);
+    }
+  }
+  for (int idx : candidates){
+    p->checked[idx] = false;
+  }
+
+  // Report in registration order, like msgq_poll
+  std::sort(ready.begin(), ready.end());
+}
+
+int msgq_poller_poll(msgq_poller_t *p, std::vector<int> &ready, int timeout){
+  ready.clear();
+
+  std::atomic<uint32_t> *seq = reinterpret_cast<std::atomic<uint32_t>*>(&p->w->seq);
+  std::atomic<uint32_t> *num_waiters = reinterpret_cast<std::atomic<uint32_t>*>(&p->w->num_waiters);
+  num_waiters->fetch_add(1);
+
+  int ms = (timeout == -1) ? 100 : timeout;
+  uint64_t deadline = msgq_nanos_monotonic() + ms * 1000000ULL;
+  bool full_scan = false;
+
+  while (true) {
+    // Read sequence number before collecting the ready set, so a message sent in between is not missed
+    uint32_t cur_seq = *seq;
+
+    msgq_poller_collect(p, full_scan, ready);
+    if (!ready.empty()) {
+      break;
+    }
+
+    uint64_t now = msgq_nanos_monotonic();
+    if (now >= deadline) {
+      // Readers evicted by a publisher restart get no wakeups until they reconnect,
+      // so look at every item once in a while before giving up
+      if (!full_scan && now - p->last_full_scan >= 100 * 1000000ULL) {
+        full_scan = true;
+        p->last_full_scan = now;
+        continue;
+      }
+      if (timeout != -1) {
+        break;
+      }
+      deadline = now + ms * 1000000ULL;
+    }
+    full_scan = false;
+
+    uint64_t remaining = deadline - now;
+    struct timespec ts;
+    ts.tv_sec = remaining / 1000000000ULL;
+    ts.tv_nsec = remaining % 1000000000ULL;
+
+    futex_wait(seq, cur_seq, &ts);
+  }
+
+  num_waiters->fetch_sub(1);
+  p->pending = ready;
+  return ready.size();
+}
@@ -3,35 +3,90 @@
 #include <cstring>
 #include <string>
 #include <atomic>
+#include <vector>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 8
+#define DEFAULT_NUM_READERS 64
+#define NUM_WAKEUP_SLOTS 1024
+#define MSGQ_POLL_READY_BITS 256
+#define MSGQ_LATENCY_BUCKETS 16
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
-#define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
-#define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
+#define UNPACK64(higher, lower, input) do {uint64_t tmp = (input); higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
+#define PACK64(output, higher, lower) output = ((uint64_t)(higher) << 32 ) | ((uint64_t)(lower) & 0xFFFFFFFF)
 
+// The header is followed by the reader table, sized when the queue is created:
+// uint64_t read_pointers[max_readers], read_valids[max_readers],
+//          read_uids[max_readers], read_next_free[max_readers],
+//          read_leases[max_readers], read_poll_bits[max_readers]
+// msgq_reader_stats_t read_stats[max_readers]
 struct  msgq_header_t {
-  uint64_t num_readers;
+  uint64_t num_readers; // High water mark of claimed reader slots
+  uint64_t max_readers;
+  uint64_t free_readers; // Head of released slots list, (tag << 32) | (slot + 1)
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t write_seq; // Sequence number of the last message, kept across publisher restarts
+};
+
+// Written only by the reader owning the slot, read by tools like msgq_top
+struct msgq_reader_stats_t {
+  uint64_t uid;          // read_uids of the reader these stats belong to
+  uint64_t received;
+  uint64_t dropped;      // messages the reader never saw, from gaps in the sequence numbers
+  uint64_t overruns;     // times the publisher lapped the reader and it had to skip ahead
+  uint64_t conflated;    // messages skipped by a conflating reader
+  uint64_t latency_sum_ns;
+  uint64_t latency_max_ns;
+  uint64_t latency_hist[MSGQ_LATENCY_BUCKETS]; // publish to receive, bucket i counts [2^i, 2^(i+1)) us
+};
+
+#define MSGQ_READER_STATS_OFFSET(max_readers) (sizeof(msgq_header_t) + 6 * (max_readers) * sizeof(uint64_t))
+#define MSGQ_HEADER_SIZE(max_readers) (MSGQ_READER_STATS_OFFSET(max_readers) + (max_readers) * sizeof(msgq_reader_stats_t))
+
+// Every message in the ring starts with this, followed by the data
+struct msgq_msg_header_t {
+  int64_t size; // -1 is a wraparound tag
+  uint64_t seq;
+  uint64_t publish_ns; // CLOCK_MONOTONIC
+};
+
+// Futex words used to wake up readers blocked in msgq_poll.
+// Indexed by the tid of the polling thread, so a single wait covers all queues it polls.
+// Collisions between threads only cause spurious wakeups.
+// The thread owning the slot can also get a ready set: publishers set the bit the reader registered
+// in read_poll_bits, so a msgq_poller_t only has to look at the queues that were written to.
+struct msgq_wakeup_t {
+  uint32_t seq;
+  uint32_t num_waiters;
+  uint32_t owner_tid; // 0 if no poller claimed the ready set
+  uint32_t reserved;
+  uint64_t ready[MSGQ_POLL_READY_BITS / 64];
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
+  std::atomic<uint64_t> *free_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *write_seq;
+  std::atomic<uint64_t> *read_pointers;
+  std::atomic<uint64_t> *read_valids;
+  std::atomic<uint64_t> *read_uids;
+  std::atomic<uint64_t> *read_next_free;
+  std::atomic<uint64_t> *read_leases;
+  std::atomic<uint64_t> *read_poll_bits; // ready bit + 1 of the reader's poller, 0 if none
+  msgq_reader_stats_t *read_stats;
   char * mmap_p;
   char * data;
   size_t size;
+  size_t header_size;
+  size_t max_readers;
   int reader_id;
   uint64_t read_uid_local;
+  uint64_t read_lease_local;
+  uint64_t read_poll_bit_local;
+  uint64_t read_seq_local; // Sequence number of the last message read, 0 before the first one
   uint64_t write_uid_local;
 
   bool read_conflate;
@@ -48,6 +103,25 @@ struct msgq_pollitem_t {
   int revents;
 };
 
+// Readiness based poller. Publishing to a queue only marks that queue in the ready set of the polling thread,
+// so a wakeup costs O(#ready) instead of O(#items). Must be used from the thread that subscribed to the queues.
+// Items that don't get a ready bit (more than MSGQ_POLL_READY_BITS per thread, or the wakeup slot is owned by
+// another thread) are checked on every poll like msgq_poll does. A queue can only be added to one poller.
+struct msgq_poller_t {
+  msgq_wakeup_t *w;
+  uint32_t tid;
+  bool owner;                    // this thread owns the ready set of w
+  uint64_t last_full_scan;
+  std::vector<msgq_queue_t*> items;
+  std::vector<int> bits;         // ready bit of items[i], -1 if it has to be scanned
+  std::vector<int> bit_items;    // item of every ready bit, -1 if unused
+  std::vector<int> scanned;      // items without a ready bit
+  std::vector<int> pending;      // items that were ready on the previous poll
+  std::vector<int> candidates;
+  std::vector<uint8_t> checked;
+  uint64_t mask[MSGQ_POLL_READY_BITS / 64];
+};
+
 void msgq_wait_for_subscriber(msgq_queue_t *q);
 void msgq_reset_reader(msgq_queue_t *q);
 
@@ -55,12 +129,30 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers = DEFAULT_NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
-void msgq_init_subscriber(msgq_queue_t * q);
+int msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+// Writes all messages before publishing them with a single write pointer update and reader wakeup.
+// A batch that doesn't fit in the ring is published in parts. Returns the number of messages sent, or -1 on error
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t num_msgs, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+
+// Like msgq_msg_recv, but msg->data points directly into the queue. Don't call msgq_msg_close on it.
+// The publisher never waits for borrowers, when the ring wraps around to the message it breaks the lease
+// and overwrites it. Anything read from msg->data is only trustworthy if msgq_msg_release returns 0.
+// Borrowing a newer message ends the lease of the previous one, release it first.
+int msgq_msg_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+// Returns 0 if the lease was intact, -1 if the publisher took the message back or it isn't the last borrowed one
+int msgq_msg_release(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
+
+void msgq_poller_init(msgq_poller_t *p);
+void msgq_poller_close(msgq_poller_t *p);
+// Returns the index of the item
+int msgq_poller_add(msgq_poller_t *p, msgq_queue_t *q);
+// Fills ready with the indices of the items that have a message, returns the number of ready items
+int msgq_poller_poll(msgq_poller_t *p, std::vector<int> &ready, int timeout);
@@ -0,0 +1,334 @@
+// Compares reader wakeup latency and throughput of the futex based msgq_poll
+// with the previous SIGUSR2 based wakeups (tkill from the publisher, nanosleep in the reader),
+// and the cost of copying receives against borrowing messages from the queue.
+// Also compares msgq_poll scanning all items against the ready set of msgq_poller_t with POLL_SOCKETS registered.
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cassert>
+#include <csignal>
+#include <ctime>
+#include <cstring>
+#include <random>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "msgq.hpp"
+
+#define LATENCY_ITERATIONS 20000
+#define THROUGHPUT_MESSAGES 200000
+#define MSG_SIZE 64
+#define RECEIVE_ITERATIONS 20000
+#define POLL_SOCKETS 100
+#define POLL_ITERATIONS 20000
+
+enum class WakeupMode {
+  FUTEX,
+  SIGNAL,
+};
+
+static uint64_t nanos_monotonic(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint32_t gettid_(){
+  return syscall(SYS_gettid);
+}
+
+static void sigusr2_handler(int signal) {
+  assert(signal == SIGUSR2);
+}
+
+// Reproduces the old msgq_poll: sleep until interrupted by SIGUSR2 or the timeout expires
+static int signal_poll(msgq_queue_t *q, int timeout){
+  if (msgq_msg_ready(q)) return 1;
+
+  struct timespec ts;
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000 * 1000;
+
+  while (true) {
+    int ret = nanosleep(&ts, &ts);
+    if (msgq_msg_ready(q)) return 1;
+    if (ret == 0) return 0;
+  }
+}
+
+static int wait_ready(msgq_queue_t *q, WakeupMode mode){
+  if (mode == WakeupMode::FUTEX){
+    msgq_pollitem_t items[1];
+    items[0].q = q;
+    return msgq_poll(items, 1, 100);
+  } else {
+    return signal_poll(q, 100);
+  }
+}
+
+static void send(msgq_queue_t *q, char *data, size_t size, WakeupMode mode, std::atomic<uint32_t> &reader_tid){
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = size;
+  msgq_msg_send(&msg, q);
+
+  if (mode == WakeupMode::SIGNAL){
+    syscall(SYS_tkill, reader_tid.load(), SIGUSR2);
+  }
+}
+
+static void open_queue(msgq_queue_t *q, std::string path, bool publisher){
+  int r = msgq_new_queue(q, path.c_str(), DEFAULT_SEGMENT_SIZE);
+  assert(r == 0);
+  if (publisher){
+    msgq_init_publisher(q);
+  } else {
+    r = msgq_init_subscriber(q);
+    assert(r == 0);
+  }
+}
+
+static void bench_latency(WakeupMode mode, const char *name){
+  std::string suffix = "_" + std::to_string(getpid());
+  msgq_queue_t ping_pub, ping_sub, pong_pub, pong_sub;
+  open_queue(&ping_pub, "msgq_bench_ping" + suffix, true);
+  open_queue(&pong_pub, "msgq_bench_pong" + suffix, true);
+
+  std::atomic<uint32_t> main_tid = gettid_(), echo_tid = 0;
+  std::atomic<bool> echo_ready = false;
+
+  open_queue(&pong_sub, "msgq_bench_pong" + suffix, false);
+
+  std::thread echo([&](){
+    open_queue(&ping_sub, "msgq_bench_ping" + suffix, false);
+    echo_tid = gettid_();
+    echo_ready = true;
+
+    for (int i = 0; i < LATENCY_ITERATIONS; i++){
+      msgq_msg_t msg;
+      while (msgq_msg_recv(&msg, &ping_sub) == 0){
+        wait_ready(&ping_sub, mode);
+      }
+      send(&pong_pub, msg.data, msg.size, mode, main_tid);
+      msgq_msg_close(&msg);
+    }
+  });
+
+  while (!echo_ready) std::this_thread::yield();
+
+  char data[MSG_SIZE] = {0};
+  std::vector<uint64_t> round_trips;
+  round_trips.reserve(LATENCY_ITERATIONS);
+
+  for (int i = 0; i < LATENCY_ITERATIONS; i++){
+    uint64_t start = nanos_monotonic();
+    send(&ping_pub, data, sizeof(data), mode, echo_tid);
+
+    msgq_msg_t msg;
+    while (msgq_msg_recv(&msg, &pong_sub) == 0){
+      wait_ready(&pong_sub, mode);
+    }
+    round_trips.push_back(nanos_monotonic() - start);
+    msgq_msg_close(&msg);
+  }
+  echo.join();
+
+  std::sort(round_trips.begin(), round_trips.end());
+  auto percentile = [&](double p){ return round_trips[(size_t)(p * (round_trips.size() - 1))] / 2000.0; };
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << name << " one-way latency (us): p50 " << percentile(0.5)
+            << ", p99 " << percentile(0.99)
+            << ", max " << percentile(1.0) << std::endl;
+
+  msgq_close_queue(&ping_pub);
+  msgq_close_queue(&ping_sub);
+  msgq_close_queue(&pong_pub);
+  msgq_close_queue(&pong_sub);
+  unlink(("/dev/shm/msgq_bench_ping" + suffix).c_str());
+  unlink(("/dev/shm/msgq_bench_pong" + suffix).c_str());
+}
+
+static void bench_throughput(WakeupMode mode, const char *name){
+  std::string path = "msgq_bench_throughput_" + std::to_string(getpid());
+  msgq_queue_t pub, sub;
+  open_queue(&pub, path, true);
+
+  std::atomic<uint32_t> reader_tid = 0;
+  std::atomic<bool> reader_ready = false;
+  std::atomic<int> received = 0;
+
+  std::thread reader([&](){
+    open_queue(&sub, path, false);
+    reader_tid = gettid_();
+    reader_ready = true;
+
+    while (received < THROUGHPUT_MESSAGES){
+      msgq_msg_t msg;
+      if (msgq_msg_recv(&msg, &sub) > 0){
+        received++;
+        msgq_msg_close(&msg);
+      } else {
+        wait_ready(&sub, mode);
+      }
+    }
+  });
+
+  while (!reader_ready) std::this_thread::yield();
+
+  char data[MSG_SIZE] = {0};
+  uint64_t start = nanos_monotonic();
+  for (int i = 0; i < THROUGHPUT_MESSAGES; i++){
+    // Don't lap the reader, we want to measure delivered messages
+    while (i - received > 10000) std::this_thread::yield();
+    send(&pub, data, sizeof(data), mode, reader_tid);
+  }
+  reader.join();
+  double dt = (nanos_monotonic() - start) * 1e-9;
+
+  std::cout << std::fixed << std::setprecision(0);
+  std::cout << name << " throughput: " << THROUGHPUT_MESSAGES / dt << " msg/s" << std::endl;
+
+  msgq_close_queue(&pub);
+  msgq_close_queue(&sub);
+  unlink(("/dev/shm/" + path).c_str());
+}
+
+// Copy path is what SubMaster used to do: copy out of the queue, then again into an aligned buffer
+static void bench_receive(size_t msg_size, bool borrow){
+  std::string path = "msgq_bench_receive_" + std::to_string(getpid());
+  msgq_queue_t pub, sub;
+  open_queue(&pub, path, true);
+  open_queue(&sub, path, false);
+
+  std::vector<char> data(msg_size), aligned(msg_size);
+  uint64_t bytes_copied = 0, total_ns = 0;
+
+  for (int i = 0; i < RECEIVE_ITERATIONS; i++){
+    msgq_msg_t msg;
+    msg.data = data.data();
+    msg.size = data.size();
+    msgq_msg_send(&msg, &pub);
+
+    uint64_t start = nanos_monotonic();
+    if (borrow){
+      int r = msgq_msg_borrow(&msg, &sub);
+      assert(r == (int)msg_size);
+      msgq_msg_release(&msg, &sub);
+    } else {
+      int r = msgq_msg_recv(&msg, &sub);
+      assert(r == (int)msg_size);
+      memcpy(aligned.data(), msg.data, msg.size);
+      bytes_copied += 2 * msg.size;
+      msgq_msg_close(&msg);
+    }
+    total_ns += nanos_monotonic() - start;
+  }
+
+  std::cout << std::fixed << std::setprecision(0);
+  std::cout << (borrow ? "borrow" : "copy  ") << " receive " << std::setw(6) << msg_size << " bytes: "
+            << std::setw(6) << (double)total_ns / RECEIVE_ITERATIONS << " ns/msg, "
+            << std::setw(6) << bytes_copied / RECEIVE_ITERATIONS << " bytes copied/msg" << std::endl;
+
+  msgq_close_queue(&pub);
+  msgq_close_queue(&sub);
+  unlink(("/dev/shm/" + path).c_str());
+}
+
+// A publisher thread writes to a random one of POLL_SOCKETS queues, the reader measures the time
+// from send until poll returned and the message was read
+static void bench_poll_sockets(bool ready_set){
+  std::string prefix = "msgq_bench_poll_" + std::to_string(getpid()) + "_";
+  std::vector<msgq_queue_t> pubs(POLL_SOCKETS), subs(POLL_SOCKETS);
+  for (int i = 0; i < POLL_SOCKETS; i++){
+    open_queue(&pubs[i], prefix + std::to_string(i), true);
+    open_queue(&subs[i], prefix + std::to_string(i), false);
+  }
+
+  msgq_poller_t poller;
+  msgq_poller_init(&poller);
+  std::vector<msgq_pollitem_t> items(POLL_SOCKETS);
+  for (int i = 0; i < POLL_SOCKETS; i++){
+    msgq_poller_add(&poller, &subs[i]);
+    items[i].q = &subs[i];
+  }
+
+  std::atomic<int> received = 0;
+  std::thread publisher([&](){
+    std::mt19937 gen(0);
+    for (int i = 0; i < POLL_ITERATIONS; i++){
+      while (received < i) std::this_thread::yield();
+      uint64_t now = nanos_monotonic();
+      msgq_msg_t msg;
+      msg.data = (char*)&now;
+      msg.size = sizeof(now);
+      msgq_msg_send(&msg, &pubs[gen() % POLL_SOCKETS]);
+    }
+  });
+
+  std::vector<int> ready;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(POLL_ITERATIONS);
+
+  while (received < POLL_ITERATIONS){
+    if (ready_set){
+      msgq_poller_poll(&poller, ready, 100);
+    } else {
+      ready.clear();
+      msgq_poll(items.data(), items.size(), 100);
+      for (int i = 0; i < POLL_SOCKETS; i++){
+        if (items[i].revents) ready.push_back(i);
+      }
+    }
+
+    for (int idx : ready){
+      msgq_msg_t msg;
+      if (msgq_msg_recv(&msg, &subs[idx]) > 0){
+        latencies.push_back(nanos_monotonic() - *(uint64_t*)msg.data);
+        msgq_msg_close(&msg);
+        received++;
+      }
+    }
+  }
+  publisher.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p){ return latencies[(size_t)(p * (latencies.size() - 1))] / 1000.0; };
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << (ready_set ? "msgq_poller" : "msgq_poll  ") << " " << POLL_SOCKETS << " sockets wakeup latency (us): p50 "
+            << percentile(0.5) << ", p99 " << percentile(0.99) << ", max " << percentile(1.0) << std::endl;
+
+  msgq_poller_close(&poller);
+  for (int i = 0; i < POLL_SOCKETS; i++){
+    msgq_close_queue(&subs[i]);
+    msgq_close_queue(&pubs[i]);
+    unlink(("/dev/shm/" + prefix + std::to_string(i)).c_str());
+  }
+}
+
+int main(){
+  std::signal(SIGUSR2, sigusr2_handler);
+
+  bench_latency(WakeupMode::SIGNAL, "signal");
+  bench_latency(WakeupMode::FUTEX, "futex ");
+
+  bench_throughput(WakeupMode::SIGNAL, "signal");
+  bench_throughput(WakeupMode::FUTEX, "futex ");
+
+  for (size_t msg_size : {64, 1024, 16 * 1024, 64 * 1024}){
+    bench_receive(msg_size, false);
+    bench_receive(msg_size, true);
+  }
+
+  bench_poll_sockets(false);
+  bench_poll_sockets(true);
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+// Prints the shared memory footprint of the msgq rings of all services:
+// the size each ring is created with, and what the files in /dev/shm currently take up.
+// usage: msgq_footprint
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "services.h"
+#include "msgq.hpp"
+
+static double mb(uint64_t bytes){
+  return bytes / (1024.0 * 1024.0);
+}
+
+int main(){
+  const size_t header_size = ALIGN(MSGQ_HEADER_SIZE(DEFAULT_NUM_READERS));
+  uint64_t total = 0, total_default = 0, total_file = 0, total_resident = 0;
+
+  std::cout << std::left << std::setw(28) << "service" << std::right << std::setw(8) << "Hz"
+            << std::setw(12) << "ring MB" << std::setw(12) << "file MB" << std::setw(12) << "resident MB" << std::endl;
+
+  for (const auto &it : services){
+    uint64_t size = it.segment_size + header_size;
+    total += size;
+    total_default += DEFAULT_SEGMENT_SIZE + header_size;
+
+    std::cout << std::left << std::setw(28) << it.name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << it.frequency << std::setw(12) << mb(size);
+
+    // Pages of the tmpfs file are only allocated once they were written to
+    struct stat st;
+    if (stat(("/dev/shm/" + std::string(it.name)).c_str(), &st) == 0){
+      total_file += st.st_size;
+      total_resident += st.st_blocks * 512;
+      std::cout << std::setw(12) << mb(st.st_size) << std::setw(12) << mb(st.st_blocks * 512);
+    } else {
+      std::cout << std::setw(12) << "-" << std::setw(12) << "-";
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << std::endl << std::fixed << std::setprecision(2)
+            << "total ring size:       " << std::setw(10) << mb(total) << " MB" << std::endl
+            << "at DEFAULT_SEGMENT_SIZE:" << std::setw(10) << mb(total_default) << " MB" << std::endl
+            << "files in /dev/shm:     " << std::setw(10) << mb(total_file) << " MB" << std::endl
+            << "resident in /dev/shm:  " << std::setw(10) << mb(total_resident) << " MB" << std::endl;
+  return 0;
+}
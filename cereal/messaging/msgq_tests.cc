@@ -0,0 +1,462 @@
+#include <thread>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "catch2/catch.hpp"
+#include "msgq.hpp"
+
+static std::string queue_path(const char *name){
+  return std::string(name) + "_" + std::to_string(getpid());
+}
+
+static void remove_queue(const std::string &path){
+  unlink(("/dev/shm/" + path).c_str());
+}
+
+static int send_int(msgq_queue_t *q, int value){
+  msgq_msg_t msg;
+  msg.data = (char*)&value;
+  msg.size = sizeof(value);
+  return msgq_msg_send(&msg, q);
+}
+
+TEST_CASE("ALIGN"){
+  REQUIRE(ALIGN(0) == 0);
+  REQUIRE(ALIGN(1) == 8);
+  REQUIRE(ALIGN(7) == 8);
+  REQUIRE(ALIGN(8) == 8);
+  REQUIRE(ALIGN(99999) == 100000);
+}
+
+TEST_CASE("Write and read single message"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+
+  REQUIRE(send_int(&pub, 1234) == sizeof(int));
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &sub) == sizeof(int));
+  REQUIRE(*(int*)msg.data == 1234);
+  msgq_msg_close(&msg);
+
+  REQUIRE(msgq_msg_recv(&msg, &sub) == 0);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Reader slots are released and reused"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024, 4) == 0);
+  msgq_init_publisher(&pub);
+
+  for (int i = 0; i < 100; i++){
+    msgq_queue_t sub;
+    REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024, 4) == 0);
+    REQUIRE(msgq_init_subscriber(&sub) == 0);
+    REQUIRE(sub.reader_id == 0);
+    msgq_close_queue(&sub);
+  }
+  REQUIRE(*pub.num_readers == 1);
+
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Too many readers fails instead of evicting"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024, 4) == 0);
+  msgq_init_publisher(&pub);
+
+  msgq_queue_t subs[5];
+  for (int i = 0; i < 4; i++){
+    REQUIRE(msgq_new_queue(&subs[i], path.c_str(), 1024, 4) == 0);
+    REQUIRE(msgq_init_subscriber(&subs[i]) == 0);
+  }
+
+  REQUIRE(msgq_new_queue(&subs[4], path.c_str(), 1024, 4) == 0);
+  REQUIRE(msgq_init_subscriber(&subs[4]) == -1);
+  REQUIRE(errno == ENOSPC);
+
+  // Existing readers are still connected
+  send_int(&pub, 42);
+  for (int i = 0; i < 4; i++){
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &subs[i]) == sizeof(int));
+    REQUIRE(*(int*)msg.data == 42);
+    msgq_msg_close(&msg);
+  }
+
+  // A slot frees up after closing
+  msgq_close_queue(&subs[0]);
+  REQUIRE(msgq_init_subscriber(&subs[4]) == 0);
+
+  for (int i = 1; i < 5; i++){
+    msgq_close_queue(&subs[i]);
+  }
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Reader table size mismatch"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t q1, q2;
+  REQUIRE(msgq_new_queue(&q1, path.c_str(), 1024, 16) == 0);
+  REQUIRE(msgq_new_queue(&q2, path.c_str(), 1024, 32) == -1);
+
+  msgq_close_queue(&q1);
+  remove_queue(path);
+}
+
+TEST_CASE("Stress test 32 concurrent readers"){
+  const int num_readers = 32;
+  const int num_messages = 10000;
+
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), DEFAULT_SEGMENT_SIZE) == 0);
+  msgq_init_publisher(&pub);
+
+  std::atomic<int> connected = 0;
+  std::atomic<int> failed = 0;
+  std::vector<std::thread> readers;
+
+  for (int r = 0; r < num_readers; r++){
+    readers.push_back(std::thread([&](){
+      msgq_queue_t sub;
+      if (msgq_new_queue(&sub, path.c_str(), DEFAULT_SEGMENT_SIZE) != 0 || msgq_init_subscriber(&sub) != 0){
+        failed++;
+        return;
+      }
+      connected++;
+
+      int expected = 0;
+      while (expected < num_messages){
+        msgq_msg_t msg;
+        int rc = msgq_msg_recv(&msg, &sub);
+        if (rc == 0){
+          msgq_pollitem_t items[1];
+          items[0].q = &sub;
+          msgq_poll(items, 1, 100);
+          continue;
+        }
+
+        if (rc != sizeof(int) || *(int*)msg.data != expected){
+          failed++;
+          msgq_msg_close(&msg);
+          break;
+        }
+        msgq_msg_close(&msg);
+        expected++;
+      }
+      msgq_close_queue(&sub);
+    }));
+  }
+
+  while (connected + failed < num_readers) usleep(1000);
+  REQUIRE(failed == 0);
+  REQUIRE(*pub.num_readers == num_readers);
+
+  for (int i = 0; i < num_messages; i++){
+    REQUIRE(send_int(&pub, i) == sizeof(int));
+  }
+
+  for (auto &t : readers) t.join();
+  REQUIRE(failed == 0);
+
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Borrow message without copy"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+
+  send_int(&pub, 1);
+  send_int(&pub, 2);
+
+  msgq_msg_t msg1, msg2;
+  REQUIRE(msgq_msg_borrow(&msg1, &sub) == sizeof(int));
+  REQUIRE(msg1.data >= sub.data);
+  REQUIRE(msg1.data < sub.data + sub.size);
+  REQUIRE((uintptr_t)msg1.data % 8 == 0);
+  REQUIRE(*(int*)msg1.data == 1);
+
+  // Lease moves to the newer message, the older one can't be vouched for anymore
+  REQUIRE(msgq_msg_borrow(&msg2, &sub) == sizeof(int));
+  REQUIRE(*(int*)msg2.data == 2);
+  REQUIRE(msgq_msg_release(&msg1, &sub) == -1);
+  REQUIRE(sub.read_leases[sub.reader_id] != 0);
+  REQUIRE(msgq_msg_release(&msg2, &sub) == 0);
+  REQUIRE(sub.read_leases[sub.reader_id] == 0);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Publisher breaks lease of stalled reader"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+
+  send_int(&pub, 1);
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == sizeof(int));
+
+  // Wrap around the ring, the publisher overwrites the borrowed message without waiting for it
+  for (int i = 0; i < 100; i++){
+    send_int(&pub, i);
+  }
+  REQUIRE(sub.read_leases[sub.reader_id] == 0);
+  REQUIRE(msgq_msg_release(&msg, &sub) == -1);
+
+  // The reader was invalidated, it skips everything up to the write pointer and keeps receiving
+  msgq_msg_t msg2;
+  REQUIRE(msgq_msg_recv(&msg2, &sub) == 0);
+  send_int(&pub, 1234);
+  REQUIRE(msgq_msg_recv(&msg2, &sub) == sizeof(int));
+  REQUIRE(*(int*)msg2.data == 1234);
+  msgq_msg_close(&msg2);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Batched send is received as individual messages"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+
+  // Move the write pointer close to the end, so the batch wraps around
+  for (int i = 0; i < 50; i++){
+    send_int(&pub, i);
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &sub) == sizeof(int));
+    msgq_msg_close(&msg);
+  }
+
+  const int batch_size = 20;
+  int values[batch_size];
+  msgq_msg_t msgs[batch_size];
+  for (int i = 0; i < batch_size; i++){
+    values[i] = 1000 + i;
+    msgs[i].data = (char*)&values[i];
+    msgs[i].size = sizeof(int);
+  }
+  REQUIRE(msgq_msg_send_batch(msgs, batch_size, &pub) == batch_size);
+
+  for (int i = 0; i < batch_size; i++){
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &sub) == sizeof(int));
+    REQUIRE(*(int*)msg.data == 1000 + i);
+    msgq_msg_close(&msg);
+  }
+  REQUIRE(msgq_msg_ready(&sub) == 0);
+
+  REQUIRE(msgq_msg_send_batch(msgs, 0, &pub) == 0);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Batch larger than the ring is published in parts"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+
+  const int batch_size = 100;
+  int values[batch_size];
+  msgq_msg_t msgs[batch_size];
+  for (int i = 0; i < batch_size; i++){
+    values[i] = i;
+    msgs[i].data = (char*)&values[i];
+    msgs[i].size = sizeof(int);
+  }
+
+  // Read every part as it is published, nothing may be overwritten before it was visible
+  std::atomic<bool> done(false);
+  std::vector<int> received;
+  std::thread reader([&](){
+    while (!done || msgq_msg_ready(&sub)){
+      msgq_msg_t msg;
+      if (msgq_msg_recv(&msg, &sub) > 0){
+        received.push_back(*(int*)msg.data);
+        msgq_msg_close(&msg);
+      }
+    }
+  });
+
+  REQUIRE(msgq_msg_send_batch(msgs, batch_size, &pub) == batch_size);
+  done = true;
+  reader.join();
+
+  // The reader can fall behind and get overrun, but whatever it got is intact and in order
+  for (size_t i = 0; i < received.size(); i++){
+    REQUIRE(received[i] >= 0);
+    REQUIRE(received[i] < batch_size);
+    if (i > 0) REQUIRE(received[i] > received[i - 1]);
+  }
+  REQUIRE(*pub.write_seq == batch_size);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
+
+TEST_CASE("Poller reports only the queues that were written to"){
+  const int num_queues = 8;
+  std::string paths[num_queues];
+  msgq_queue_t pubs[num_queues], subs[num_queues];
+
+  msgq_poller_t poller;
+  msgq_poller_init(&poller);
+  REQUIRE(poller.owner);
+
+  for (int i = 0; i < num_queues; i++){
+    paths[i] = queue_path(("test_queue_" + std::to_string(i)).c_str());
+    REQUIRE(msgq_new_queue(&pubs[i], paths[i].c_str(), 1024) == 0);
+    REQUIRE(msgq_new_queue(&subs[i], paths[i].c_str(), 1024) == 0);
+    msgq_init_publisher(&pubs[i]);
+    REQUIRE(msgq_init_subscriber(&subs[i]) == 0);
+    REQUIRE(msgq_poller_add(&poller, &subs[i]) == i);
+  }
+
+  std::vector<int> ready;
+  REQUIRE(msgq_poller_poll(&poller, ready, 0) == 0);
+
+  send_int(&pubs[5], 5);
+  send_int(&pubs[2], 2);
+  send_int(&pubs[2], 3);
+  REQUIRE(msgq_poller_poll(&poller, ready, 0) == 2);
+  REQUIRE(ready == std::vector<int>{2, 5});
+
+  // Level triggered: a queue stays ready until it is drained
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &subs[2]) == sizeof(int));
+  msgq_msg_close(&msg);
+  REQUIRE(msgq_msg_recv(&msg, &subs[5]) == sizeof(int));
+  msgq_msg_close(&msg);
+  REQUIRE(msgq_poller_poll(&poller, ready, 0) == 1);
+  REQUIRE(ready == std::vector<int>{2});
+
+  REQUIRE(msgq_msg_recv(&msg, &subs[2]) == sizeof(int));
+  msgq_msg_close(&msg);
+  REQUIRE(msgq_poller_poll(&poller, ready, 0) == 0);
+
+  // Wakes up from another thread
+  std::thread t([&](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    send_int(&pubs[7], 7);
+  });
+  REQUIRE(msgq_poller_poll(&poller, ready, 1000) == 1);
+  REQUIRE(ready == std::vector<int>{7});
+  t.join();
+  REQUIRE(msgq_msg_recv(&msg, &subs[7]) == sizeof(int));
+  msgq_msg_close(&msg);
+
+  // The reader reconnects after a publisher restart and keeps its ready bit
+  msgq_init_publisher(&pubs[3]);
+  REQUIRE(msgq_msg_ready(&subs[3]) == 0);
+  send_int(&pubs[3], 3);
+  REQUIRE(msgq_poller_poll(&poller, ready, 0) == 1);
+  REQUIRE(ready == std::vector<int>{3});
+
+  msgq_poller_close(&poller);
+  for (int i = 0; i < num_queues; i++){
+    msgq_close_queue(&subs[i]);
+    msgq_close_queue(&pubs[i]);
+    remove_queue(paths[i]);
+  }
+}
+
+TEST_CASE("Reader stats count drops, overruns and conflated messages"){
+  std::string path = queue_path("test_queue");
+  msgq_queue_t pub, sub, conflate_sub;
+  REQUIRE(msgq_new_queue(&pub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, path.c_str(), 1024) == 0);
+  REQUIRE(msgq_new_queue(&conflate_sub, path.c_str(), 1024) == 0);
+  msgq_init_publisher(&pub);
+  REQUIRE(msgq_init_subscriber(&sub) == 0);
+  REQUIRE(msgq_init_subscriber(&conflate_sub) == 0);
+  conflate_sub.read_conflate = true;
+
+  msgq_reader_stats_t *stats = &sub.read_stats[sub.reader_id];
+  msgq_reader_stats_t *conflate_stats = &conflate_sub.read_stats[conflate_sub.reader_id];
+  REQUIRE(stats->uid == sub.read_uid_local);
+
+  msgq_msg_t msg;
+  for (int i = 0; i < 5; i++){
+    send_int(&pub, i);
+  }
+  for (int i = 0; i < 5; i++){
+    REQUIRE(msgq_msg_recv(&msg, &sub) == sizeof(int));
+    msgq_msg_close(&msg);
+  }
+  REQUIRE(msgq_msg_recv(&msg, &conflate_sub) == sizeof(int));
+  REQUIRE(*(int*)msg.data == 4);
+  msgq_msg_close(&msg);
+
+  REQUIRE(stats->received == 5);
+  REQUIRE(stats->dropped == 0);
+  REQUIRE(stats->overruns == 0);
+  REQUIRE(conflate_stats->received == 1);
+  REQUIRE(conflate_stats->conflated == 4);
+
+  uint64_t hist_total = 0;
+  for (int i = 0; i < MSGQ_LATENCY_BUCKETS; i++){
+    hist_total += stats->latency_hist[i];
+  }
+  REQUIRE(hist_total == 5);
+  REQUIRE(stats->latency_max_ns > 0);
+
+  // Lap the reader, it skips ahead to the write pointer and counts the messages it missed on the next read
+  for (int i = 0; i < 100; i++){
+    send_int(&pub, 100 + i);
+  }
+  REQUIRE(msgq_msg_recv(&msg, &sub) == 0);
+  REQUIRE(stats->overruns == 1);
+
+  send_int(&pub, 200);
+  REQUIRE(msgq_msg_recv(&msg, &sub) == sizeof(int));
+  REQUIRE(*(int*)msg.data == 200);
+  msgq_msg_close(&msg);
+  REQUIRE(stats->dropped + stats->received == 5 + 101);
+
+  // Sequence numbers continue across publisher restarts
+  uint64_t seq = *pub.write_seq;
+  msgq_init_publisher(&pub);
+  send_int(&pub, 300);
+  REQUIRE(*pub.write_seq == seq + 1);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&conflate_sub);
+  msgq_close_queue(&pub);
+  remove_queue(path);
+}
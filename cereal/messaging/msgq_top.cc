@@ -0,0 +1,142 @@
+// Shows the reader stats of all msgq services, refreshed every second like top.
+// usage: msgq_top [--once] [service...]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "services.h"
+#include "msgq.hpp"
+
+struct QueueView {
+  std::string name;
+  char *mem = NULL;
+  size_t size = 0;
+  msgq_header_t *header = NULL;
+  const uint64_t *read_uids = NULL;
+  msgq_reader_stats_t *stats = NULL;
+};
+
+// Maps the header of an existing queue read only, never creates one
+static bool open_queue(const std::string &name, QueueView &view){
+  int fd = open(("/dev/shm/" + name).c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(msgq_header_t)){
+    close(fd);
+    return false;
+  }
+
+  char *mem = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  msgq_header_t *header = (msgq_header_t *)mem;
+  if (header->max_readers == 0 || MSGQ_HEADER_SIZE(header->max_readers) > (size_t)st.st_size){
+    munmap(mem, st.st_size);
+    return false;
+  }
+
+  view.name = name;
+  view.mem = mem;
+  view.size = st.st_size;
+  view.header = header;
+  // same layout as the reader table in msgq_new_queue
+  view.read_uids = (const uint64_t *)(mem + sizeof(msgq_header_t)) + 2 * header->max_readers;
+  view.stats = (msgq_reader_stats_t *)(mem + MSGQ_READER_STATS_OFFSET(header->max_readers));
+  return true;
+}
+
+// Upper bound of the histogram bucket holding the p-th percentile, in us
+static uint64_t latency_percentile(const msgq_reader_stats_t &s, double p){
+  uint64_t total = 0;
+  for (int i = 0; i < MSGQ_LATENCY_BUCKETS; i++) total += s.latency_hist[i];
+  if (total == 0) return 0;
+
+  uint64_t count = 0;
+  for (int i = 0; i < MSGQ_LATENCY_BUCKETS; i++){
+    count += s.latency_hist[i];
+    if (count >= p * total) return 2ULL << i;
+  }
+  return 2ULL << (MSGQ_LATENCY_BUCKETS - 1);
+}
+
+int main(int argc, char **argv){
+  bool once = false;
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++){
+    std::string arg = argv[i];
+    if (arg == "--once"){
+      once = true;
+    } else {
+      names.push_back(arg);
+    }
+  }
+  if (names.empty()){
+    for (const auto &it : services){
+      names.push_back(it.name);
+    }
+  }
+
+  // Rates are computed from the difference with the previous refresh
+  std::map<std::string, uint64_t> prev_seq;
+  std::map<uint64_t, uint64_t> prev_received;
+  auto prev_time = std::chrono::steady_clock::now();
+
+  while (true){
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - prev_time).count();
+    prev_time = now;
+
+    if (!once) std::cout << "\033[H\033[2J";
+    std::cout << std::left << std::setw(28) << "service" << std::right
+              << std::setw(8) << "tid" << std::setw(9) << "pub Hz" << std::setw(9) << "recv Hz"
+              << std::setw(11) << "received" << std::setw(9) << "dropped" << std::setw(9) << "overruns"
+              << std::setw(10) << "conflated" << std::setw(9) << "avg us" << std::setw(9) << "p50 us"
+              << std::setw(9) << "p99 us" << std::setw(10) << "max us" << std::endl;
+
+    for (const auto &name : names){
+      QueueView q;
+      if (!open_queue(name, q)) continue;
+
+      uint64_t seq = q.header->write_seq;
+      double pub_hz = (dt > 0 && prev_seq.count(name)) ? (seq - prev_seq[name]) / dt : 0;
+      prev_seq[name] = seq;
+
+      uint64_t num_readers = std::min(q.header->num_readers, q.header->max_readers);
+      for (uint64_t i = 0; i < num_readers; i++){
+        msgq_reader_stats_t s = q.stats[i];
+        // stats of a slot that was released or taken away from its reader
+        if (s.uid == 0 || q.read_uids[i] != s.uid) continue;
+
+        double recv_hz = (dt > 0 && prev_received.count(s.uid)) ? (s.received - prev_received[s.uid]) / dt : 0;
+        prev_received[s.uid] = s.received;
+
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(8) << (s.uid & 0xFFFFFFFF) << std::setw(9) << pub_hz << std::setw(9) << recv_hz
+                  << std::setw(11) << s.received << std::setw(9) << s.dropped << std::setw(9) << s.overruns
+                  << std::setw(10) << s.conflated
+                  << std::setw(9) << (s.received ? s.latency_sum_ns / 1000.0 / s.received : 0.0)
+                  << std::setw(9) << latency_percentile(s, 0.5) << std::setw(9) << latency_percentile(s, 0.99)
+                  << std::setw(10) << s.latency_max_ns / 1000.0 << std::endl;
+      }
+
+      munmap(q.mem, q.size);
+    }
+
+    if (once) break;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <time.h>
+#include <stdexcept>
 #include "messaging.hpp"
 #include "services.h"
 
@@ -39,7 +40,9 @@ struct SubMaster::SubMessage {
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
+  // msg_reader reads one while the next message is copied into the other
+  AlignedBuffer aligned_buf[2];
+  int cur_buf = 0;
   cereal::Event::Reader event;
 };
 
@@ -70,15 +73,22 @@ int SubMaster::update(int timeout) {
   auto sockets = poller_->poll(timeout);
   uint64_t current_time = nanos_since_boot();
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
+    // The event is read until the next update, so the borrowed message is copied once into a reused buffer
+    Message *msg = s->borrow(true);
     if (msg == nullptr) continue;
 
     SubMessage *m = messages_.at(s);
+    auto words = m->aligned_buf[!m->cur_buf].align(msg);
+    bool intact = msg->release();
+    delete msg;
+    // overwritten while it was copied, the previous message stays
+    if (!intact) continue;
+
     if (m->msg_reader) {
       m->msg_reader->~FlatArrayMessageReader();
     }
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg));
-    delete msg;
+    m->cur_buf = !m->cur_buf;
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words);
     m->event = m->msg_reader->getRoot<cereal::Event>();
     m->updated = true;
     m->rcv_time = current_time;
@@ -153,11 +163,30 @@ PubMaster::PubMaster(const std::initializer_list<const char *> &service_list) {
   }
 }
 
+PubSocket *PubMaster::socket(const char *name) {
+  auto it = sockets_.find(name);
+  if (it == sockets_.end()) throw std::out_of_range(name);
+  return it->second;
+}
+
 int PubMaster::send(const char *name, MessageBuilder &msg) {
   auto bytes = msg.toBytes();
   return send(name, bytes.begin(), bytes.size());
 }
 
+int PubMaster::send(const char *name, ReusableMessageBuilder &msg) {
+  auto bytes = msg.toBytes();
+  return send(name, bytes.begin(), bytes.size());
+}
+
+int PubMaster::send(const char *name, kj::ArrayPtr<MessageBuilder> msgs) {
+  batch_.clear();
+  for (auto &msg : msgs) {
+    batch_.push_back(msg.toBytes());
+  }
+  return socket(name)->sendBatch(batch_);
+}
+
 PubMaster::~PubMaster() {
   for (auto s : sockets_) delete s.second;
 }
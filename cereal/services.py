@@ -4,19 +4,37 @@ from typing import Optional
 
 EON = os.path.isfile('/EON')
 
+# msgq rings hold RING_RETENTION seconds of messages at the nominal frequency.
+# The minimum leaves room for bursts of event based services and is well above the
+# 3 messages a ring must fit, the maximum was the size of the camera state rings before.
+RING_RETENTION = 5.
+MIN_SEGMENT_SIZE = 1024 * 1024
+MAX_SEGMENT_SIZE = 100 * 1024 * 1024
+DEFAULT_MSG_SIZE = 4096
+
+
+def segment_size(frequency: float, msg_size: int) -> int:
+  size = max(MIN_SEGMENT_SIZE, 3 * msg_size, int(msg_size * frequency * RING_RETENTION))
+  size = min(size, MAX_SEGMENT_SIZE)
+  return (size + MIN_SEGMENT_SIZE - 1) // MIN_SEGMENT_SIZE * MIN_SEGMENT_SIZE
+
+
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None,
+               msg_size: int = DEFAULT_MSG_SIZE):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.msg_size = msg_size  # typical serialized size in bytes
+    self.segment_size = segment_size(frequency, msg_size)
 
 service_list = {
-  "roadCameraState": Service(8002, True, 20., 1),
+  "roadCameraState": Service(8002, True, 20., 1, msg_size=3 * 1024 * 1024),
   "sensorEvents": Service(8003, True, 100., 100),
   "gpsNMEA": Service(8004, True, 9.),
   "deviceState": Service(8005, True, 2., 1),
-  "can": Service(8006, True, 100.),
+  "can": Service(8006, True, 100., msg_size=8192),
   "controlsState": Service(8007, True, 100., 100),
   "features": Service(8010, True, 0.),
   "pandaState": Service(8011, True, 2., 1),
@@ -31,7 +49,7 @@ service_list = {
   "carControl": Service(8023, True, 100., 10),
   "longitudinalPlan": Service(8024, True, 20., 2),
   "liveLocation": Service(8025, True, 0., 1),
-  "procLog": Service(8031, True, 0.5),
+  "procLog": Service(8031, True, 0.5, msg_size=64 * 1024),
   "gpsLocationExternal": Service(8032, True, 10., 1),
   "ubloxGnss": Service(8033, True, 10.),
   "clocks": Service(8034, True, 1., 1),
@@ -43,17 +61,17 @@ service_list = {
   "liveParameters": Service(8064, True, 20., 2),
   "cameraOdometry": Service(8066, True, 20., 5),
   "lateralPlan": Service(8067, True, 20., 2),
-  "thumbnail": Service(8069, True, 0.2, 1),
+  "thumbnail": Service(8069, True, 0.2, 1, msg_size=128 * 1024),
   "carEvents": Service(8070, True, 1., 1),
   "carParams": Service(8071, True, 0.02, 1),
-  "driverCameraState": Service(8072, True, 10. if EON else 20., 1),
+  "driverCameraState": Service(8072, True, 10. if EON else 20., 1, msg_size=3 * 1024 * 1024),
   "driverEncodeIdx": Service(8061, True, 10. if EON else 20., 1),
   "driverState": Service(8063, True, 10. if EON else 20., 1),
   "driverMonitoringState": Service(8073, True, 10. if EON else 20., 1),
   "offroadLayout": Service(8074, False, 0.),
   "wideRoadEncodeIdx": Service(8075, True, 20., 1),
-  "wideRoadCameraState": Service(8076, True, 20., 1),
-  "modelV2": Service(8077, True, 20., 20),
+  "wideRoadCameraState": Service(8076, True, 20., 1, msg_size=3 * 1024 * 1024),
+  "modelV2": Service(8077, True, 20., 20, msg_size=64 * 1024),
   "managerState": Service(8078, True, 2., 1),
 
   "testModel": Service(8040, False, 0.),
@@ -67,13 +85,13 @@ def build_header():
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; int segment_size; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { .name = "%s", .port = %d, .should_log = %s, .frequency = %d, .decimation = %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    h += '  { .name = "%s", .port = %d, .should_log = %s, .frequency = %d, .decimation = %d, .segment_size = %d },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.segment_size)
   h += "};\n"
   h += "#endif\n"
   return h
@@ -0,0 +1,76 @@
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "frame_trace.h"
+
+#ifdef __APPLE__
+#define CLOCK_BOOTTIME CLOCK_MONOTONIC
+#endif
+
+static const char *stage_names[] = {
+  "camera eof",
+  "camera debayer",
+  "camera send",
+  "model start",
+  "model end",
+  "model publish",
+  "loggerd recv",
+  "loggerd encoded",
+  "ui recv",
+};
+static_assert(sizeof(stage_names) / sizeof(stage_names[0]) == FRAME_TRACE_MAX);
+
+const char *frame_trace_stage_name(int stage){
+  return stage >= 0 && stage < FRAME_TRACE_MAX ? stage_names[stage] : "unknown";
+}
+
+FrameTraceRing *frame_trace_open(){
+  int fd = open(FRAME_TRACE_PATH, O_RDWR | O_CREAT, 0777);
+  if (fd < 0) return nullptr;
+
+  // Growing the file is idempotent, so it doesn't matter which process gets here first
+  if (ftruncate(fd, sizeof(FrameTraceRing)) != 0){
+    close(fd);
+    return nullptr;
+  }
+
+  void *addr = mmap(NULL, sizeof(FrameTraceRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return addr == MAP_FAILED ? nullptr : (FrameTraceRing *)addr;
+}
+
+static FrameTraceRing *get_ring(){
+  static FrameTraceRing *ring = []() -> FrameTraceRing * {
+    const char *env = getenv("FRAME_TRACE");
+    if (env == nullptr || strcmp(env, "1") != 0) return nullptr;
+    return frame_trace_open();
+  }();
+  return ring;
+}
+
+void frame_trace(FrameTraceStage stage, VisionStreamType stream, uint32_t frame_id, uint64_t ts){
+  FrameTraceRing *ring = get_ring();
+  if (ring == nullptr) return;
+
+  if (ts == 0){
+    struct timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    ts = t.tv_sec * 1000000000ULL + t.tv_nsec;
+  }
+
+  uint64_t idx = ring->write_idx.fetch_add(1);
+  FrameTraceEvent &e = ring->events[idx % FRAME_TRACE_SIZE];
+
+  // Readers skip the slot while it's being written
+  e.seq.store(0);
+  e.ts = ts;
+  e.frame_id = frame_id;
+  e.stage = stage;
+  e.stream = stream;
+  e.seq.store(idx + 1, std::memory_order_release);
+}
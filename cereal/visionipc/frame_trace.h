@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+#include "visionbuf.h"
+
+// Opt-in tracing of the stages a camera frame goes through, enabled with FRAME_TRACE=1.
+// All processes append to the same ring in /dev/shm, frame_trace joins the events by frame_id.
+
+#define FRAME_TRACE_PATH "/dev/shm/frame_trace"
+#define FRAME_TRACE_SIZE (1 << 16) // ~2 seconds of all stages of all cameras at 20 fps
+
+enum FrameTraceStage : uint16_t {
+  FRAME_TRACE_CAMERA_EOF,
+  FRAME_TRACE_CAMERA_DEBAYER,
+  FRAME_TRACE_CAMERA_SEND,
+  FRAME_TRACE_MODEL_START,
+  FRAME_TRACE_MODEL_END,
+  FRAME_TRACE_MODEL_PUBLISH,
+  FRAME_TRACE_LOGGERD_RECV,
+  FRAME_TRACE_LOGGERD_ENCODED,
+  FRAME_TRACE_UI_RECV,
+  FRAME_TRACE_MAX,
+};
+
+struct FrameTraceEvent {
+  std::atomic<uint64_t> seq; // index in the ring + 1, set once the event is written
+  uint64_t ts;               // nanos since boot, same clock as timestamp_eof
+  uint32_t frame_id;
+  uint16_t stage;
+  uint16_t stream;           // VisionStreamType
+};
+
+struct FrameTraceRing {
+  std::atomic<uint64_t> write_idx;
+  uint64_t padding[7];
+  FrameTraceEvent events[FRAME_TRACE_SIZE];
+};
+
+const char *frame_trace_stage_name(int stage);
+
+// Maps the ring, creating it if no process did yet. Returns nullptr on failure
+FrameTraceRing *frame_trace_open();
+
+// ts of 0 means now
+void frame_trace(FrameTraceStage stage, VisionStreamType stream, uint32_t frame_id, uint64_t ts = 0);
@@ -0,0 +1,128 @@
+// Joins the events of the frame trace ring into per frame latency breakdowns.
+// Start the camera and model processes with FRAME_TRACE=1.
+// usage: frame_trace [--frames] [--interval <seconds>]
+// Prints the time from sensor EOF to every stage, per camera. --frames also prints every frame.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "frame_trace.h"
+
+// RGB and YUV streams of a camera carry the same frame ids
+static const char *camera_names[] = {"road", "driver", "wide"};
+#define NUM_CAMERAS 3
+
+typedef std::array<uint64_t, FRAME_TRACE_MAX> FrameStages;
+
+static void print_frame(int camera, uint32_t frame_id, const FrameStages &ts){
+  printf("%-6s %8u", camera_names[camera], frame_id);
+  for (int s = 1; s < FRAME_TRACE_MAX; s++){
+    if (ts[s]) printf("  %s %+.1f", frame_trace_stage_name(s), (int64_t)(ts[s] - ts[FRAME_TRACE_CAMERA_EOF]) / 1e6);
+  }
+  printf("\n");
+}
+
+static void print_summary(std::vector<double> (&latencies)[NUM_CAMERAS][FRAME_TRACE_MAX]){
+  printf("\n%-6s %-16s %6s %8s %8s %8s %8s   ms since eof\n", "camera", "stage", "n", "mean", "p50", "p90", "max");
+  for (int c = 0; c < NUM_CAMERAS; c++){
+    for (int s = 1; s < FRAME_TRACE_MAX; s++){
+      auto &l = latencies[c][s];
+      if (l.empty()) continue;
+
+      std::sort(l.begin(), l.end());
+      double sum = 0;
+      for (double v : l) sum += v;
+      printf("%-6s %-16s %6zu %8.2f %8.2f %8.2f %8.2f\n", camera_names[c], frame_trace_stage_name(s), l.size(),
+             sum / l.size(), l[l.size() / 2], l[l.size() * 9 / 10], l.back());
+      l.clear();
+    }
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char **argv){
+  bool print_frames = false;
+  double interval = 5.0;
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--frames") == 0){
+      print_frames = true;
+    } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc){
+      interval = atof(argv[++i]);
+    } else {
+      printf("usage: %s [--frames] [--interval <seconds>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  FrameTraceRing *ring = frame_trace_open();
+  if (ring == nullptr){
+    printf("failed to open %s\n", FRAME_TRACE_PATH);
+    return 1;
+  }
+
+  std::map<std::pair<int, uint32_t>, FrameStages> frames;
+  std::vector<double> latencies[NUM_CAMERAS][FRAME_TRACE_MAX];
+  uint64_t read_idx = ring->write_idx;
+  uint64_t lost = 0, latest = 0;
+  auto last_summary = std::chrono::steady_clock::now();
+
+  while (true){
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    uint64_t write_idx = ring->write_idx;
+    if (write_idx - read_idx > FRAME_TRACE_SIZE){
+      lost += write_idx - FRAME_TRACE_SIZE - read_idx;
+      read_idx = write_idx - FRAME_TRACE_SIZE;
+    }
+
+    for (; read_idx < write_idx; read_idx++){
+      FrameTraceEvent &e = ring->events[read_idx % FRAME_TRACE_SIZE];
+      if (e.seq.load(std::memory_order_acquire) != read_idx + 1) continue;
+      uint64_t ts = e.ts;
+      uint32_t frame_id = e.frame_id;
+      int stage = e.stage, stream = e.stream;
+      // Overwritten while copying
+      if (e.seq.load(std::memory_order_acquire) != read_idx + 1 || stage >= FRAME_TRACE_MAX) continue;
+
+      frames[{stream % NUM_CAMERAS, frame_id}][stage] = ts;
+      latest = std::max(latest, ts);
+    }
+
+    // A frame is done once all consumers had a second to get to it
+    for (auto it = frames.begin(); it != frames.end();){
+      auto &ts = it->second;
+      uint64_t first = UINT64_MAX;
+      for (uint64_t t : ts){
+        if (t) first = std::min(first, t);
+      }
+      if (latest - first < 1000000000ULL){
+        ++it;
+        continue;
+      }
+
+      int camera = it->first.first;
+      if (ts[FRAME_TRACE_CAMERA_EOF]){
+        for (int s = 1; s < FRAME_TRACE_MAX; s++){
+          if (ts[s]) latencies[camera][s].push_back((int64_t)(ts[s] - ts[FRAME_TRACE_CAMERA_EOF]) / 1e6);
+        }
+        if (print_frames) print_frame(camera, it->first.second, ts);
+      }
+      it = frames.erase(it);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - last_summary).count() >= interval){
+      print_summary(latencies);
+      if (lost) printf("%llu events overwritten before they were read\n", (unsigned long long)lost);
+      last_summary = now;
+    }
+  }
+  return 0;
+}
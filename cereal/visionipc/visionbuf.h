@@ -46,6 +46,7 @@ class VisionBuf {
   // OpenCL
   cl_mem buf_cl = nullptr;
   cl_command_queue copy_q = nullptr;
+  bool zero_copy = false; // buf_cl uses addr directly, sync is a no-op
 
   // ion
   int handle = 0;
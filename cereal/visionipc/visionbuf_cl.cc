@@ -9,35 +9,70 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
+
+#ifdef __APPLE__
 std::atomic<int> offset = 0;
 
-static void *malloc_with_fd(size_t len, int *fd) {
+static int shm_open_fd() {
   char full_path[0x100];
-
-#ifdef __APPLE__
   snprintf(full_path, sizeof(full_path)-1, "/tmp/visionbuf_%d_%d", getpid(), offset++);
+
+  int fd = open(full_path, O_RDWR | O_CREAT, 0777);
+  assert(fd >= 0);
+  unlink(full_path);
+  return fd;
+}
 #else
-  snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionbuf_%d_%d", getpid(), offset++);
-#endif
+static int shm_open_fd() {
+  int fd = memfd_create("visionbuf", 0);
+  assert(fd >= 0);
+  return fd;
+}
 
-  *fd = open(full_path, O_RDWR | O_CREAT, 0777);
-  assert(*fd >= 0);
+// Frames are megabytes, back them with huge pages if the system has some reserved
+static void *malloc_huge_with_fd(size_t len, int *fd, size_t *mmap_len) {
+  if (len < HUGE_PAGE_SIZE) return nullptr;
 
-  unlink(full_path);
+  *fd = memfd_create("visionbuf", MFD_HUGETLB);
+  if (*fd < 0) return nullptr;
 
+  *mmap_len = ALIGN(len, HUGE_PAGE_SIZE);
+  void *addr = MAP_FAILED;
+  if (ftruncate(*fd, *mmap_len) == 0) {
+    // Fails when there are not enough free huge pages
+    addr = mmap(NULL, *mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  }
+  if (addr == MAP_FAILED) {
+    close(*fd);
+    return nullptr;
+  }
+  return addr;
+}
+#endif
+
+static void *malloc_with_fd(size_t len, int *fd, size_t *mmap_len) {
+#ifndef __APPLE__
+  void *huge = malloc_huge_with_fd(len, fd, mmap_len);
+  if (huge) return huge;
+#endif
+
+  *fd = shm_open_fd();
+  *mmap_len = len;
   ftruncate(*fd, len);
   void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
   assert(addr != MAP_FAILED);
-
   return addr;
 }
 
 void VisionBuf::allocate(size_t len) {
   int fd;
-  void *addr = malloc_with_fd(len, &fd);
+  size_t mmap_len;
+  void *addr = malloc_with_fd(len, &fd, &mmap_len);
 
   this->len = len;
-  this->mmap_len = len;
+  this->mmap_len = mmap_len;
   this->addr = addr;
   this->fd = fd;
 }
@@ -50,6 +85,13 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
 
   this->buf_cl = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, this->len, this->addr, &err);
   assert(err == 0);
+
+  // Without a GPU the CL buffer is the shared mapping itself, nothing to copy. CL_MEM_USE_HOST_PTR only allows
+  // the runtime to cache the host memory, this relies on CPU runtimes (pocl, Intel) not doing so
+  cl_device_type device_type = 0;
+  err = clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+  assert(err == 0);
+  this->zero_copy = !(device_type & CL_DEVICE_TYPE_GPU);
 }
 
 
@@ -62,7 +104,7 @@ void VisionBuf::import(){
 
 void VisionBuf::sync(int dir) {
   int err = 0;
-  if (!this->buf_cl) return;
+  if (!this->buf_cl || this->zero_copy) return;
 
   if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
     err = clEnqueueReadBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
@@ -81,6 +123,6 @@ void VisionBuf::free() {
     clReleaseCommandQueue(this->copy_q);
   }
 
-  munmap(this->addr, this->len);
+  munmap(this->addr, this->mmap_len);
   close(this->fd);
 }
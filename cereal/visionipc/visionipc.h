@@ -1,9 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 
 constexpr int VISIONIPC_MAX_FDS = 64;
+constexpr int VISIONIPC_MAX_CLIENTS = 32;
 
 struct VisionIpcBufExtra {
   uint32_t frame_id;
@@ -14,5 +16,22 @@ struct VisionIpcBufExtra {
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint64_t seq;
   struct VisionIpcBufExtra extra;
 };
+
+// Shared by the server and all clients of a stream.
+// A client leases the buffer it received until its next recv, the server doesn't hand out leased buffers.
+// Every client owns a slot, so the server can take back the lease of a client that died.
+// seq changes whenever the server takes a buffer to write to, so a client can tell if its frame was replaced.
+struct VisionIpcLeases {
+  std::atomic<uint32_t> writer[VISIONIPC_MAX_FDS]; // set while the server writes to the buffer
+  std::atomic<uint64_t> seq[VISIONIPC_MAX_FDS];
+  std::atomic<int32_t> owner[VISIONIPC_MAX_CLIENTS];   // pid of the client in the slot, 0 if free
+  std::atomic<uint32_t> leased[VISIONIPC_MAX_CLIENTS]; // idx + 1 of the buffer leased by the slot, 0 if none
+};
+
+struct VisionIpcBufStats {
+  uint64_t frames_skipped; // buffers get_buffer passed over because a client was still reading them
+  uint64_t frames_stolen;  // buffers overwritten while leased, because all buffers were leased
+};
@@ -20,9 +20,11 @@ bool VisionIpcClient::connect(bool blocking){
   connected = false;
 
   // Cleanup old buffers on reconnect
+  release();
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i].free();
   }
+  free_leases();
   num_buffers = 0;
 
   // Connect to server socket and ask for all FDs of type
@@ -51,9 +53,25 @@ bool VisionIpcClient::connect(bool blocking){
   VisionBuf bufs[VISIONIPC_MAX_FDS];
   r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_buffers);
 
-  assert(num_buffers > 0);
+  assert(num_buffers > 1);
   assert(r == sizeof(VisionBuf) * num_buffers);
 
+  // The last one is the lease table
+  num_buffers--;
+  lease_buf = bufs[num_buffers];
+  lease_buf.fd = fds[num_buffers];
+  lease_buf.import();
+  leases = (VisionIpcLeases*)lease_buf.addr;
+
+  // Without a slot frames aren't protected while reading, release still reports if they were overwritten
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS && slot < 0; i++){
+    int32_t expected = 0;
+    if (leases->owner[i].compare_exchange_strong(expected, getpid())) slot = i;
+  }
+  if (slot < 0) {
+    std::cout << "VisionIpcClient no free lease slot" << std::endl;
+  }
+
   // Import buffers
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i] = bufs[i];
@@ -73,6 +91,8 @@ bool VisionIpcClient::connect(bool blocking){
 }
 
 VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
+  release();
+
   auto p = poller->poll(timeout_ms);
 
   if (!p.size()){
@@ -97,6 +117,18 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
     return nullptr;
   }
 
+  // Lease the buffer, unless the server already took it back to write the next frame.
+  // The server marks the buffer before looking for leases, so one of the two sees the other
+  if (slot >= 0) leases->leased[slot] = packet->idx + 1;
+  if (leases->writer[packet->idx] || leases->seq[packet->idx] != packet->seq){
+    if (slot >= 0) leases->leased[slot] = 0;
+    frames_dropped++;
+    delete r;
+    return nullptr;
+  }
+  leased = buf;
+  leased_seq = packet->seq;
+
   if (extra) {
     *extra = packet->extra;
   }
@@ -106,12 +138,35 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
   return buf;
 }
 
+bool VisionIpcClient::release(){
+  if (!leased) return true;
+
+  bool intact = leases->seq[leased->idx] == leased_seq;
+  if (slot >= 0) leases->leased[slot] = 0;
+  leased = nullptr;
+
+  if (!intact) frames_stolen++;
+  return intact;
+}
 
+void VisionIpcClient::free_leases(){
+  if (!leases) return;
+
+  if (slot >= 0) {
+    leases->leased[slot] = 0;
+    leases->owner[slot] = 0;
+    slot = -1;
+  }
+  lease_buf.free();
+  leases = nullptr;
+}
 
 VisionIpcClient::~VisionIpcClient(){
+  release();
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i].free();
   }
+  free_leases();
 
   delete sock;
   delete poller;
@@ -19,14 +19,26 @@ private:
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
 
+  VisionBuf lease_buf;
+  VisionIpcLeases * leases = nullptr;
+  int slot = -1;
+  VisionBuf * leased = nullptr;
+  uint64_t leased_seq = 0;
+
   void init_msgq(bool conflate);
+  void free_leases();
 
 public:
   bool connected = false;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+  uint64_t frames_dropped = 0; // replaced by the server before they were received
+  uint64_t frames_stolen = 0;  // overwritten by the server while leased
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
+  // The returned buffer is leased until the next recv or release
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  // Returns false if the server had to overwrite the buffer while it was leased
+  bool release();
   bool connect(bool blocking=true);
 };
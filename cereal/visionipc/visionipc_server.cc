@@ -2,8 +2,10 @@
 #include <chrono>
 #include <cassert>
 #include <random>
+#include <cstring>
 
 #include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -20,6 +22,11 @@ std::string get_endpoint_name(std::string name, VisionStreamType type){
   }
 }
 
+// A pid that was reused keeps the slot until that process exits as well
+static bool process_alive(pid_t pid){
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
 VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_context ctx) : name(name), device_id(device_id), ctx(ctx) {
   msg_ctx = Context::create();
 
@@ -61,6 +68,16 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
 
   cur_idx[type] = 0;
 
+  // Lease table, sent to clients along with the buffers
+  VisionBuf* lease_buf = new VisionBuf();
+  lease_buf->allocate(sizeof(VisionIpcLeases));
+  memset(lease_buf->addr, 0, sizeof(VisionIpcLeases));
+  lease_bufs[type] = lease_buf;
+  leases[type] = (VisionIpcLeases*)lease_buf->addr;
+  writing[type] = nullptr;
+  seq[type] = 0;
+  stats[type] = {};
+
   // Create msgq publisher for each of the `name` + type combos
   // TODO: compute port number directly if using zmq
   sockets[type] = PubSocket::create(msg_ctx, get_endpoint_name(name, type), false);
@@ -110,17 +127,23 @@ void VisionIpcServer::listener(){
       continue;
     }
 
+    // Make room for clients that reconnect after crashing
+    reclaim_dead_clients(leases[type]);
+
     int fds[VISIONIPC_MAX_FDS];
-    int num_fds = buffers[type].size();
+    int num_fds = buffers[type].size() + 1;
     VisionBuf bufs[VISIONIPC_MAX_FDS];
 
+    // The lease table goes last
     for (int i = 0; i < num_fds; i++){
-      fds[i] = buffers[type][i]->fd;
-      bufs[i] = *buffers[type][i];
+      VisionBuf *b = i < num_fds - 1 ? buffers[type][i] : lease_bufs[type];
+      fds[i] = b->fd;
+      bufs[i] = *b;
 
       // Remove some private openCL/ion metadata
       bufs[i].buf_cl = 0;
       bufs[i].copy_q = 0;
+      bufs[i].zero_copy = false;
       bufs[i].handle = 0;
       bufs[i].owner = false;
 
@@ -138,11 +161,72 @@ void VisionIpcServer::listener(){
 
 
 
+bool VisionIpcServer::is_leased(VisionIpcLeases *l, size_t idx){
+  bool leased = false;
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+    uint32_t lease = idx + 1;
+    if (l->leased[i] != lease) continue;
+
+    // Take the lease back from a client that died while reading
+    int32_t pid = l->owner[i];
+    if (pid != 0 && !process_alive(pid)){
+      l->leased[i].compare_exchange_strong(lease, 0);
+      l->owner[i].compare_exchange_strong(pid, 0);
+      continue;
+    }
+    leased = true;
+  }
+  return leased;
+}
+
+void VisionIpcServer::reclaim_dead_clients(VisionIpcLeases *l){
+  for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+    int32_t pid = l->owner[i];
+    if (pid == 0 || process_alive(pid)) continue;
+
+    // Free the lease before the slot, a new owner must find it empty
+    l->leased[i] = 0;
+    l->owner[i].compare_exchange_strong(pid, 0);
+  }
+}
+
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  auto &b = buffers[type];
+  VisionIpcLeases *l = leases[type];
+
+  if (writing[type]){
+    l->writer[writing[type]->idx] = 0;
+  }
+
+  // Skip buffers clients are still reading from. Mark the buffer before looking for leases,
+  // a client taking a lease at the same time sees the mark and drops the frame
+  size_t idx = 0;
+  bool found = false;
+  for (size_t i = 0; i < b.size() && !found; i++){
+    idx = cur_idx[type]++ % b.size();
+    l->writer[idx] = 1;
+    found = !is_leased(l, idx);
+    if (!found) {
+      l->writer[idx] = 0;
+      stats[type].frames_skipped++;
+    }
+  }
+
+  // All of them are leased, overwrite the next one anyway. Its readers find out on release
+  if (!found){
+    idx = cur_idx[type]++ % b.size();
+    l->writer[idx] = 1;
+    stats[type].frames_stolen++;
+  }
+
+  l->seq[idx] = ++seq[type];
+  return writing[type] = b[idx];
+}
+
+VisionIpcBufStats VisionIpcServer::get_stats(VisionStreamType type){
+  assert(stats.count(type));
+  return stats[type];
 }
 
 void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
@@ -154,8 +238,14 @@ void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.seq = leases[buf->type]->seq[buf->idx];
   packet.extra = *extra;
 
+  if (writing[buf->type] == buf){
+    leases[buf->type]->writer[buf->idx] = 0;
+    writing[buf->type] = nullptr;
+  }
+
   sockets[buf->type]->send((char*)&packet, sizeof(packet));
 }
 
@@ -170,6 +260,10 @@ VisionIpcServer::~VisionIpcServer(){
       delete b;
     }
   }
+  for( auto const& [type, b] : lease_bufs ) {
+    b->free();
+    delete b;
+  }
 
   // Messaging cleanup
   for( auto const& [type, sock] : sockets ) {
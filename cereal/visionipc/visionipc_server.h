@@ -25,16 +25,27 @@ class VisionIpcServer {
   std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
   std::map<VisionStreamType, std::map<VisionBuf*, size_t> > idxs;
 
+  std::map<VisionStreamType, VisionBuf*> lease_bufs;
+  std::map<VisionStreamType, VisionIpcLeases*> leases;
+  std::map<VisionStreamType, VisionBuf*> writing;
+  std::map<VisionStreamType, uint64_t> seq;
+  std::map<VisionStreamType, VisionIpcBufStats> stats;
+
   Context * msg_ctx;
   std::map<VisionStreamType, PubSocket*> sockets;
 
   void listener(void);
+  bool is_leased(VisionIpcLeases *l, size_t idx);
+  void reclaim_dead_clients(VisionIpcLeases *l);
 
  public:
   VisionIpcServer(std::string name, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcServer();
 
+  // Takes the next buffer no client is reading from. One buffer per stream can be in flight,
+  // a buffer that was never sent is given back on the next call.
   VisionBuf * get_buffer(VisionStreamType type);
+  VisionIpcBufStats get_stats(VisionStreamType type);
 
   void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
   void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
@@ -1,5 +1,10 @@
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "catch2/catch.hpp"
 #include "visionipc_server.h"
@@ -133,3 +138,169 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->idx == buf->idx);
+
+  // The client holds on to its frame, the server keeps using the other buffer
+  for (int i = 0; i < 3; i++){
+    VisionBuf * next = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(next->idx != buf->idx);
+    server.send(next, &extra);
+  }
+
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).frames_skipped == 2);
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).frames_stolen == 0);
+  REQUIRE(client.release());
+}
+
+TEST_CASE("Overwriting a leased buffer is reported"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 1;
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(buf, &extra);
+  REQUIRE(client.recv() != nullptr);
+
+  // Only one buffer, the server has to take it from the client
+  buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).frames_stolen == 1);
+  REQUIRE_FALSE(client.release());
+  REQUIRE(client.frames_stolen == 1);
+
+  // Frames replaced before the client got to them are dropped
+  extra.frame_id = 2;
+  server.send(buf, &extra);
+  buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(client.recv() == nullptr);
+  REQUIRE(client.frames_dropped == 1);
+
+  extra.frame_id = 3;
+  server.send(buf, &extra);
+  VisionIpcBufExtra extra_recv = {0};
+  REQUIRE(client.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.frame_id == 3);
+}
+
+TEST_CASE("Leases of a dead client are reclaimed"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  int to_child[2], to_parent[2];
+  REQUIRE(pipe(to_child) == 0);
+  REQUIRE(pipe(to_parent) == 0);
+
+  // The child leases the only buffer and dies without releasing it
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0){
+    VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+    char c = client.connect();
+    write(to_parent[1], &c, 1);
+    read(to_child[0], &c, 1);
+    c = client.recv(nullptr, 1000) != nullptr;
+    write(to_parent[1], &c, 1);
+    _exit(0);
+  }
+
+  char c = 0;
+  REQUIRE(read(to_parent[0], &c, 1) == 1);
+  REQUIRE(c);
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(buf, &extra);
+  write(to_child[1], &c, 1);
+  REQUIRE(read(to_parent[0], &c, 1) == 1);
+  REQUIRE(c);
+  waitpid(pid, nullptr, 0);
+
+  buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).frames_stolen == 0);
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).frames_skipped == 0);
+
+  for (int fd : {to_child[0], to_child[1], to_parent[0], to_parent[1]}) close(fd);
+}
+
+TEST_CASE("Throughput 3 cameras at 20 fps"){
+  const size_t width = 1928, height = 1208, num_frames = 40;
+  const VisionStreamType types[] = {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_FRONT, VISION_STREAM_YUV_WIDE};
+
+  VisionIpcServer server("camerad");
+  for (auto type : types){
+    server.create_buffers(type, 4, false, width, height);
+  }
+  server.start_listener();
+
+  std::vector<std::thread> clients;
+  std::atomic<int> ready = 0;
+  size_t received[3] = {}, intact[3] = {};
+  for (int c = 0; c < 3; c++){
+    clients.emplace_back([&, c](){
+      VisionIpcClient client = VisionIpcClient("camerad", types[c], false);
+      client.connect();
+      ready++;
+
+      // The frame is shared, not copied: the client sees what the server wrote, and it wasn't replaced while reading
+      VisionIpcBufExtra extra = {0};
+      while (received[c] < num_frames){
+        VisionBuf * buf = client.recv(&extra, 1000);
+        if (buf == nullptr) break;
+        received[c]++;
+        bool ok = buf->y[0] == (uint8_t)extra.frame_id && buf->y[buf->len - 1] == (uint8_t)extra.frame_id;
+        if (client.release() && ok) intact[c]++;
+      }
+    });
+  }
+  while (ready < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  zmq_sleep();
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < num_frames; i++){
+    std::this_thread::sleep_until(start + std::chrono::milliseconds(50) * i);
+
+    for (auto type : types){
+      VisionBuf * buf = server.get_buffer(type);
+      memset(buf->addr, i, buf->len);
+
+      VisionIpcBufExtra extra = {0};
+      extra.frame_id = i;
+      server.send(buf, &extra);
+    }
+  }
+
+  for (auto &t : clients) t.join();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // the clients keep up with 20 fps, give them one more frame and some slack for the last one
+  REQUIRE(elapsed < std::chrono::milliseconds(50) * num_frames + std::chrono::milliseconds(500));
+
+  for (int c = 0; c < 3; c++){
+    REQUIRE(received[c] == num_frames);
+    REQUIRE(intact[c] == num_frames);
+    REQUIRE(server.get_stats(types[c]).frames_stolen == 0);
+  }
+}
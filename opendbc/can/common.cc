@@ -1,72 +1,83 @@
+#include <cassert>
+
 #include "common.h"
 
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+// Sum of all nibbles, SIMD within a register: add nibble pairs into bytes, then sum the bytes with a multiply
+static inline unsigned int nibble_sum(uint64_t d) {
+  d = (d & 0x0F0F0F0F0F0F0F0FULL) + ((d >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  return (d * 0x0101010101010101ULL) >> 56;
+}
+
+// Sum of all bytes, using 16 bit lanes so the partial sums can't overflow
+static inline unsigned int byte_sum(uint64_t d) {
+  d = (d & 0x00FF00FF00FF00FFULL) + ((d >> 8) & 0x00FF00FF00FF00FFULL);
+  return (d * 0x0001000100010001ULL) >> 48;
+}
+
+static inline unsigned int honda_checksum_impl(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 4; // remove checksum
 
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
-  s = 8-s;
-  s &= 0xF;
-
-  return s;
+  int s = 8 - nibble_sum(address) - nibble_sum(d);
+  return s & 0xF;
 }
 
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+static inline unsigned int toyota_checksum_impl(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
-
-  return s & 0xFF;
+  return (l + byte_sum(address) + byte_sum(d)) & 0xFF;
 }
 
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
+static inline unsigned int subaru_checksum_impl(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
+  d &= (1ULL << ((l-1)*8)) - 1; // checksum is first byte
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
-
-  return s & 0xFF;
+  return (byte_sum(address) + byte_sum(d)) & 0xFF;
 }
 
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+// Static lookup tables for fast computation of CRC8 poly 0x1D (SAE J1850, Chrysler) and poly 0xD5 (pedal)
+uint8_t crc8_lut_1d[256];
+uint8_t crc8_lut_d5[256];
+
+static inline unsigned int chrysler_checksum_impl(unsigned int address, uint64_t d, int l) {
   /* This function does not want the checksum byte in the input data.
   jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
   uint8_t checksum = 0xFF;
   for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
+    checksum = crc8_lut_1d[checksum ^ ((d >> 8*j) & 0xFF)];
   }
   return ~checksum & 0xFF;
 }
 
+static inline unsigned int pedal_checksum_impl(uint64_t d, int l) {
+  uint8_t crc = 0xFF; // standard crc8, poly 0xD5
+
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  for (int i = 0; i < l - 1; i++) {
+    crc = crc8_lut_d5[crc ^ ((d >> (i*8)) & 0xFF)];
+  }
+  return crc;
+}
+
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+  return honda_checksum_impl(address, d, l);
+}
+
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+  return toyota_checksum_impl(address, d, l);
+}
+
+unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
+  return subaru_checksum_impl(address, d, l);
+}
+
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  return chrysler_checksum_impl(address, d, l);
+}
+
 // Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
 uint8_t crc8_lut_8h2f[256];
 
@@ -90,6 +101,8 @@ void init_crc_lookup_tables() {
   // At init time, set up static lookup tables for fast CRC computation.
 
   gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+  gen_crc_lookup_table(0x1D, crc8_lut_1d);      // CRC-8 SAE J1850 for Chrysler
+  gen_crc_lookup_table(0xD5, crc8_lut_d5);      // CRC-8 for the comma pedal
 }
 
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
@@ -172,25 +185,34 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
 
 
 unsigned int pedal_checksum(uint64_t d, int l) {
-  uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
-
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
+  return pedal_checksum_impl(d, l);
+}
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
+void checksum_batch(SignalType type, const uint32_t *address, const uint64_t *d, const unsigned int *l,
+                    unsigned int *out, size_t n) {
+  // dispatch once, so each loop only runs one inlined kernel
+  switch (type) {
+    case SignalType::HONDA_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = honda_checksum_impl(address[i], d[i], l[i]);
+      break;
+    case SignalType::TOYOTA_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = toyota_checksum_impl(address[i], d[i], l[i]);
+      break;
+    case SignalType::SUBARU_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = subaru_checksum_impl(address[i], d[i], l[i]);
+      break;
+    case SignalType::CHRYSLER_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = chrysler_checksum_impl(address[i], d[i], l[i]);
+      break;
+    case SignalType::PEDAL_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = pedal_checksum_impl(d[i], l[i]);
+      break;
+    case SignalType::VOLKSWAGEN_CHECKSUM:
+      for (size_t i = 0; i < n; i++) out[i] = volkswagen_crc(address[i], d[i], l[i]);
+      break;
+    default:
+      assert(false);
   }
-  return crc;
 }
 
 
@@ -2,7 +2,7 @@
 
 #include <vector>
 #include <map>
-#include <unordered_map>
+#include <memory>
 
 #include "common_dbc.h"
 #include <capnp/dynamic.h>
@@ -15,13 +15,7 @@
 #define MAX_BAD_COUNTER 5
 
 // Helper functions
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
 void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
-unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
 
@@ -30,8 +24,17 @@ public:
   uint32_t address;
   unsigned int size;
 
-  std::vector<Signal> parse_sigs;
-  std::vector<double> vals;
+  // Point into the arenas of the owning CANParser
+  const Signal *parse_sigs;
+  double *vals;
+  size_t num_sigs;
+
+  // generated decoder for this message, fills all_vals for every signal in the DBC message.
+  // sig_index maps parse_sigs to their position in all_vals
+  MsgDecodeFn decode;
+  const int *sig_index;
+  double *all_vals;
+  int counter_size;
 
   uint16_t ts;
   uint64_t seen;
@@ -42,6 +45,7 @@ public:
 
   bool ignore_checksum = false;
   bool ignore_counter = false;
+  bool updated = false;
 
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
@@ -53,7 +57,24 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+
+  // Sorted by address, message_states[i] belongs to addresses[i]
+  std::vector<uint32_t> addresses;
+  std::vector<MessageState> message_states;
+
+  // Contiguous storage for the signals of all messages, indexed through MessageState
+  std::vector<Signal> sig_arena;
+  std::vector<int> sig_index_arena;
+  std::vector<double> val_arena;
+  std::vector<double> decode_buf;
+
+  // indices of the message states parsed since the last query_latest
+  std::vector<uint32_t> updated_states;
+
+  struct MessageSpec;
+  void init_states(const std::map<uint32_t, MessageSpec> &specs);
+  int lookup(uint32_t address);
+  void mark_updated(uint32_t idx);
 
 public:
   bool can_valid = false;
@@ -63,23 +84,88 @@ public:
             const std::vector<MessageParseOptions> &options,
             const std::vector<SignalParseOptions> &sigoptions);
   CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter);
+  CANParser(const CANParser&) = delete;
+  CANParser& operator=(const CANParser&) = delete;
   #ifndef DYNAMIC_CAPNP
   void update_string(const std::string &data, bool sendcan);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   #endif
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
+  void UpdateFrame(uint64_t sec, uint32_t address, uint16_t bus_time, const uint8_t *dat, size_t len);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+  // Fills vals with the signals of messages parsed since the previous call. Reuses the capacity of vals,
+  // so this doesn't allocate once vals has grown to fit the largest update.
+  void query_latest(std::vector<SignalValue> &vals);
+};
+
+// Parses the frames of several buses in a single pass over the can list, routing each frame by src
+class MultiBusCANParser {
+private:
+  kj::Array<capnp::word> aligned_buf;
+  std::string dbc_name;
+  std::vector<std::unique_ptr<CANParser>> parsers;
+  CANParser *bus_parsers[256] = {}; // indexed by src
+
+public:
+  uint64_t last_sec = 0;
+
+  MultiBusCANParser(const std::string& dbc_name);
+  CANParser *add_bus(int bus, const std::vector<MessageParseOptions> &options,
+                     const std::vector<SignalParseOptions> &sigoptions);
+  CANParser *get_bus(int bus) { return bus_parsers[bus & 0xFF]; }
+  #ifndef DYNAMIC_CAPNP
+  void update_string(const std::string &data, bool sendcan);
+  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
+  #endif
+  void UpdateValid(uint64_t sec);
+};
+
+// Pre-resolved signal, see CANPacker::lookup_signal_handle
+struct SignalHandleValue {
+  int handle;
+  double value;
+};
+
+struct CANPackMessage {
+  int msg_handle;
+  std::vector<SignalHandleValue> values;
+  int counter;
 };
 
 class CANPacker {
 private:
+  struct PackMessage {
+    uint32_t address;
+    unsigned int size;
+    int counter_sig, checksum_sig; // signal handles, -1 if not present
+  };
+
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
+  std::map<std::pair<uint32_t, std::string>, int> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::vector<Signal> signals;
+  std::vector<PackMessage> messages;
+
+  std::vector<SignalHandleValue> resolved_values;
+
+  // scratch buffers for pack_batch
+  std::vector<size_t> batch_idx;
+  std::vector<uint32_t> batch_address;
+  std::vector<uint64_t> batch_dat;
+  std::vector<unsigned int> batch_size;
+  std::vector<unsigned int> batch_chksm;
+
+  uint64_t pack_signals(const PackMessage &msg, const std::vector<SignalHandleValue> &values, int counter);
 
 public:
   CANPacker(const std::string& dbc_name);
+  // Resolve a message or signal once, the handles are only array indices during packing. -1 if undefined
+  int lookup_message_handle(uint32_t address);
+  int lookup_signal_handle(uint32_t address, const std::string &name);
+  uint64_t pack_handles(int msg_handle, const std::vector<SignalHandleValue> &values, int counter);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
+  // Packs all messages into out, computing the checksums of the whole batch at once
+  void pack_batch(const std::vector<CANPackMessage> &msgs, std::vector<uint64_t> &out);
   Msg* lookup_message(uint32_t address);
 };
@@ -78,7 +78,26 @@ cdef extern from "common.h":
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    void query_latest(vector[SignalValue]&)
+
+  cdef cppclass MultiBusCANParser:
+    MultiBusCANParser(string)
+    CANParser *add_bus(int, vector[MessageParseOptions], vector[SignalParseOptions])
+    void update_string(string, bool)
+
+  cdef struct SignalHandleValue:
+    int handle
+    double value
+
+  cdef struct CANPackMessage:
+    int msg_handle
+    vector[SignalHandleValue] values
+    int counter
 
   cdef cppclass CANPacker:
    CANPacker(string)
+   int lookup_message_handle(uint32_t)
+   int lookup_signal_handle(uint32_t, string)
+   uint64_t pack_handles(int, vector[SignalHandleValue]&, int counter)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   void pack_batch(vector[CANPackMessage]&, vector[uint64_t]&)
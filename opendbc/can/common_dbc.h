@@ -52,12 +52,17 @@ struct Signal {
   SignalType type;
 };
 
+// Generated straight-line decoder for one message. Writes the scaled value of every signal in Msg::sigs order,
+// and the raw counter if the message has one. Returns false if check_checksum is set and the checksum doesn't match.
+typedef bool (*MsgDecodeFn)(uint64_t dat_le, uint64_t dat_be, bool check_checksum, int64_t *counter, double *vals);
+
 struct Msg {
   const char* name;
   uint32_t address;
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  MsgDecodeFn decode;
 };
 
 struct Val {
@@ -75,7 +80,19 @@ struct DBC {
   size_t num_vals;
 };
 
+// Checksum helpers, also used by the generated decoders
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
+unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
+unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
+unsigned int pedal_checksum(uint64_t d, int l);
+// Computes the checksums of n frames of the same checksum type into out, d is in the byte order the type expects
+void checksum_batch(SignalType type, const uint32_t *address, const uint64_t *d, const unsigned int *l,
+                    unsigned int *out, size_t n);
+
 std::vector<const DBC*>& get_dbcs();
+const Msg* dbc_lookup_msg(const DBC* dbc, uint32_t address);
 const DBC* dbc_lookup(const std::string& dbc_name);
 
 void dbc_register(const DBC* dbc);
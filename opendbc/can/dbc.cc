@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 
 #include "common_dbc.h"
 
@@ -16,6 +17,13 @@ const DBC* dbc_lookup(const std::string& dbc_name) {
   return NULL;
 }
 
+// msgs are sorted by address by process_dbc.py
+const Msg* dbc_lookup_msg(const DBC* dbc, uint32_t address) {
+  const Msg* end = dbc->msgs + dbc->num_msgs;
+  const Msg* msg = std::lower_bound(dbc->msgs, end, address, [](const Msg& m, uint32_t a) { return m.address < a; });
+  return (msg != end && msg->address == address) ? msg : NULL;
+}
+
 void dbc_register(const DBC* dbc) {
   get_dbcs().push_back(dbc);
 }
@@ -19,30 +19,33 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{sig_type(address, sig)}},
     },
   {% endfor %}
 };
+
+bool decode_{{address}}(uint64_t dat_le, uint64_t dat_be, bool check_checksum, int64_t *counter, double *vals) {
+  int64_t tmp;
+  {% for sig in sigs %}
+    {% if sig.is_little_endian %}
+  tmp = (dat_le >> {{sig.start_bit}}) & {{mask(sig.size)}};
+    {% else %}
+      {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
+  tmp = {{be_shift(b1, sig.size)}} & {{mask(sig.size)}};
+    {% endif %}
+    {% if sig.is_signed %}
+  tmp = (tmp ^ {{sign_bit(sig.size)}}) - {{sign_bit(sig.size)}};
+    {% endif %}
+    {% set type = sig_type(address, sig) %}
+    {% if type.endswith("_CHECKSUM") %}
+  if (check_checksum && {{checksum_call(address, type, msg_size)}} != tmp) return false;
+    {% elif type.endswith("_COUNTER") %}
+  *counter = tmp;
+    {% endif %}
+  vals[{{loop.index0}}] = tmp * {{cdouble(sig.factor)}} + {{cdouble(sig.offset)}};
+  {% endfor %}
+  return true;
+}
 {% endfor %}
 
 const Msg msgs[] = {
@@ -54,6 +57,7 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    .decode = decode_{{address}},
   },
 {% endfor %}
 };
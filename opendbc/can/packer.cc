@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <cstring>
 
 #include "common.h"
 
@@ -37,31 +38,73 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
 
+  // a message handle is the index in dbc->msgs, a signal handle the index in signals
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
     message_lookup[msg->address] = *msg;
+
+    PackMessage pack_msg = {
+      .address = msg->address,
+      .size = msg->size,
+      .counter_sig = -1,
+      .checksum_sig = -1,
+    };
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+      int handle = signals.size();
+      signals.push_back(*sig);
+      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = handle;
+
+      if (strcmp(sig->name, "COUNTER") == 0) {
+        pack_msg.counter_sig = handle;
+      } else if (strcmp(sig->name, "CHECKSUM") == 0) {
+        switch (sig->type) {
+          case SignalType::HONDA_CHECKSUM:
+          case SignalType::TOYOTA_CHECKSUM:
+          case SignalType::VOLKSWAGEN_CHECKSUM:
+          case SignalType::SUBARU_CHECKSUM:
+          case SignalType::CHRYSLER_CHECKSUM:
+            pack_msg.checksum_sig = handle;
+            break;
+          default:
+            //WARN("CHECKSUM signal type not valid\n");
+            break;
+        }
+      }
     }
+    messages.push_back(pack_msg);
   }
   init_crc_lookup_tables();
 }
 
-uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
-  uint64_t ret = 0;
-  for (const auto& sigval : signals) {
-    std::string name = std::string(sigval.name);
-    double value = sigval.value;
+int CANPacker::lookup_message_handle(uint32_t address) {
+  const Msg *msg = dbc_lookup_msg(dbc, address);
+  if (!msg) {
+    WARN("undefined message %d\n", address);
+    return -1;
+  }
+  return msg - dbc->msgs;
+}
 
-    auto sig_it = signal_lookup.find(std::make_pair(address, name));
-    if (sig_it == signal_lookup.end()) {
-      WARN("undefined signal %s - %d\n", name.c_str(), address);
+int CANPacker::lookup_signal_handle(uint32_t address, const std::string &name) {
+  auto sig_it = signal_lookup.find(std::make_pair(address, name));
+  if (sig_it == signal_lookup.end()) {
+    WARN("undefined signal %s - %d\n", name.c_str(), address);
+    return -1;
+  }
+  return sig_it->second;
+}
+
+uint64_t CANPacker::pack_signals(const PackMessage &msg, const std::vector<SignalHandleValue> &values, int counter) {
+  uint64_t ret = 0;
+  for (const auto& sigval : values) {
+    if (sigval.handle < 0 || sigval.handle >= (int)signals.size()) {
+      WARN("invalid signal handle %d\n", sigval.handle);
       continue;
     }
-    const auto& sig = sig_it->second;
+    const Signal &sig = signals[sigval.handle];
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
+    int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
     if (ival < 0) {
       ival = (1ULL << sig.b2) + ival;
     }
@@ -70,12 +113,11 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
   }
 
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (msg.counter_sig < 0) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const Signal &sig = signals[msg.counter_sig];
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
@@ -84,35 +126,99 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
     ret = set_value(ret, sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
-    if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
-      // until later in the pack process. Checksums can be run backwards, CRCs not so much.
-      // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else {
-      //WARN("CHECKSUM signal type not valid\n");
-    }
+  return ret;
+}
+
+// FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
+// until later in the pack process. Checksums can be run backwards, CRCs not so much.
+// The correct fix is unclear but this works for the moment.
+static inline uint64_t checksum_input(SignalType type, uint64_t dat) {
+  if (type == SignalType::VOLKSWAGEN_CHECKSUM || type == SignalType::CHRYSLER_CHECKSUM) {
+    return ReverseBytes(dat);
+  }
+  return dat;
+}
+
+uint64_t CANPacker::pack_handles(int msg_handle, const std::vector<SignalHandleValue> &values, int counter) {
+  if (msg_handle < 0 || msg_handle >= (int)messages.size()) {
+    WARN("invalid message handle %d\n", msg_handle);
+    return 0;
+  }
+  const PackMessage &msg = messages[msg_handle];
+  uint64_t ret = pack_signals(msg, values, counter);
+
+  if (msg.checksum_sig >= 0) {
+    const Signal &sig = signals[msg.checksum_sig];
+    uint64_t dat = checksum_input(sig.type, ret);
+    unsigned int chksm;
+    checksum_batch(sig.type, &msg.address, &dat, &msg.size, &chksm, 1);
+    ret = set_value(ret, sig, chksm);
   }
 
   return ret;
 }
 
+uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter) {
+  int msg_handle = lookup_message_handle(address);
+  if (msg_handle < 0) {
+    return 0;
+  }
+
+  resolved_values.clear();
+  for (const auto& sigval : values) {
+    int handle = lookup_signal_handle(address, sigval.name);
+    if (handle >= 0) {
+      resolved_values.push_back({.handle = handle, .value = sigval.value});
+    }
+  }
+
+  return pack_handles(msg_handle, resolved_values, counter);
+}
+
+void CANPacker::pack_batch(const std::vector<CANPackMessage> &msgs, std::vector<uint64_t> &out) {
+  out.resize(msgs.size());
+
+  for (size_t i = 0; i < msgs.size(); i++) {
+    int msg_handle = msgs[i].msg_handle;
+    if (msg_handle < 0 || msg_handle >= (int)messages.size()) {
+      WARN("invalid message handle %d\n", msg_handle);
+      out[i] = 0;
+      continue;
+    }
+    out[i] = pack_signals(messages[msg_handle], msgs[i].values, msgs[i].counter);
+  }
+
+  // Compute the checksums per type, a DBC normally uses a single type so this is one batch
+  for (SignalType type : {SignalType::HONDA_CHECKSUM, SignalType::TOYOTA_CHECKSUM, SignalType::VOLKSWAGEN_CHECKSUM,
+                          SignalType::SUBARU_CHECKSUM, SignalType::CHRYSLER_CHECKSUM}) {
+    batch_idx.clear();
+    batch_address.clear();
+    batch_dat.clear();
+    batch_size.clear();
+    for (size_t i = 0; i < msgs.size(); i++) {
+      int msg_handle = msgs[i].msg_handle;
+      if (msg_handle < 0 || msg_handle >= (int)messages.size()) continue;
+      const PackMessage &msg = messages[msg_handle];
+      if (msg.checksum_sig >= 0 && signals[msg.checksum_sig].type == type) {
+        batch_idx.push_back(i);
+        batch_address.push_back(msg.address);
+        batch_dat.push_back(checksum_input(type, out[i]));
+        batch_size.push_back(msg.size);
+      }
+    }
+    if (batch_idx.empty()) continue;
+
+    batch_chksm.resize(batch_idx.size());
+    checksum_batch(type, batch_address.data(), batch_dat.data(), batch_size.data(), batch_chksm.data(), batch_idx.size());
+
+    for (size_t j = 0; j < batch_idx.size(); j++) {
+      size_t i = batch_idx[j];
+      const PackMessage &msg = messages[msgs[i].msg_handle];
+      out[i] = set_value(out[i], signals[msg.checksum_sig], batch_chksm[j]);
+    }
+  }
+}
+
 Msg* CANPacker::lookup_message(uint32_t address) {
   return &message_lookup[address];
 }
@@ -0,0 +1,116 @@
+// Compares per-frame and batch throughput of CANPacker and the checksum kernels,
+// and packing by signal name against pre-resolved handles.
+// Every message of the DBC is packed with all of its signals set, like a carcontroller building all outgoing frames.
+// usage: packer_benchmark [dbc_name...]
+
+#include <cassert>
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#define ITERATIONS 2000
+
+template <typename F>
+static double time_ns(F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    f();
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench_dbc(const std::string &dbc_name) {
+  const DBC *dbc = dbc_lookup(dbc_name);
+  assert(dbc);
+  CANPacker packer(dbc_name);
+
+  std::vector<uint32_t> addresses;
+  std::vector<std::vector<SignalPackValue>> named;
+  std::vector<CANPackMessage> msgs;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    std::vector<SignalPackValue> values;
+    CANPackMessage m = {.msg_handle = packer.lookup_message_handle(msg.address), .counter = -1};
+    for (int j = 0; j < msg.num_sigs; j++) {
+      if (msg.sigs[j].type != SignalType::DEFAULT) continue;
+      double value = msg.sigs[j].offset + j * msg.sigs[j].factor;
+      values.push_back({.name = msg.sigs[j].name, .value = value});
+      m.values.push_back({.handle = packer.lookup_signal_handle(msg.address, msg.sigs[j].name), .value = value});
+    }
+    addresses.push_back(msg.address);
+    named.push_back(values);
+    msgs.push_back(m);
+  }
+
+  std::vector<uint64_t> by_name(msgs.size()), by_handle(msgs.size()), batch;
+  double name_ns = time_ns([&]() {
+    for (size_t i = 0; i < msgs.size(); i++) {
+      by_name[i] = packer.pack(addresses[i], named[i], -1);
+    }
+  });
+  double handle_ns = time_ns([&]() {
+    for (size_t i = 0; i < msgs.size(); i++) {
+      by_handle[i] = packer.pack_handles(msgs[i].msg_handle, msgs[i].values, msgs[i].counter);
+    }
+  });
+  double batch_ns = time_ns([&]() { packer.pack_batch(msgs, batch); });
+  assert(by_name == by_handle && by_name == batch);
+
+  double frames = (double)msgs.size() * ITERATIONS;
+  printf("%-45s pack %6.0f ns/frame   pack_handles %6.0f ns/frame   pack_batch %6.0f ns/frame\n", dbc_name.c_str(),
+         name_ns / frames, handle_ns / frames, batch_ns / frames);
+}
+
+static void bench_checksums() {
+  const size_t n = 1024;
+  std::vector<uint32_t> address(n);
+  std::vector<uint64_t> dat(n);
+  std::vector<unsigned int> size(n, 8), out(n);
+  for (size_t i = 0; i < n; i++) {
+    address[i] = 0x100 + i;
+    dat[i] = 0x0123456789ABCDEFULL * (i + 1);
+  }
+
+  struct Kernel {
+    const char *name;
+    SignalType type;
+    unsigned int (*f)(unsigned int, uint64_t, int);
+  };
+  Kernel kernels[] = {
+    {"honda_checksum", SignalType::HONDA_CHECKSUM, honda_checksum},
+    {"toyota_checksum", SignalType::TOYOTA_CHECKSUM, toyota_checksum},
+    {"subaru_checksum", SignalType::SUBARU_CHECKSUM, subaru_checksum},
+    {"chrysler_checksum", SignalType::CHRYSLER_CHECKSUM, chrysler_checksum},
+  };
+
+  for (auto &k : kernels) {
+    double single_ns = time_ns([&]() {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = k.f(address[i], dat[i], size[i]);
+      }
+    });
+    double batch_ns = time_ns([&]() {
+      checksum_batch(k.type, address.data(), dat.data(), size.data(), out.data(), n);
+    });
+    printf("%-45s per frame %6.2f ns/frame   checksum_batch %6.2f ns/frame\n", k.name,
+           single_ns / (n * ITERATIONS), batch_ns / (n * ITERATIONS));
+  }
+}
+
+int main(int argc, char **argv) {
+  init_crc_lookup_tables();
+  bench_checksums();
+
+  std::vector<std::string> dbcs = {"honda_civic_touring_2016_can_generated", "toyota_rav4_2017_pt_generated",
+                                   "vw_mqb_2010", "subaru_global_2017_generated", "chrysler_pacifica_2017_hybrid"};
+  if (argc > 1) {
+    dbcs.assign(argv + 1, argv + argc);
+  }
+  for (auto &dbc_name : dbcs) {
+    bench_dbc(dbc_name);
+  }
+  return 0;
+}
@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from .common cimport CANPacker as cpp_CANPacker
-from .common cimport dbc_lookup, SignalPackValue, DBC
+from .common cimport dbc_lookup, SignalHandleValue, CANPackMessage, DBC
 
 
 cdef class CANPacker:
@@ -18,6 +18,8 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    map[int, int] address_to_handle
+    dict signal_handles
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -30,22 +32,35 @@ cdef class CANPacker:
       msg = self.dbc[0].msgs[i]
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
+      self.address_to_handle[msg.address] = self.packer.lookup_message_handle(msg.address)
+    self.signal_handles = {}
 
-  cdef uint64_t pack(self, addr, values, counter):
-    cdef vector[SignalPackValue] values_thing
-    cdef SignalPackValue spv
+  cdef void resolve_values(self, int addr, values, vector[SignalHandleValue] &out):
+    # signal names are resolved to handles on first use, then only looked up in this dict
+    cdef SignalHandleValue shv
+    handles = self.signal_handles.get(addr)
+    if handles is None:
+      handles = self.signal_handles[addr] = {}
 
-    names = []
+    out.clear()
+    for name, value in values.items():
+      handle = handles.get(name)
+      if handle is None:
+        handle = handles[name] = self.packer.lookup_signal_handle(addr, name.encode('utf8'))
+      if handle < 0:
+        continue
 
-    for name, value in values.iteritems():
-      n = name.encode('utf8')
-      names.append(n) # TODO: find better way to keep reference to temp string around
+      shv.handle = handle
+      shv.value = value
+      out.push_back(shv)
 
-      spv.name = n
-      spv.value = value
-      values_thing.push_back(spv)
+  cdef uint64_t pack(self, addr, values, counter):
+    cdef vector[SignalHandleValue] values_thing
+    if self.address_to_handle.count(addr) == 0:
+      return 0
 
-    return self.packer.pack(addr, values_thing, counter)
+    self.resolve_values(addr, values, values_thing)
+    return self.packer.pack_handles(self.address_to_handle[addr], values_thing, counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
@@ -67,3 +82,35 @@ cdef class CANPacker:
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_can_msgs(self, msgs):
+    """Packs a list of (name_or_addr, bus, values, counter) in one call, checksums are computed for the whole batch"""
+    cdef vector[CANPackMessage] batch
+    cdef CANPackMessage m
+    cdef vector[uint64_t] packed
+    cdef uint64_t val
+    cdef int addr, size
+
+    addrs = []
+    for name_or_addr, bus, values, counter in msgs:
+      if type(name_or_addr) == int:
+        addr = name_or_addr
+        size = self.address_to_size[name_or_addr]
+      else:
+        addr, size = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+      if self.address_to_handle.count(addr) == 0:
+        raise KeyError(addr)
+      addrs.append((addr, size, bus))
+
+      m.msg_handle = self.address_to_handle[addr]
+      m.counter = counter
+      self.resolve_values(addr, values, m.values)
+      batch.push_back(m)
+
+    self.packer.pack_batch(batch, packed)
+
+    ret = []
+    for i, (addr, size, bus) in enumerate(addrs):
+      val = self.ReverseBytes(packed[i])
+      ret.append([addr, 0, (<char *>&val)[:size], bus])
+    return ret
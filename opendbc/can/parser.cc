@@ -17,72 +17,20 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
   uint64_t dat_le = read_u64_le(dat);
   uint64_t dat_be = read_u64_be(dat);
 
-  for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
-
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
-    }
-
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
-    }
-
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+  int64_t cnt = 0;
+  if (!decode(dat_le, dat_be, !ignore_checksum, &cnt, all_vals)) {
+    INFO("0x%X CHECKSUM FAIL\n", address);
+    return false;
+  }
 
-    if (!ignore_checksum) {
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        if (toyota_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-        if (volkswagen_crc(address, dat_le, size) != tmp) {
-          INFO("0x%X CRC FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-        if (subaru_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-        if (chrysler_checksum(address, dat_le, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-        if (pedal_checksum(dat_be, size) != tmp) {
-          INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
-          return false;
-        }
-      }
-    }
-    if (!ignore_counter) {
-      if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-          if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      }
+  if (!ignore_counter && counter_size > 0) {
+    if (!update_counter_generic(cnt, counter_size)) {
+      return false;
     }
+  }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+  for (int i = 0; i < num_sigs; i++) {
+    vals[i] = all_vals[sig_index[i]];
   }
   ts = ts_;
   seen = sec;
@@ -109,6 +57,88 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
 }
 
 
+struct CANParser::MessageSpec {
+  const Msg *msg;
+  uint64_t check_threshold;
+  bool ignore_checksum, ignore_counter;
+  std::vector<std::pair<int, double>> sigs; // index in msg->sigs, default value
+};
+
+void CANParser::init_states(const std::map<uint32_t, MessageSpec> &specs) {
+  size_t total_sigs = 0, max_msg_sigs = 0;
+  for (const auto& kv : specs) {
+    total_sigs += kv.second.sigs.size();
+    max_msg_sigs = std::max(max_msg_sigs, kv.second.msg->num_sigs);
+  }
+
+  addresses.reserve(specs.size());
+  message_states.reserve(specs.size());
+  sig_arena.reserve(total_sigs);
+  sig_index_arena.reserve(total_sigs);
+  val_arena.reserve(total_sigs);
+  decode_buf.resize(max_msg_sigs);
+
+  for (const auto& kv : specs) {
+    const MessageSpec &spec = kv.second;
+    MessageState state = {};
+    state.address = spec.msg->address;
+    state.size = spec.msg->size;
+    state.decode = spec.msg->decode;
+    state.check_threshold = spec.check_threshold;
+    state.ignore_checksum = spec.ignore_checksum;
+    state.ignore_counter = spec.ignore_counter;
+    state.num_sigs = spec.sigs.size();
+
+    for (int i = 0; i < spec.msg->num_sigs; i++) {
+      const Signal &sig = spec.msg->sigs[i];
+      if (sig.type == SignalType::HONDA_COUNTER || sig.type == SignalType::VOLKSWAGEN_COUNTER || sig.type == SignalType::PEDAL_COUNTER) {
+        state.counter_size = sig.b2;
+      }
+    }
+
+    for (const auto& sig : spec.sigs) {
+      sig_arena.push_back(spec.msg->sigs[sig.first]);
+      sig_index_arena.push_back(sig.first);
+      val_arena.push_back(sig.second);
+    }
+
+    addresses.push_back(state.address);
+    message_states.push_back(state);
+  }
+
+  // arenas don't grow anymore, point the states into them
+  size_t offset = 0;
+  for (auto& state : message_states) {
+    state.parse_sigs = sig_arena.data() + offset;
+    state.sig_index = sig_index_arena.data() + offset;
+    state.vals = val_arena.data() + offset;
+    state.all_vals = decode_buf.data();
+    offset += state.num_sigs;
+  }
+
+  // the first query returns the default values of all signals
+  updated_states.reserve(message_states.size());
+  for (uint32_t i = 0; i < message_states.size(); i++) {
+    mark_updated(i);
+  }
+}
+
+void CANParser::mark_updated(uint32_t idx) {
+  MessageState &state = message_states[idx];
+  if (!state.updated) {
+    state.updated = true;
+    updated_states.push_back(idx);
+  }
+}
+
+int CANParser::lookup(uint32_t address) {
+  auto it = std::lower_bound(addresses.begin(), addresses.end(), address);
+  if (it == addresses.end() || *it != address) {
+    return -1;
+  }
+  return it - addresses.begin();
+}
+
 CANParser::CANParser(int abus, const std::string& dbc_name,
           const std::vector<MessageParseOptions> &options,
           const std::vector<SignalParseOptions> &sigoptions)
@@ -118,36 +148,27 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageSpec> specs;
   for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
-    state.address = op.address;
-    // state.check_frequency = op.check_frequency,
-
-    // msg is not valid if a message isn't received for 10 consecutive steps
-    if (op.check_frequency > 0) {
-      state.check_threshold = (1000000000ULL / op.check_frequency) * 10;
-    }
-
-    const Msg* msg = NULL;
-    for (int i = 0; i < dbc->num_msgs; i++) {
-      if (dbc->msgs[i].address == op.address) {
-        msg = &dbc->msgs[i];
-        break;
-      }
-    }
+    const Msg* msg = dbc_lookup_msg(dbc, op.address);
     if (!msg) {
       fprintf(stderr, "CANParser: could not find message 0x%X in DBC %s\n", op.address, dbc_name.c_str());
       assert(false);
     }
 
-    state.size = msg->size;
+    MessageSpec &spec = specs[op.address];
+    spec.msg = msg;
+    // state.check_frequency = op.check_frequency,
+
+    // msg is not valid if a message isn't received for 10 consecutive steps
+    if (op.check_frequency > 0) {
+      spec.check_threshold = (1000000000ULL / op.check_frequency) * 10;
+    }
 
     // track checksums and counters for this message
     for (int i = 0; i < msg->num_sigs; i++) {
-      const Signal *sig = &msg->sigs[i];
-      if (sig->type != SignalType::DEFAULT) {
-        state.parse_sigs.push_back(*sig);
-        state.vals.push_back(0);
+      if (msg->sigs[i].type != SignalType::DEFAULT) {
+        spec.sigs.push_back({i, 0});
       }
     }
 
@@ -159,13 +180,14 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         const Signal *sig = &msg->sigs[i];
         if (strcmp(sig->name, sigop.name) == 0
             && sig->type == SignalType::DEFAULT) {
-          state.parse_sigs.push_back(*sig);
-          state.vals.push_back(sigop.default_value);
+          spec.sigs.push_back({i, sigop.default_value});
           break;
         }
       }
     }
   }
+
+  init_states(specs);
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -176,23 +198,20 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageSpec> specs;
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    MessageState state = {
-      .address = msg->address,
-      .size = msg->size,
-      .ignore_checksum = ignore_checksum,
-      .ignore_counter = ignore_counter,
-    };
+    MessageSpec &spec = specs[msg->address];
+    spec.msg = msg;
+    spec.ignore_checksum = ignore_checksum;
+    spec.ignore_counter = ignore_counter;
 
     for (int j = 0; j < msg->num_sigs; j++) {
-      const Signal *sig = &msg->sigs[j];
-      state.parse_sigs.push_back(*sig);
-      state.vals.push_back(0);
+      spec.sigs.push_back({j, 0});
     }
-
-    message_states[state.address] = state;
   }
+
+  init_states(specs);
 }
 
 #ifndef DYNAMIC_CAPNP
@@ -228,17 +247,7 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
-      // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-      continue;
-    }
-
-    if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-    uint8_t dat[8] = {0};
-    memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
-
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    UpdateFrame(sec, cmsg.getAddress(), cmsg.getBusTime(), cmsg.getDat().begin(), cmsg.getDat().size());
   }
 }
 #endif
@@ -252,23 +261,29 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
-    DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
+  auto dat = cmsg.get("dat").as<capnp::Data>();
+  UpdateFrame(sec, cmsg.get("address").as<uint32_t>(), cmsg.get("busTime").as<uint16_t>(), dat.begin(), dat.size());
+}
+
+void CANParser::UpdateFrame(uint64_t sec, uint32_t address, uint16_t bus_time, const uint8_t *dat, size_t len) {
+  int idx = lookup(address);
+  if (idx < 0) {
+    // DEBUG("skip %d: not specified\n", address);
     return;
   }
 
-  auto dat = cmsg.get("dat").as<capnp::Data>();
-  if (dat.size() > 8) return; //shouldn't ever happen
+  if (len > 8) return; //shouldn't ever happen
   uint8_t data[8] = {0};
-  memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  memcpy(data, dat, len);
+
+  if (message_states[idx].parse(sec, bus_time, data)) {
+    mark_updated(idx);
+  }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
@@ -280,14 +295,20 @@ void CANParser::UpdateValid(uint64_t sec) {
 
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
+  query_latest(ret);
+  return ret;
+}
+
+void CANParser::query_latest(std::vector<SignalValue> &vals) {
+  vals.clear();
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-    if (last_sec != 0 && state.seen != last_sec) continue;
+  for (uint32_t idx : updated_states) {
+    MessageState &state = message_states[idx];
+    state.updated = false;
 
-    for (int i=0; i<state.parse_sigs.size(); i++) {
+    for (int i=0; i<state.num_sigs; i++) {
       const Signal &sig = state.parse_sigs[i];
-      ret.push_back((SignalValue){
+      vals.push_back((SignalValue){
         .address = state.address,
         .ts = state.ts,
         .name = sig.name,
@@ -295,6 +316,56 @@ std::vector<SignalValue> CANParser::query_latest() {
       });
     }
   }
+  updated_states.clear();
+}
 
-  return ret;
+MultiBusCANParser::MultiBusCANParser(const std::string& dbc_name)
+  : aligned_buf(kj::heapArray<capnp::word>(1024)), dbc_name(dbc_name) {
+  assert(dbc_lookup(dbc_name));
+}
+
+CANParser *MultiBusCANParser::add_bus(int bus, const std::vector<MessageParseOptions> &options,
+                                      const std::vector<SignalParseOptions> &sigoptions) {
+  assert(bus >= 0 && bus < 256 && !bus_parsers[bus]);
+  parsers.push_back(std::make_unique<CANParser>(bus, dbc_name, options, sigoptions));
+  bus_parsers[bus] = parsers.back().get();
+  return bus_parsers[bus];
+}
+
+#ifndef DYNAMIC_CAPNP
+void MultiBusCANParser::update_string(const std::string &data, bool sendcan) {
+  // format for board, make copy due to alignment issues.
+  const size_t buf_size = (data.length() / sizeof(capnp::word)) + 1;
+  if (aligned_buf.size() < buf_size) {
+    aligned_buf = kj::heapArray<capnp::word>(buf_size);
+  }
+  memcpy(aligned_buf.begin(), data.data(), data.length());
+
+  // extract the messages
+  capnp::FlatArrayMessageReader cmsg(aligned_buf.slice(0, buf_size));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  last_sec = event.getLogMonoTime();
+
+  auto cans = sendcan? event.getSendcan() : event.getCan();
+  UpdateCans(last_sec, cans);
+
+  UpdateValid(last_sec);
+}
+
+void MultiBusCANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
+  for (auto cmsg : cans) {
+    CANParser *parser = bus_parsers[cmsg.getSrc() & 0xFF];
+    if (parser) {
+      parser->UpdateFrame(sec, cmsg.getAddress(), cmsg.getBusTime(), cmsg.getDat().begin(), cmsg.getDat().size());
+    }
+  }
+}
+#endif
+
+void MultiBusCANParser::UpdateValid(uint64_t sec) {
+  for (auto &parser : parsers) {
+    parser->last_sec = sec;
+    parser->UpdateValid(sec);
+  }
 }
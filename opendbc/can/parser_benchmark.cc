@@ -0,0 +1,104 @@
+// Replays the can events of an uncompressed rlog through CANParser::UpdateCans and reports frames/sec.
+// Also compares one CANParser per bus for buses 0-2 against a single MultiBusCANParser.
+// usage: parser_benchmark <dbc_name> <rlog> [bus] [iterations]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("usage: %s <dbc_name> <rlog> [bus] [iterations]\n", argv[0]);
+    return 1;
+  }
+  const char *dbc_name = argv[1];
+  int bus = argc > 3 ? atoi(argv[3]) : 0;
+  int iterations = argc > 4 ? atoi(argv[4]) : 100;
+
+  std::ifstream f(argv[2], std::ios::binary);
+  std::vector<char> raw((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if (raw.empty()) {
+    printf("failed to read %s\n", argv[2]);
+    return 1;
+  }
+
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word) + 1);
+  memcpy(buf.begin(), raw.data(), raw.size());
+
+  // keep the readers of all can events around, so the replay only measures parsing
+  std::vector<std::unique_ptr<capnp::FlatArrayMessageReader>> readers;
+  std::vector<cereal::Event::Reader> events;
+  size_t frames = 0, multi_frames = 0;
+
+  kj::ArrayPtr<const capnp::word> words = buf.slice(0, raw.size() / sizeof(capnp::word));
+  while (words.size() > 0) {
+    auto reader = std::make_unique<capnp::FlatArrayMessageReader>(words);
+    words = kj::arrayPtr(reader->getEnd(), words.end());
+
+    cereal::Event::Reader event = reader->getRoot<cereal::Event>();
+    if (event.which() != cereal::Event::CAN) continue;
+
+    for (auto cmsg : event.getCan()) {
+      frames += (cmsg.getSrc() == bus);
+      multi_frames += (cmsg.getSrc() < 3);
+    }
+    events.push_back(event);
+    readers.push_back(std::move(reader));
+  }
+  printf("%zu can events, %zu frames on bus %d\n", events.size(), frames, bus);
+
+  auto report = [&](const std::string &name, size_t num_frames, auto update) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      for (auto &event : events) {
+        update(event.getLogMonoTime(), event.getCan());
+      }
+    }
+    double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-50s %10.0f ns/event %12.0f frames/s\n", (name + "/" + dbc_name).c_str(),
+           dt * 1e9 / (events.size() * iterations), num_frames * iterations / dt);
+  };
+
+  CANParser parser(bus, dbc_name, false, false);
+  report("BM_UpdateCans", frames, [&](uint64_t sec, auto cans) {
+    parser.UpdateCans(sec, cans);
+    parser.UpdateValid(sec);
+  });
+
+  // parse every signal of the DBC on buses 0-2
+  const DBC *dbc = dbc_lookup(dbc_name);
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    options.push_back({.address = msg.address, .check_frequency = 0});
+    for (int j = 0; j < msg.num_sigs; j++) {
+      sigoptions.push_back({.address = msg.address, .name = msg.sigs[j].name, .default_value = 0});
+    }
+  }
+
+  std::vector<std::unique_ptr<CANParser>> bus_parsers;
+  MultiBusCANParser multi(dbc_name);
+  for (int b = 0; b < 3; b++) {
+    bus_parsers.push_back(std::make_unique<CANParser>(b, dbc_name, options, sigoptions));
+    multi.add_bus(b, options, sigoptions);
+  }
+
+  report("BM_UpdateCans_3_parsers", multi_frames, [&](uint64_t sec, auto cans) {
+    for (auto &p : bus_parsers) {
+      p->UpdateCans(sec, cans);
+      p->UpdateValid(sec);
+    }
+  });
+  report("BM_MultiBusUpdateCans", multi_frames, [&](uint64_t sec, auto cans) {
+    multi.UpdateCans(sec, cans);
+    multi.UpdateValid(sec);
+  });
+  return 0;
+}
@@ -9,6 +9,7 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
+from .common cimport MultiBusCANParser as cpp_MultiBusCANParser
 from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
 
 import os
@@ -34,6 +35,9 @@ cdef class CANParser:
     int can_invalid_cnt
 
   def __init__(self, dbc_name, signals, checks=None, bus=0):
+    self._init(dbc_name, signals, checks, bus, NULL)
+
+  cdef _init(self, dbc_name, signals, checks, int bus, cpp_MultiBusCANParser *multi):
     if checks is None:
       checks = []
     self.can_valid = True
@@ -92,14 +96,18 @@ cdef class CANParser:
       mpo.check_frequency = freq
       message_options_v.push_back(mpo)
 
-    self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
+    if multi == NULL:
+      self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
+    else:
+      self.can = multi.add_bus(bus, message_options_v, signal_options_v)
     self.update_vl()
 
   cdef unordered_set[uint32_t] update_vl(self):
     cdef string sig_name
     cdef unordered_set[uint32_t] updated_val
 
-    can_values = self.can.query_latest()
+    # only returns signals of messages that were parsed since the last call, reusing the buffer
+    self.can.query_latest(self.can_values)
     valid = self.can.can_valid
 
     # Update invalid flag
@@ -109,7 +117,7 @@ cdef class CANParser:
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
 
-    for cv in can_values:
+    for cv in self.can_values:
       # Cast char * directly to unicode
       name = <unicode>self.address_to_msg_name[cv.address].c_str()
       cv_name = <unicode>cv.name
@@ -137,6 +145,36 @@ cdef class CANParser:
 
     return updated_vals
 
+cdef class MultiBusCANParser:
+  """Parses several buses in a single pass over each can event.
+  buses maps bus to (signals, checks), parsers[bus] holds the values like a regular CANParser"""
+  cdef:
+    cpp_MultiBusCANParser *can
+
+  cdef readonly:
+    dict parsers
+
+  def __init__(self, dbc_name, buses):
+    if not dbc_lookup(dbc_name):
+      raise RuntimeError("Can't lookup" + dbc_name)
+    self.can = new cpp_MultiBusCANParser(dbc_name)
+    self.parsers = {}
+
+    for bus, (signals, checks) in buses.items():
+      parser = CANParser.__new__(CANParser)
+      (<CANParser>parser)._init(dbc_name, signals, checks, bus, self.can)
+      self.parsers[bus] = parser
+
+  def update_strings(self, strings, sendcan=False):
+    updated_vals = {bus: set() for bus in self.parsers}
+
+    for s in strings:
+      self.can.update_string(s, sendcan)
+      for bus, parser in self.parsers.items():
+        updated_vals[bus].update((<CANParser>parser).update_vl())
+
+    return updated_vals
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -8,6 +8,22 @@ import jinja2
 from collections import Counter
 from opendbc.can.dbc import dbc
 
+# SignalType values with special handling in the parser and packer, see common_dbc.h
+SIGNAL_TYPES = [
+  "HONDA_CHECKSUM", "HONDA_COUNTER", "TOYOTA_CHECKSUM", "PEDAL_CHECKSUM", "PEDAL_COUNTER",
+  "VOLKSWAGEN_CHECKSUM", "VOLKSWAGEN_COUNTER", "SUBARU_CHECKSUM", "CHRYSLER_CHECKSUM",
+]
+
+# checksum function and the byte order of the data it takes, used by the generated decoders
+CHECKSUM_FUNCS = {
+  "HONDA_CHECKSUM": ("honda_checksum", "dat_be"),
+  "TOYOTA_CHECKSUM": ("toyota_checksum", "dat_be"),
+  "PEDAL_CHECKSUM": ("pedal_checksum", "dat_be"),
+  "VOLKSWAGEN_CHECKSUM": ("volkswagen_crc", "dat_le"),
+  "SUBARU_CHECKSUM": ("subaru_checksum", "dat_be"),
+  "CHRYSLER_CHECKSUM": ("chrysler_checksum", "dat_le"),
+}
+
 def process(in_fn, out_fn):
   dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
   # print("processing %s: %s -> %s" % (dbc_name, in_fn, out_fn))
@@ -104,7 +120,43 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+  def sig_type(address, sig):
+    if checksum_type is not None and sig.name in ("CHECKSUM", "COUNTER"):
+      t = "%s_%s" % (checksum_type.upper(), sig.name)
+      if t in SIGNAL_TYPES:
+        return t
+    if address in [0x200, 0x201] and sig.name == "CHECKSUM_PEDAL":
+      return "PEDAL_CHECKSUM"
+    if address in [0x200, 0x201] and sig.name == "COUNTER_PEDAL":
+      return "PEDAL_COUNTER"
+    return "DEFAULT"
+
+  def checksum_call(address, sig_type, msg_size):
+    func, dat = CHECKSUM_FUNCS[sig_type]
+    if sig_type == "PEDAL_CHECKSUM":
+      return "%s(%s, %d)" % (func, dat, msg_size)
+    return "%s(0x%X, %s, %d)" % (func, address, dat, msg_size)
+
+  def be_shift(b1, size):
+    # A big endian signal can run past the end of the last byte (e.g. mazda_2017 NEW_SIGNAL_4),
+    # the bits that don't exist read as zero instead of shifting by a negative count
+    bo = 64 - (b1 + size)
+    if bo < 0:
+      return "(dat_be << %d)" % -bo
+    return "(dat_be >> %d)" % bo
+
+  def mask(size):
+    return "0x%XULL" % ((1 << size) - 1)
+
+  def sign_bit(size):
+    return "0x%XULL" % (1 << (size - 1))
+
+  def cdouble(v):
+    return repr(float(v))
+
+  parser_code = template.render(dbc=can_dbc, msgs=msgs, def_vals=def_vals, len=len,
+                                sig_type=sig_type, checksum_call=checksum_call, be_shift=be_shift,
+                                mask=mask, sign_bit=sign_bit, cdouble=cdouble)
 
   with open(out_fn, "a+") as out_f:
     out_f.seek(0)
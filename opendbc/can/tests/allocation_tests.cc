@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "opendbc/can/common.h"
+#include "opendbc/can/tests/can_frames.h"
+
+// Interposes on malloc through glibc internals, which would affect every other test in the same binary
+#ifdef __GLIBC__
+
+// Count heap allocations of the calling thread while enabled. operator new ends up in malloc as well.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t num, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static thread_local bool count_allocations = false;
+static thread_local size_t num_allocations = 0;
+
+extern "C" void *malloc(size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t num, size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  if (count_allocations) num_allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+TEST_CASE("Parsing and querying doesn't allocate once warm") {
+  CANPacker packer(DBC);
+  CANParser parser(0, DBC, message_options(), signal_options());
+  CanList cans({pack_frame(packer, STEER_ANGLE_SENSOR, 0, {{"STEER_ANGLE", 30}}),
+                pack_frame(packer, WHEEL_SPEEDS, 0, {{"WHEEL_SPEED_FR", 50}}),
+                pack_frame(packer, STEER_TORQUE_SENSOR, 0, {{"STEER_TORQUE_DRIVER", 100}})});
+  auto reader = cans.reader();
+
+  std::vector<SignalValue> vals;
+  parser.query_latest(vals);
+
+  size_t sizes[100];
+  count_allocations = true;
+  for (uint64_t i = 0; i < 100; i++) {
+    parser.UpdateCans(i * 10 * MS, reader);
+    parser.UpdateValid(i * 10 * MS);
+    parser.query_latest(vals);
+    sizes[i] = vals.size();
+  }
+  count_allocations = false;
+  REQUIRE(num_allocations == 0);
+  for (size_t size : sizes) {
+    REQUIRE(size == 6);
+  }
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "opendbc/can/common.h"
+
+// Frames of a few toyota messages, packed with CANPacker and sent as a can list
+
+static const char *DBC = "toyota_nodsu_pt_generated";
+static const uint64_t MS = 1000000ULL;
+
+static const uint32_t STEER_ANGLE_SENSOR = 37, WHEEL_SPEEDS = 170, STEER_TORQUE_SENSOR = 608;
+
+struct Frame {
+  uint32_t address;
+  uint8_t src;
+  uint8_t dat[8];
+};
+
+// Bytes of the frame in the order packer_pyx sends them
+inline Frame pack_frame(CANPacker &packer, uint32_t address, uint8_t src, const std::vector<SignalPackValue> &values, int counter = -1) {
+  Frame f = {address, src};
+  uint64_t val = packer.pack(address, values, counter);
+  for (int i = 0; i < 8; i++) {
+    f.dat[i] = val >> (56 - 8 * i);
+  }
+  return f;
+}
+
+struct CanList {
+  capnp::MallocMessageBuilder msg;
+  capnp::List<cereal::CanData>::Builder can;
+
+  CanList(const std::vector<Frame> &frames) {
+    can = msg.initRoot<cereal::Event>().initCan(frames.size());
+    for (int i = 0; i < frames.size(); i++) {
+      can[i].setAddress(frames[i].address);
+      can[i].setBusTime(i);
+      can[i].setSrc(frames[i].src);
+      can[i].setDat(kj::arrayPtr(frames[i].dat, 8));
+    }
+  }
+  capnp::List<cereal::CanData>::Reader reader() { return can.asReader(); }
+};
+
+inline std::vector<MessageParseOptions> message_options() {
+  return {{STEER_ANGLE_SENSOR, 0}, {WHEEL_SPEEDS, 100}, {STEER_TORQUE_SENSOR, 50}};
+}
+
+inline std::vector<SignalParseOptions> signal_options() {
+  return {
+    {STEER_ANGLE_SENSOR, "STEER_ANGLE", 1},
+    {STEER_ANGLE_SENSOR, "STEER_RATE", 2},
+    {WHEEL_SPEEDS, "WHEEL_SPEED_FR", 3},
+    {WHEEL_SPEEDS, "WHEEL_SPEED_FL", 4},
+    {STEER_TORQUE_SENSOR, "STEER_TORQUE_DRIVER", 5},
+  };
+}
@@ -0,0 +1,133 @@
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "opendbc/can/common.h"
+#include "opendbc/can/tests/can_frames.h"
+
+static std::vector<uint32_t> addresses(const std::vector<SignalValue> &vals) {
+  std::vector<uint32_t> ret;
+  for (auto &v : vals) {
+    if (ret.empty() || ret.back() != v.address) ret.push_back(v.address);
+  }
+  return ret;
+}
+
+static double value(const std::vector<SignalValue> &vals, const char *name) {
+  for (auto &v : vals) {
+    if (strcmp(v.name, name) == 0) return v.value;
+  }
+  FAIL("no signal " << name);
+  return 0;
+}
+
+TEST_CASE("query_latest returns the messages parsed since the last query") {
+  CANPacker packer(DBC);
+  CANParser parser(0, DBC, message_options(), signal_options());
+  std::vector<SignalValue> vals;
+
+  // the first query has the defaults of every message, the checksum is parsed too
+  parser.query_latest(vals);
+  REQUIRE(vals.size() == 6);
+  REQUIRE(value(vals, "STEER_ANGLE") == 1);
+  REQUIRE(value(vals, "STEER_TORQUE_DRIVER") == 5);
+
+  parser.query_latest(vals);
+  REQUIRE(vals.empty());
+
+  Frame wheel_speeds = pack_frame(packer, WHEEL_SPEEDS, 0, {{"WHEEL_SPEED_FR", 10}, {"WHEEL_SPEED_FL", 20}});
+  CanList one({wheel_speeds});
+  parser.UpdateCans(MS, one.reader());
+  parser.query_latest(vals);
+  REQUIRE(addresses(vals) == std::vector<uint32_t>{WHEEL_SPEEDS});
+  REQUIRE(value(vals, "WHEEL_SPEED_FR") == Approx(10).margin(0.01));
+  REQUIRE(value(vals, "WHEEL_SPEED_FL") == Approx(20).margin(0.01));
+
+  // the set was cleared by the query
+  parser.query_latest(vals);
+  REQUIRE(vals.empty());
+
+  SECTION("a message parsed twice is returned once with its latest values") {
+    CanList two({wheel_speeds,
+                 pack_frame(packer, STEER_ANGLE_SENSOR, 0, {{"STEER_ANGLE", 30}}),
+                 pack_frame(packer, WHEEL_SPEEDS, 0, {{"WHEEL_SPEED_FR", 50}, {"WHEEL_SPEED_FL", 60}})});
+    parser.UpdateCans(2 * MS, two.reader());
+    parser.query_latest(vals);
+    REQUIRE(addresses(vals) == std::vector<uint32_t>{WHEEL_SPEEDS, STEER_ANGLE_SENSOR});
+    REQUIRE(value(vals, "WHEEL_SPEED_FR") == Approx(50).margin(0.01));
+    REQUIRE(value(vals, "STEER_ANGLE") == Approx(30).margin(1.5));
+  }
+
+  SECTION("frames of other buses, unknown addresses and bad checksums aren't returned") {
+    Frame bad_checksum = pack_frame(packer, STEER_TORQUE_SENSOR, 0, {{"STEER_TORQUE_DRIVER", 100}});
+    bad_checksum.dat[7]++;
+    CanList ignored({pack_frame(packer, WHEEL_SPEEDS, 1, {{"WHEEL_SPEED_FR", 50}}),
+                     pack_frame(packer, 180, 0, {}),
+                     bad_checksum});
+    parser.UpdateCans(2 * MS, ignored.reader());
+    parser.query_latest(vals);
+    REQUIRE(vals.empty());
+  }
+}
+
+TEST_CASE("MultiBusCANParser matches a CANParser per bus") {
+  CANPacker packer(DBC);
+  MultiBusCANParser multi(DBC);
+  std::vector<std::unique_ptr<CANParser>> parsers;
+  for (int bus = 0; bus < 3; bus++) {
+    multi.add_bus(bus, message_options(), signal_options());
+    parsers.push_back(std::make_unique<CANParser>(bus, DBC, message_options(), signal_options()));
+  }
+  REQUIRE(multi.get_bus(3) == nullptr);
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> src(0, 3), msg(0, 2), counts(0, 8);
+  std::uniform_real_distribution<double> speed(0, 100), angle(-400, 400), torque(-1000, 1000);
+
+  std::vector<SignalValue> expected, vals;
+  for (uint64_t step = 0; step < 500; step++) {
+    std::vector<Frame> frames;
+    for (int i = counts(gen); i > 0; i--) {
+      int s = src(gen), m = msg(gen);
+      if (m == 0) {
+        frames.push_back(pack_frame(packer, WHEEL_SPEEDS, s, {{"WHEEL_SPEED_FR", speed(gen)}, {"WHEEL_SPEED_FL", speed(gen)}}));
+      } else if (m == 1) {
+        frames.push_back(pack_frame(packer, STEER_ANGLE_SENSOR, s, {{"STEER_ANGLE", angle(gen)}, {"STEER_RATE", angle(gen)}}));
+      } else {
+        frames.push_back(pack_frame(packer, STEER_TORQUE_SENSOR, s, {{"STEER_TORQUE_DRIVER", torque(gen)}}));
+      }
+    }
+    // now and then a checksum fails
+    if (step % 50 == 0) {
+      frames.push_back(pack_frame(packer, STEER_TORQUE_SENSOR, step / 50 % 3, {{"STEER_TORQUE_DRIVER", torque(gen)}}));
+      frames.back().dat[7]++;
+    }
+
+    // frames arrive every 10 ms, gaps make the checks on frequency fail now and then
+    uint64_t sec = step * 10 * MS;
+    CanList cans(frames);
+    multi.UpdateCans(sec, cans.reader());
+    multi.UpdateValid(sec);
+
+    for (int bus = 0; bus < 3; bus++) {
+      parsers[bus]->UpdateCans(sec, cans.reader());
+      parsers[bus]->UpdateValid(sec);
+
+      CANParser *p = multi.get_bus(bus);
+      REQUIRE(p->can_valid == parsers[bus]->can_valid);
+      REQUIRE(p->last_sec == sec);
+
+      parsers[bus]->query_latest(expected);
+      p->query_latest(vals);
+      REQUIRE(vals.size() == expected.size());
+      for (int i = 0; i < vals.size(); i++) {
+        REQUIRE(vals[i].address == expected[i].address);
+        REQUIRE(vals[i].ts == expected[i].ts);
+        REQUIRE(strcmp(vals[i].name, expected[i].name) == 0);
+        REQUIRE(vals[i].value == expected[i].value);
+      }
+    }
+  }
+}
@@ -191,9 +191,8 @@ void usb_retry_connect() {
   LOGW("connected to board");
 }
 
-void can_recv(PubMaster &pm) {
+void can_recv(PubMaster &pm, ReusableMessageBuilder &msg) {
   // create message
-  MessageBuilder msg;
   auto event = msg.initEvent();
   int recv = panda->can_receive(event);
   if (recv){
@@ -245,13 +244,14 @@ void can_recv_thread() {
 
   // can = 8006
   PubMaster pm({"can"});
+  ReusableMessageBuilder msg;
 
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
 
   while (!do_exit && panda->connected) {
-    can_recv(pm);
+    can_recv(pm, msg);
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
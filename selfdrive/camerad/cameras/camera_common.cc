@@ -23,6 +23,7 @@
 #include "common/swaglog.h"
 #include "common/util.h"
 #include "modeldata.h"
+#include "frame_trace.h"
 #include "imgproc/utils.h"
 
 static cl_program build_debayer_program(cl_device_id device_id, cl_context context, const CameraInfo *ci, const CameraBuf *b, const CameraState *s) {
@@ -114,6 +115,7 @@ bool CameraBuf::acquire() {
   }
 
   cur_frame_data = camera_bufs_metadata[cur_buf_idx];
+  frame_trace(FRAME_TRACE_CAMERA_EOF, rgb_type, cur_frame_data.frame_id, cur_frame_data.timestamp_eof);
 
   cur_rgb_buf = vipc_server->get_buffer(rgb_type);
 
@@ -149,6 +151,7 @@ bool CameraBuf::acquire() {
 
   clWaitForEvents(1, &debayer_event);
   CL_CHECK(clReleaseEvent(debayer_event));
+  frame_trace(FRAME_TRACE_CAMERA_DEBAYER, rgb_type, cur_frame_data.frame_id);
 
   cur_yuv_buf = vipc_server->get_buffer(yuv_type);
   rgb_to_yuv_queue(&rgb_to_yuv_state, q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl);
@@ -160,6 +163,7 @@ bool CameraBuf::acquire() {
   };
   vipc_server->send(cur_rgb_buf, &extra);
   vipc_server->send(cur_yuv_buf, &extra);
+  frame_trace(FRAME_TRACE_CAMERA_SEND, yuv_type, cur_frame_data.frame_id);
 
   return true;
 }
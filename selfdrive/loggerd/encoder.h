@@ -1,12 +1,17 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 
 class VideoEncoder {
 public:
   virtual ~VideoEncoder() {}
   virtual int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                            int in_width, int in_height, uint64_t ts) = 0;
-  virtual void encoder_open(const char* path) = 0;
-  virtual void encoder_close() = 0;
+  // segment_length in seconds, to preallocate the file
+  virtual void encoder_open(const char* path, int segment_length) = 0;
+  // Stops writing to the current file and returns what finishes it. That can run on another thread
+  // while the encoder goes on with the next file
+  virtual std::function<void()> encoder_detach() = 0;
+  void encoder_close() { encoder_detach()(); }
 };
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Index of the chunks of an rlog/qlog, appended after the last bz2 stream.
+// bzip2 and python's bz2 ignore trailing data, so indexed logs still read like before.
+//
+// [bz2 chunk]...[bz2 chunk][LogChunkIndex x num_chunks][LogIndexFooter]
+
+#define LOG_INDEX_MAGIC 0x5844494c // "LIDX"
+#define LOG_INDEX_VERSION 1
+#define LOG_INDEX_SERVICE_WORDS 4
+// A chunk is a block of at most LOG_BLOCK_SIZE plus one event, which can't be larger than the biggest msgq ring
+#define LOG_INDEX_MAX_RAW_SIZE (100 * 1024 * 1024)
+
+struct LogChunkIndex {
+  uint64_t offset;            // of the bz2 stream in the file
+  uint32_t size;              // compressed
+  uint32_t raw_size;
+  uint64_t start_mono_time;   // smallest and largest logMonoTime of the events in the chunk
+  uint64_t end_mono_time;
+  uint64_t services[LOG_INDEX_SERVICE_WORDS]; // bit per cereal::Event::Which in the chunk
+};
+
+struct LogIndexFooter {
+  uint64_t index_offset;
+  uint32_t num_chunks;
+  uint32_t version;
+  uint32_t magic;
+  uint32_t padding;
+};
+
+inline void log_index_set_service(LogChunkIndex &idx, int which) {
+  if (which >= 0 && which < LOG_INDEX_SERVICE_WORDS * 64) {
+    idx.services[which / 64] |= 1ULL << (which % 64);
+  }
+}
+
+inline bool log_index_has_service(const LogChunkIndex &idx, int which) {
+  if (which < 0 || which >= LOG_INDEX_SERVICE_WORDS * 64) return true;
+  return idx.services[which / 64] & (1ULL << (which % 64));
+}
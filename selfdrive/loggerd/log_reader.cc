@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include <bzlib.h>
+#include <capnp/schema.h>
+
+#include "common/swaglog.h"
+#include "log_reader.h"
+
+IndexedLogReader::~IndexedLogReader() {
+  if (file) fclose(file);
+}
+
+bool IndexedLogReader::open(const std::string &path) {
+  file = fopen(path.c_str(), "rb");
+  if (file == nullptr) return false;
+
+  LogIndexFooter footer;
+  if (fseeko(file, -(off_t)sizeof(footer), SEEK_END) != 0 || fread(&footer, sizeof(footer), 1, file) != 1) {
+    return false;
+  }
+  if (footer.magic != LOG_INDEX_MAGIC || footer.version != LOG_INDEX_VERSION) {
+    LOGE("%s has no index", path.c_str());
+    return false;
+  }
+
+  // The index sits right in front of the footer, the chunks in front of the index
+  uint64_t index_end = ftello(file) - sizeof(footer);
+  if (footer.index_offset > index_end ||
+      (index_end - footer.index_offset) != (uint64_t)footer.num_chunks * sizeof(LogChunkIndex)) {
+    LOGE("%s has a corrupt index footer", path.c_str());
+    return false;
+  }
+
+  chunk_index.resize(footer.num_chunks);
+  if (fseeko(file, footer.index_offset, SEEK_SET) != 0 ||
+      fread(chunk_index.data(), sizeof(LogChunkIndex), footer.num_chunks, file) != footer.num_chunks) {
+    chunk_index.clear();
+    return false;
+  }
+
+  for (const LogChunkIndex &c : chunk_index) {
+    if (c.offset > footer.index_offset || c.size > footer.index_offset - c.offset || c.raw_size > LOG_INDEX_MAX_RAW_SIZE) {
+      LOGE("%s has a corrupt chunk index", path.c_str());
+      chunk_index.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+int IndexedLogReader::serviceWhich(const std::string &name) {
+  for (auto field : capnp::Schema::from<cereal::Event>().getUnionFields()) {
+    if (field.getProto().getName() == name) {
+      return field.getProto().getDiscriminantValue();
+    }
+  }
+  return -1;
+}
+
+std::vector<int> IndexedLogReader::findChunks(uint64_t start, uint64_t end, const std::vector<std::string> &services) const {
+  std::vector<int> which;
+  for (auto &s : services) {
+    which.push_back(serviceWhich(s));
+  }
+
+  std::vector<int> ret;
+  for (int i = 0; i < chunk_index.size(); i++) {
+    const LogChunkIndex &c = chunk_index[i];
+    if (c.end_mono_time < start || c.start_mono_time > end) continue;
+
+    bool has_service = which.empty();
+    for (int w : which) {
+      has_service = has_service || log_index_has_service(c, w);
+    }
+    if (has_service) ret.push_back(i);
+  }
+  return ret;
+}
+
+bool IndexedLogReader::readChunk(int idx, std::vector<kj::ArrayPtr<const capnp::word>> &events) {
+  events.clear();
+  if (idx < 0 || idx >= chunk_index.size()) return false;
+  const LogChunkIndex &c = chunk_index[idx];
+
+  compressed.resize(c.size);
+  if (fseeko(file, c.offset, SEEK_SET) != 0 || fread(compressed.data(), 1, c.size, file) != c.size) {
+    return false;
+  }
+
+  size_t words = (c.raw_size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+  if (raw.size() < words) {
+    raw = kj::heapArray<capnp::word>(words);
+  }
+  unsigned int raw_size = c.raw_size;
+  int bzerror = BZ2_bzBuffToBuffDecompress((char *)raw.begin(), &raw_size, compressed.data(), c.size, 0, 0);
+  if (bzerror != BZ_OK || raw_size != c.raw_size) {
+    LOGE("failed to decompress chunk %d, bzerror=%d", idx, bzerror);
+    return false;
+  }
+
+  kj::ArrayPtr<const capnp::word> remaining(raw.begin(), c.raw_size / sizeof(capnp::word));
+  try {
+    while (remaining.size() > 0) {
+      capnp::FlatArrayMessageReader reader(remaining);
+      const capnp::word *end = reader.getEnd();
+      events.push_back(kj::arrayPtr(remaining.begin(), end));
+      remaining = kj::arrayPtr(end, remaining.end());
+    }
+  } catch (const kj::Exception &e) {
+    LOGE("failed to parse chunk %d: %s", idx, e.getDescription().cStr());
+    return false;
+  }
+  return true;
+}
+
+int IndexedLogReader::forEach(uint64_t start, uint64_t end, const std::vector<std::string> &services,
+                              std::function<void(cereal::Event::Reader)> f) {
+  std::vector<int> which;
+  for (auto &s : services) {
+    which.push_back(serviceWhich(s));
+  }
+
+  auto chunks = findChunks(start, end, services);
+  std::vector<kj::ArrayPtr<const capnp::word>> events;
+  for (int idx : chunks) {
+    if (!readChunk(idx, events)) continue;
+
+    for (auto &e : events) {
+      capnp::FlatArrayMessageReader reader(e);
+      auto event = reader.getRoot<cereal::Event>();
+      if (event.getLogMonoTime() < start || event.getLogMonoTime() > end) continue;
+      if (!which.empty() && std::find(which.begin(), which.end(), (int)event.which()) == which.end()) continue;
+      f(event);
+    }
+  }
+  return chunks.size();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <kj/array.h>
+#include <capnp/serialize.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "log_index.h"
+
+// Random access to logs written with an index: only the chunks that can contain
+// the requested time range and services are decompressed.
+class IndexedLogReader {
+ public:
+  ~IndexedLogReader();
+
+  // Returns false if the file can't be read or has no index
+  bool open(const std::string &path);
+  const std::vector<LogChunkIndex> &chunks() const { return chunk_index; }
+
+  // Chunks with events of any of the services between start and end (logMonoTime, inclusive).
+  // No services means all of them
+  std::vector<int> findChunks(uint64_t start, uint64_t end, const std::vector<std::string> &services = {}) const;
+
+  // Decompresses a chunk, the events stay valid until the next call
+  bool readChunk(int idx, std::vector<kj::ArrayPtr<const capnp::word>> &events);
+
+  // Calls f for the events of the services between start and end, returns the number of chunks decoded
+  int forEach(uint64_t start, uint64_t end, const std::vector<std::string> &services,
+              std::function<void(cereal::Event::Reader)> f);
+
+  // Event::Which of a service, -1 if there is none
+  static int serviceWhich(const std::string &name);
+
+ private:
+  FILE *file = nullptr;
+  std::vector<LogChunkIndex> chunk_index;
+  std::vector<char> compressed;
+  kj::Array<capnp::word> raw;
+};
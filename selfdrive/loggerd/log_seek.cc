@@ -0,0 +1,69 @@
+// Reads the events of some services in a time range from an indexed rlog/qlog.
+// usage: log_seek <rlog.bz2> [--start <s>] [--end <s>] [--services a,b,...]
+// Times are seconds from the start of the log.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "log_reader.h"
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <rlog.bz2> [--start <s>] [--end <s>] [--services a,b,...]\n", argv[0]);
+    return 1;
+  }
+
+  double start_s = 0, end_s = 1e9;
+  std::vector<std::string> services;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--start") == 0) {
+      start_s = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--end") == 0) {
+      end_s = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--services") == 0) {
+      std::stringstream ss(argv[i + 1]);
+      std::string s;
+      while (std::getline(ss, s, ',')) services.push_back(s);
+    }
+  }
+
+  for (auto &s : services) {
+    if (IndexedLogReader::serviceWhich(s) < 0) {
+      printf("unknown service %s\n", s.c_str());
+      return 1;
+    }
+  }
+
+  IndexedLogReader reader;
+  if (!reader.open(argv[1]) || reader.chunks().empty()) {
+    printf("failed to open %s, or it has no index\n", argv[1]);
+    return 1;
+  }
+
+  uint64_t log_start = UINT64_MAX;
+  for (auto &c : reader.chunks()) {
+    log_start = std::min(log_start, c.start_mono_time);
+  }
+
+  std::map<int, int> counts;
+  int decoded = reader.forEach(log_start + start_s * 1e9, log_start + end_s * 1e9, services, [&](cereal::Event::Reader event) {
+    counts[(int)event.which()]++;
+  });
+
+  printf("decoded %d of %zu chunks\n", decoded, reader.chunks().size());
+  auto fields = capnp::Schema::from<cereal::Event>().getUnionFields();
+  for (auto &[which, count] : counts) {
+    for (auto field : fields) {
+      if (field.getProto().getDiscriminantValue() == which) {
+        printf("%-32s %d\n", field.getProto().getName().cStr(), count);
+      }
+    }
+  }
+  return 0;
+}
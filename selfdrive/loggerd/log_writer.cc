@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <bzlib.h>
+#include <capnp/serialize.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "common/swaglog.h"
+#include "log_writer.h"
+
+class LogCompressorPool {
+ public:
+  LogCompressorPool() {
+    int num_threads = std::clamp((int)std::thread::hardware_concurrency() / 2, 1, 4);
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back(&LogCompressorPool::compress_thread, this);
+    }
+  }
+
+  ~LogCompressorPool() {
+    {
+      std::unique_lock lk(lock);
+      exit = true;
+    }
+    job_cv.notify_all();
+    for (auto &t : threads) t.join();
+    for (auto b : free_blocks) delete b;
+  }
+
+  LogBlock *get_block() {
+    std::unique_lock lk(lock);
+    if (free_blocks.empty()) {
+      LogBlock *b = new LogBlock;
+      b->raw.reserve(LOG_BLOCK_SIZE);
+      return b;
+    }
+    LogBlock *b = free_blocks.back();
+    free_blocks.pop_back();
+    return b;
+  }
+
+  void put_block(LogBlock *b, bool written) {
+    b->raw.clear();
+    b->done = false;
+    {
+      std::unique_lock lk(lock);
+      free_blocks.push_back(b);
+      if (written) {
+        queued_blocks--;
+        stats.bytes_out += b->compressed.size();
+      }
+    }
+    if (written) space_cv.notify_all();
+  }
+
+  void submit(AsyncBZFile *file, LogBlock *b) {
+    std::unique_lock lk(lock);
+    if (queued_blocks >= LOG_MAX_QUEUED_BLOCKS) {
+      auto t1 = std::chrono::steady_clock::now();
+      space_cv.wait(lk, [&] { return queued_blocks < LOG_MAX_QUEUED_BLOCKS; });
+      auto t2 = std::chrono::steady_clock::now();
+      stats.stalls++;
+      stats.stall_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
+
+    queued_blocks++;
+    stats.blocks++;
+    stats.bytes_in += b->raw.size();
+    stats.max_queued_blocks = std::max(stats.max_queued_blocks, queued_blocks);
+    jobs.push_back({file, b});
+    lk.unlock();
+    job_cv.notify_one();
+  }
+
+  LogWriterStats get_stats() {
+    std::unique_lock lk(lock);
+    LogWriterStats s = stats;
+    s.queued_blocks = queued_blocks;
+    return s;
+  }
+
+ private:
+  void compress_thread() {
+    while (true) {
+      std::unique_lock lk(lock);
+      job_cv.wait(lk, [&] { return exit || !jobs.empty(); });
+      if (jobs.empty()) return;
+      auto [file, b] = jobs.front();
+      jobs.pop_front();
+      lk.unlock();
+
+      if (compress_block(b) && file->indexed) {
+        index_block(b);
+      }
+      file->block_done(b);
+    }
+  }
+
+  // Leaves compressed empty if the block can't be compressed
+  static bool compress_block(LogBlock *b) {
+    // Worst case from the bzip2 docs: 1% larger plus 600 bytes
+    size_t max_size = b->raw.size() + b->raw.size() / 100 + 600;
+    int bzerror = BZ_OK;
+    for (int attempt = 0; attempt < 5; attempt++) {
+      unsigned int size = max_size;
+      b->compressed.resize(size);
+      bzerror = BZ2_bzBuffToBuffCompress(b->compressed.data(), &size, b->raw.data(), b->raw.size(), 9, 0, 30);
+      if (bzerror == BZ_OK) {
+        b->compressed.resize(size);
+        return true;
+      }
+
+      LOGE("BZ2_bzBuffToBuffCompress error, bzerror=%d, attempt %d", bzerror, attempt);
+      if (bzerror == BZ_OUTBUFF_FULL) {
+        max_size *= 2;
+      } else {
+        // out of memory, give the rest of loggerd a moment to free some
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+
+    LOGE("dropping log block of %zu bytes, bzerror=%d", b->raw.size(), bzerror);
+    b->compressed.clear();
+    return false;
+  }
+
+  static void index_block(LogBlock *b) {
+    LogChunkIndex &idx = b->index;
+    idx = {};
+    idx.raw_size = b->raw.size();
+    idx.start_mono_time = UINT64_MAX;
+
+    // Events are word aligned within the block, raw itself is allocated with at least word alignment
+    try {
+      kj::ArrayPtr<const capnp::word> words((const capnp::word *)b->raw.data(), b->raw.size() / sizeof(capnp::word));
+      while (words.size() > 0) {
+        capnp::FlatArrayMessageReader reader(words);
+        auto event = reader.getRoot<cereal::Event>();
+        idx.start_mono_time = std::min(idx.start_mono_time, event.getLogMonoTime());
+        idx.end_mono_time = std::max(idx.end_mono_time, event.getLogMonoTime());
+        log_index_set_service(idx, (int)event.which());
+        words = kj::arrayPtr(reader.getEnd(), words.end());
+      }
+    } catch (const kj::Exception &e) {
+      // Readers have to look at it whatever they're searching for
+      LOGE("failed to index log block: %s", e.getDescription().cStr());
+      idx.start_mono_time = 0;
+      idx.end_mono_time = UINT64_MAX;
+      memset(idx.services, 0xff, sizeof(idx.services));
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable job_cv, space_cv;
+  std::deque<std::pair<AsyncBZFile *, LogBlock *>> jobs;
+  std::vector<LogBlock *> free_blocks;
+  std::vector<std::thread> threads;
+  uint64_t queued_blocks = 0;
+  LogWriterStats stats = {};
+  bool exit = false;
+};
+
+static LogCompressorPool &pool() {
+  static LogCompressorPool p;
+  return p;
+}
+
+LogWriterStats log_writer_stats() {
+  return pool().get_stats();
+}
+
+AsyncBZFile::AsyncBZFile(const char* path, bool indexed, size_t expected_size) : indexed(indexed) {
+  file = std::make_unique<SegmentFile>(path, expected_size);
+  cur = pool().get_block();
+}
+
+AsyncBZFile::~AsyncBZFile() {
+  if (cur->raw.empty()) {
+    pool().put_block(cur, false);
+  } else {
+    submit();
+  }
+
+  {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [&] { return pending.empty(); });
+  }
+
+  if (indexed) {
+    write_index();
+  }
+
+  file.reset();
+}
+
+void AsyncBZFile::write(void* data, size_t size) {
+  if (!cur->raw.empty() && cur->raw.size() + size > LOG_BLOCK_SIZE) {
+    submit();
+    cur = pool().get_block();
+  }
+
+  // Events larger than a block get one of their own
+  cur->raw.insert(cur->raw.end(), (const char *)data, (const char *)data + size);
+  if (cur->raw.size() >= LOG_BLOCK_SIZE) {
+    submit();
+    cur = pool().get_block();
+  }
+}
+
+void AsyncBZFile::write_index() {
+  LogIndexFooter footer = {
+    .index_offset = file->tell(),
+    .num_chunks = (uint32_t)chunks.size(),
+    .version = LOG_INDEX_VERSION,
+    .magic = LOG_INDEX_MAGIC,
+  };
+  size_t index_size = chunks.size() * sizeof(LogChunkIndex);
+  if (!file->write(chunks.data(), index_size) || !file->write(&footer, sizeof(footer))) {
+    LOGE("log index write error");
+  }
+}
+
+void AsyncBZFile::submit() {
+  {
+    std::unique_lock lk(lock);
+    pending.push_back(cur);
+  }
+  pool().submit(this, cur);
+}
+
+// Writes out the blocks in front that are compressed, whichever compressor thread finishes them
+void AsyncBZFile::block_done(LogBlock *block) {
+  std::unique_lock lk(lock);
+  block->done = true;
+
+  while (!pending.empty() && pending.front()->done) {
+    LogBlock *b = pending.front();
+    pending.pop_front();
+
+    // A block that failed to compress was logged already, SegmentFile logs the first write error.
+    // The file position moves on either way, only what made it into the file is indexed.
+    uint64_t offset = file->tell();
+    bool written = !b->compressed.empty() && file->write(b->compressed.data(), b->compressed.size());
+    if (written && indexed) {
+      b->index.offset = offset;
+      b->index.size = b->compressed.size();
+      chunks.push_back(b->index);
+    }
+    pool().put_block(b, true);
+  }
+
+  if (pending.empty()) {
+    cv.notify_all();
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "log_index.h"
+#include "segment_file.h"
+
+// Events are collected into blocks that a pool of threads compresses in parallel.
+// Every block is a complete bz2 stream, the file is the concatenation of them
+// which bzip2 and python's bz2 decompress as one.
+// Events don't span blocks, so with an index every block can be decoded on its own.
+#define LOG_BLOCK_SIZE (900 * 1000)
+
+// Blocks waiting for compression before writers block
+#define LOG_MAX_QUEUED_BLOCKS 32
+
+struct LogBlock {
+  std::vector<char> raw;
+  std::vector<char> compressed;
+  LogChunkIndex index;
+  bool done = false;
+};
+
+struct LogWriterStats {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t blocks;
+  uint64_t queued_blocks;
+  uint64_t max_queued_blocks;
+  uint64_t stalls;     // writes that waited for the compressors to catch up
+  double stall_ms;
+};
+
+class AsyncBZFile {
+ public:
+  // indexed expects capnp events and writes a LogIndexFooter on close.
+  // expected_size of the compressed file is preallocated
+  AsyncBZFile(const char* path, bool indexed = false, size_t expected_size = 0);
+  // Waits until all blocks are written
+  ~AsyncBZFile();
+  void write(void* data, size_t size);
+
+ private:
+  friend class LogCompressorPool;
+  void submit();
+  void block_done(LogBlock *block);
+
+  void write_index();
+
+  std::unique_ptr<SegmentFile> file;
+  LogBlock *cur = nullptr;
+  const bool indexed;
+  std::vector<LogChunkIndex> chunks;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<LogBlock *> pending; // in file order
+};
+
+LogWriterStats log_writer_stats();
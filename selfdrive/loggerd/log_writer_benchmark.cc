@@ -0,0 +1,118 @@
+// Replays a synthetic mix of 100 services at 100 Hz into an rlog, once compressed inline
+// on the calling thread like loggerd used to, once through AsyncBZFile.
+// usage: log_writer_benchmark [seconds of driving, default 60] [output dir, default /tmp]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+
+#include "log_writer.h"
+
+#define NUM_SERVICES 100
+#define SERVICE_FREQ 100
+
+struct Event {
+  std::vector<char> data;
+};
+
+// Sizes from 32 bytes to 1 KB. Like real events: a header, slowly changing values and some noise
+static std::vector<Event> make_events(int seconds) {
+  std::vector<Event> events;
+  srand(1234);
+  for (int t = 0; t < seconds * SERVICE_FREQ; t++) {
+    for (int s = 0; s < NUM_SERVICES; s++) {
+      Event e;
+      e.data.resize(32 << (s % 6));
+      uint32_t header[4] = {(uint32_t)s, (uint32_t)t, 0xdeadbeef, (uint32_t)e.data.size()};
+      memcpy(e.data.data(), header, sizeof(header));
+
+      for (size_t i = sizeof(header); i + sizeof(float) <= e.data.size(); i += sizeof(float)) {
+        float v = (i % 64 == 0) ? (float)rand() / RAND_MAX : sinf((t + i) * 0.01f) * s;
+        memcpy(&e.data[i], &v, sizeof(v));
+      }
+      events.push_back(std::move(e));
+    }
+  }
+  return events;
+}
+
+struct Result {
+  double seconds;
+  std::vector<double> write_us;
+};
+
+template <class Write, class Close>
+static Result replay(const std::vector<Event> &events, Write write, Close close) {
+  Result r;
+  r.write_us.reserve(events.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto &e : events) {
+    auto t1 = std::chrono::steady_clock::now();
+    write(e);
+    auto t2 = std::chrono::steady_clock::now();
+    r.write_us.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+  }
+  close();
+  r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return r;
+}
+
+static void print_result(const char *name, Result &r, size_t bytes, double driving_seconds) {
+  std::sort(r.write_us.begin(), r.write_us.end());
+  double total = 0;
+  for (double us : r.write_us) total += us;
+
+  printf("%-8s %8.2f s %8.1f MB/s %8.1fx realtime   write us: p50 %.2f p99 %.2f max %.0f   on loggerd thread %.2f s\n",
+         name, r.seconds, bytes / r.seconds / 1e6, driving_seconds / r.seconds,
+         r.write_us[r.write_us.size() / 2], r.write_us[r.write_us.size() * 99 / 100], r.write_us.back(), total / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 60;
+  std::string dir = argc > 2 ? argv[2] : "/tmp";
+
+  auto events = make_events(seconds);
+  size_t bytes = 0;
+  for (auto &e : events) bytes += e.data.size();
+  printf("%zu events, %.1f MB, %d s of %d services at %d Hz\n\n", events.size(), bytes / 1e6, seconds, NUM_SERVICES, SERVICE_FREQ);
+
+  {
+    std::string path = dir + "/rlog_inline.bz2";
+    FILE *f = fopen(path.c_str(), "wb");
+    int bzerror;
+    BZFILE *bz = BZ2_bzWriteOpen(&bzerror, f, 9, 0, 30);
+    Result r = replay(events, [&](const Event &e) {
+      BZ2_bzWrite(&bzerror, bz, (void *)e.data.data(), e.data.size());
+    }, [&]() {
+      BZ2_bzWriteClose(&bzerror, bz, 0, nullptr, nullptr);
+      fclose(f);
+    });
+    print_result("inline", r, bytes, seconds);
+  }
+
+  {
+    std::string path = dir + "/rlog_async.bz2";
+    AsyncBZFile *f = new AsyncBZFile(path.c_str());
+    Result r = replay(events, [&](const Event &e) {
+      f->write((void *)e.data.data(), e.data.size());
+    }, [&]() {
+      delete f;
+    });
+    print_result("async", r, bytes, seconds);
+
+    LogWriterStats ws = log_writer_stats();
+    printf("\nasync: %lu blocks, ratio %.2f, max %lu queued, %lu stalls for %.1f ms\n", (unsigned long)ws.blocks,
+           (double)ws.bytes_in / ws.bytes_out, (unsigned long)ws.max_queued_blocks, (unsigned long)ws.stalls, ws.stall_ms);
+  }
+
+  return 0;
+}
@@ -182,9 +182,9 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<BZFile>(h->log_path);
+  h->log = std::make_unique<AsyncBZFile>(h->log_path, true, RLOG_PREALLOC_SIZE);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    h->q_log = std::make_unique<AsyncBZFile>(h->qlog_path, true, QLOG_PREALLOC_SIZE);
   }
 
   pthread_mutex_init(&h->lock, NULL);
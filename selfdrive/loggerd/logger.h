@@ -8,6 +8,7 @@
 #include <kj/array.h>
 #include <capnp/serialize.h>
 #include "common/util.h"
+#include "log_writer.h"
 
 #if defined(QCOM) || defined(QCOM2)
 const std::string LOG_ROOT = "/data/media/0/realdata";
@@ -17,6 +18,10 @@ const std::string LOG_ROOT = util::getenv_default("HOME", "/.comma/media/0/reald
 
 #define LOGGER_MAX_HANDLES 16
 
+// Preallocated for the logs of a segment, a bit more than they usually compress to
+#define RLOG_PREALLOC_SIZE (16 * 1024 * 1024)
+#define QLOG_PREALLOC_SIZE (1024 * 1024)
+
 class BZFile {
  public:
   BZFile(const char* path) {
@@ -58,7 +63,7 @@ typedef struct LoggerHandle {
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<BZFile> log, q_log;
+  std::unique_ptr<AsyncBZFile> log, q_log;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -14,6 +14,8 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <functional>
+#include <future>
 #include <random>
 
 #include <ftw.h>
@@ -24,11 +26,13 @@
 #include "common/util.h"
 #include "camerad/cameras/camera_common.h"
 #include "logger.h"
+#include "qlog_policy.h"
 #include "messaging.hpp"
 #include "services.h"
 
 #include "visionipc.h"
 #include "visionipc_client.h"
+#include "frame_trace.h"
 
 #include "encoder.h"
 #if defined(QCOM) || defined(QCOM2)
@@ -54,6 +58,7 @@ constexpr int DCAM_BITRATE = MAIN_BITRATE;
 #endif
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
+#define MAX_FRAME_LAG 100       // encoder frames this far behind the segment start mean camerad restarted
 
 const int SEGMENT_LENGTH = getenv("LOGGERD_TEST") ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
@@ -104,16 +109,26 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
   },
 };
 
+// A segment for an encoder thread to switch to. Frames from start_frame_id on go to it,
+// the frame packets before it were logged to the previous segment.
+struct SegmentEpoch {
+  int segment;
+  uint32_t start_frame_id;
+  char path[4096];
+  LoggerHandle *lh;
+};
+
 class RotateState {
 public:
   SubSocket* fpkt_sock;
-  uint32_t stream_frame_id, log_frame_id, last_rotate_frame_id;
-  bool enabled, should_rotate, initialized;
-  std::atomic<bool> rotating;
-  std::atomic<int> cur_seg;
+  uint32_t stream_frame_id, log_frame_id;
+  bool enabled, log_frame_seen;
+  std::atomic<SegmentEpoch *> next_epoch;     // posted by the main thread, taken by the encoder thread
+  std::atomic<uint32_t> seg_start_frame_id;   // first frame encoded into the current segment
+  std::atomic<bool> seg_started;
 
-  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), log_frame_id(0),
-                  last_rotate_frame_id(UINT32_MAX), enabled(false), should_rotate(false), initialized(false), rotating(false), cur_seg(-1) {};
+  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), log_frame_id(0), enabled(false), log_frame_seen(false),
+                  next_epoch(nullptr), seg_start_frame_id(0), seg_started(false) {};
 
   void waitLogThread() {
     std::unique_lock<std::mutex> lk(fid_lock);
@@ -138,24 +153,57 @@ public:
   void setLogFrameId(uint32_t frame_id) {
     fid_lock.lock();
     log_frame_id = frame_id;
+    log_frame_seen = true;
     fid_lock.unlock();
     cv.notify_one();
   }
 
-  void rotate() {
-    if (enabled) {
+  // Called by the main thread after logger_next. If the encoder thread didn't
+  // take the previous epoch yet (no frames), it is replaced.
+  void rotate(int segment, const char *path, LoggerHandle *lh) {
+    SegmentEpoch *e = new SegmentEpoch();
+    e->segment = segment;
+    e->lh = lh;
+    snprintf(e->path, sizeof(e->path), "%s", path);
+    {
       std::unique_lock<std::mutex> lk(fid_lock);
-      should_rotate = true;
-      last_rotate_frame_id = stream_frame_id;
+      e->start_frame_id = log_frame_seen ? log_frame_id + 1 : 0;
     }
+    dropEpoch(next_epoch.exchange(e));
   }
 
-  void finish_rotate() {
-    std::unique_lock<std::mutex> lk(fid_lock);
-    should_rotate = false;
+  // After the encoder thread exited
+  void clearEpoch() {
+    dropEpoch(next_epoch.exchange(nullptr));
+  }
+
+  // Called by the encoder thread for every frame, returns the epoch once the frame belongs to it
+  SegmentEpoch *takeEpoch(uint32_t frame_id) {
+    SegmentEpoch *e = next_epoch.load();
+    if (e == nullptr) return nullptr;
+
+    // frame ids going back a lot means camerad restarted, the old boundary is meaningless
+    int32_t d = (int32_t)(frame_id - e->start_frame_id);
+    if (d < 0 && d > -MAX_FRAME_LAG) return nullptr;
+
+    if (!next_epoch.compare_exchange_strong(e, nullptr)) return nullptr;
+    seg_start_frame_id = frame_id;
+    seg_started = true;
+    return e;
+  }
+
+  bool canRotate() {
+    return next_epoch.load() == nullptr && seg_started && log_frame_id >= seg_start_frame_id + SEGMENT_LENGTH * MAIN_FPS;
   }
 
 private:
+  void dropEpoch(SegmentEpoch *e) {
+    if (e) {
+      lh_close(e->lh);
+      delete e;
+    }
+  }
+
   std::mutex fid_lock;
   std::condition_variable cv;
 };
@@ -165,11 +213,26 @@ struct LoggerdState {
   LoggerState logger = {};
   char segment_path[4096];
   int rotate_segment;
-  pthread_mutex_t rotate_lock;
   RotateState rotate_state[LOG_CAMERA_ID_MAX-1];
 };
 LoggerdState s;
 
+// Finishes the files and logger handle of a finished segment off the encoder thread
+std::future<void> finalize_segment(std::vector<Encoder *> &encoders, SegmentEpoch *epoch) {
+  std::vector<std::function<void()>> finish;
+  for (auto &e : encoders) {
+    finish.push_back(e->encoder_detach());
+  }
+  return std::async(std::launch::async, [finish = std::move(finish), epoch]() {
+    set_thread_name("loggerd_finalize");
+    for (auto &f : finish) {
+      f();
+    }
+    lh_close(epoch->lh);
+    delete epoch;
+  });
+}
+
 void encoder_thread(int cam_idx) {
   assert(cam_idx < LOG_CAMERA_ID_MAX-1);
 
@@ -179,8 +242,10 @@ void encoder_thread(int cam_idx) {
   set_thread_name(cam_info.filename);
 
   int cnt = 0;
-  LoggerHandle *lh = NULL;
+  uint32_t last_frame_id = 0;
+  SegmentEpoch *epoch = nullptr;
   std::vector<Encoder *> encoders;
+  std::future<void> closed;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   while (!do_exit) {
@@ -213,58 +278,37 @@ void encoder_thread(int cam_idx) {
       if (buf == nullptr){
         continue;
       }
+      frame_trace(FRAME_TRACE_LOGGERD_RECV, cam_info.stream_type, extra.frame_id);
 
       //printf("logger latency to tsEof: %f\n", (double)(nanos_since_boot() - extra.timestamp_eof) / 1000000.0);
 
-      // all the rotation stuff
-      {
-        pthread_mutex_lock(&s.rotate_lock);
-        pthread_mutex_unlock(&s.rotate_lock);
+      // wait if camera pkt id is older than stream
+      rotate_state.waitLogThread();
 
-        // wait if camera pkt id is older than stream
-        rotate_state.waitLogThread();
+      if (do_exit) break;
 
-        if (do_exit) break;
-
-        // rotate the encoder if the logger is on a newer segment
-        if (rotate_state.should_rotate) {
-          LOGW("camera %d rotate encoder to %s", cam_idx, s.segment_path);
-
-          if (!rotate_state.initialized) {
-            rotate_state.last_rotate_frame_id = extra.frame_id - 1;
-            rotate_state.initialized = true;
-          }
-
-          // get new logger handle for new segment
-          if (lh) {
-            lh_close(lh);
-          }
-          lh = logger_get_handle(&s.logger);
-
-          // wait for all to start rotating
-          rotate_state.rotating = true;
-          for(auto &r : s.rotate_state) {
-             while(r.enabled && !r.rotating && !do_exit) util::sleep_for(5);
-          }
-
-          pthread_mutex_lock(&s.rotate_lock);
-          for (auto &e : encoders) {
-            e->encoder_close();
-            e->encoder_open(s.segment_path);
-          }
-          rotate_state.cur_seg = s.rotate_segment;
-          pthread_mutex_unlock(&s.rotate_lock);
+      // switch to the new segment at our first frame of it, the other cameras do the same on their own
+      if (SegmentEpoch *next = rotate_state.takeEpoch(extra.frame_id)) {
+        LOGW("camera %d rotate encoder to %s", cam_idx, next->path);
+        // finishing the previous files had a whole segment, this only waits if segments are very short
+        if (closed.valid()) closed.wait();
+        if (epoch) {
+          closed = finalize_segment(encoders, epoch);
+        }
 
-          // wait for all to finish rotating
-          for(auto &r : s.rotate_state) {
-             while(r.enabled && r.cur_seg != s.rotate_segment && !do_exit) util::sleep_for(5);
-          }
-          rotate_state.rotating = false;
-          rotate_state.finish_rotate();
+        for (auto &e : encoders) {
+          e->encoder_open(next->path, SEGMENT_LENGTH);
         }
+        epoch = next;
+      }
+
+      if (getenv("LOGGERD_TEST") && epoch && last_frame_id != 0 && extra.frame_id != last_frame_id + 1) {
+        LOGE("camera %d lost %d frames before %u", cam_idx, (int)(extra.frame_id - last_frame_id - 1), extra.frame_id);
       }
+      last_frame_id = extra.frame_id;
 
       rotate_state.setStreamFrameId(extra.frame_id);
+      if (epoch == nullptr) continue;
 
       // encode a frame
       for (int i = 0; i < encoders.size(); ++i) {
@@ -285,29 +329,28 @@ void encoder_thread(int cam_idx) {
           eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
     #endif
           eidx.setEncodeId(cnt);
-          eidx.setSegmentNum(rotate_state.cur_seg);
+          eidx.setSegmentNum(epoch->segment);
           eidx.setSegmentId(out_id);
-          if (lh) {
-            auto bytes = msg.toBytes();
-            lh_log(lh, bytes.begin(), bytes.size(), false);
-          }
+          auto bytes = msg.toBytes();
+          lh_log(epoch->lh, bytes.begin(), bytes.size(), false);
         }
       }
 
+      frame_trace(FRAME_TRACE_LOGGERD_ENCODED, cam_info.stream_type, extra.frame_id);
       cnt++;
     }
-
-    if (lh) {
-      lh_close(lh);
-      lh = NULL;
-    }
   }
 
   LOG("encoder destroy");
-  for(auto &e : encoders) {
+  if (closed.valid()) closed.wait();
+  for (auto &e : encoders) {
     e->encoder_close();
-    delete e;
   }
+  if (epoch) {
+    lh_close(epoch->lh);
+    delete epoch;
+  }
+  for (auto &e : encoders) delete e;
 }
 
 int clear_locks_fn(const char* fpath, const struct stat *sb, int tyupeflag) {
@@ -330,18 +373,22 @@ int main(int argc, char** argv) {
 
   clear_locks();
 
+  QlogPolicy qlog_policy;
+  std::string qlog_policy_path = util::getenv_default("QLOG_POLICY", "", QLOG_POLICY_DEFAULT_PATH);
+  if (!qlog_policy.init(qlog_policy_path)) {
+    LOGE("qlog policy %s has errors, using decimation", qlog_policy_path.c_str());
+  }
+
   // setup messaging
-  typedef struct QlogState {
-    int counter, freq;
-  } QlogState;
-  std::map<SubSocket*, QlogState> qlog_states;
+  std::map<SubSocket*, int> service_idx;
 
   s.ctx = Context::create();
   Poller * poller = Poller::create();
   std::vector<SubSocket*> socks;
 
   // subscribe to all socks
-  for (const auto& it : services) {
+  for (int i = 0; i < std::size(services); i++) {
+    const auto& it = services[i];
     if (!it.should_log) continue;
 
     SubSocket * sock = SubSocket::create(s.ctx, it.name);
@@ -354,15 +401,12 @@ int main(int argc, char** argv) {
         s.rotate_state[cid].fpkt_sock = sock;
       }
     }
-    qlog_states[sock] = {.counter = 0, .freq = it.decimation};
+    service_idx[sock] = i;
   }
 
   // init logger
   logger_init(&s.logger, "rlog", true);
 
-  // init encoders
-  pthread_mutex_init(&s.rotate_lock, NULL);
-
   // TODO: create these threads dynamically on frame packet presence
   std::vector<std::thread> encoder_threads;
   encoder_threads.push_back(std::thread(encoder_thread, LOG_CAMERA_ID_FCAMERA));
@@ -383,6 +427,7 @@ int main(int argc, char** argv) {
 
   uint64_t msg_count = 0;
   uint64_t bytes_count = 0;
+  uint64_t last_writer_stalls = 0;
   AlignedBuffer aligned_buf;
 
   double start_ts = seconds_since_boot();
@@ -403,16 +448,23 @@ int main(int argc, char** argv) {
         delete last_msg;
         last_msg = msg;
 
-        QlogState& qs = qlog_states[sock];
-        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), qs.counter == 0 && qs.freq != -1);
-        if (qs.freq != -1) {
-          qs.counter = (qs.counter + 1) % qs.freq;
-        }
+        int idx = service_idx[sock];
+        bool in_qlog = qlog_policy.should_log(idx, msg->getData(), msg->getSize(), nanos_since_boot());
+        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), in_qlog);
+        qlog_policy.account(idx, msg->getSize(), in_qlog);
 
         bytes_count += msg->getSize();
         if ((++msg_count % 1000) == 0) {
           double ts = seconds_since_boot();
           LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
+
+          LogWriterStats ws = log_writer_stats();
+          LOGD("log writer: %lu blocks, ratio %.2f, %lu queued (max %lu)", ws.blocks,
+               ws.bytes_out ? (double)ws.bytes_in / ws.bytes_out : 0., ws.queued_blocks, ws.max_queued_blocks);
+          if (ws.stalls > last_writer_stalls) {
+            LOGW("log writer stalled %lu times, %.1f ms total", ws.stalls, ws.stall_ms);
+            last_writer_stalls = ws.stalls;
+          }
         }
       }
 
@@ -450,9 +502,7 @@ int main(int argc, char** argv) {
         new_segment = true;
         for (auto &r : s.rotate_state) {
           // this *should* be redundant on tici since all camera frames are synced
-          new_segment &= (((r.stream_frame_id >= r.last_rotate_frame_id + SEGMENT_LENGTH * MAIN_FPS) &&
-                          (!r.should_rotate) && (r.initialized)) ||
-                          (!r.enabled));
+          new_segment &= r.canRotate() || !r.enabled;
 #ifndef QCOM2
           break; // only look at fcamera frame id if not QCOM2
 #endif
@@ -467,22 +517,26 @@ int main(int argc, char** argv) {
 
     // rotate to new segment
     if (new_segment) {
-      pthread_mutex_lock(&s.rotate_lock);
       last_rotate_tms = millis_since_boot();
+      if (s.logger.part > -1) {
+        LOG("segment %d bytes per service: %s", s.logger.part, qlog_policy.report().c_str());
+      }
 
       int err = logger_next(&s.logger, LOG_ROOT.c_str(), s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
       assert(err == 0);
       LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", s.segment_path);
 
-      // rotate encoders
-      for (auto &r : s.rotate_state) r.rotate();
-      pthread_mutex_unlock(&s.rotate_lock);
+      // hand the new segment to the encoders, each switches at its first frame of it
+      for (auto &r : s.rotate_state) {
+        if (r.enabled) r.rotate(s.rotate_segment, s.segment_path, logger_get_handle(&s.logger));
+      }
     }
   }
 
   LOGW("closing encoders");
   for (auto &r : s.rotate_state) r.cancelWait();
   for (auto &t : encoder_threads) t.join();
+  for (auto &r : s.rotate_state) r.clearEpoch();
 
   LOGW("closing logger");
   logger_close(&s.logger);
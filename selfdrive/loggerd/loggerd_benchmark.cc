@@ -0,0 +1,382 @@
+// Runs loggerd against synthetic cameras and services and reports whether it keeps up.
+// A fake camerad serves the cameras over VisionIPC, every logged service in services.h
+// is published at its frequency with all of its fields filled in. loggerd runs in the
+// LOGGERD_TEST mode with short segments and HOME in a temporary directory.
+// usage: loggerd_benchmark [segments, default 5] [segment seconds, default 5] [cameras, default 1]
+//                          [width, default 1928] [height, default 1208] [fps, default 20]
+// cameras are road, driver and wide, loggerd only records the ones it has encoders for on this device.
+// LOGGERD is the loggerd to run, default ./loggerd
+
+#include <assert.h>
+#include <dirent.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <capnp/dynamic.h>
+#include <capnp/schema.h>
+
+#include "common/timing.h"
+#include "common/util.h"
+#include "messaging.hpp"
+#include "services.h"
+#include "visionipc_server.h"
+#include "log_reader.h"
+
+using Clock = std::chrono::steady_clock;
+
+#if defined(QCOM) || defined(QCOM2)
+#define VIDEO_EXT ""
+#else
+#define VIDEO_EXT ".mkv"  // RawLogger
+#endif
+
+struct BenchCamera {
+  VisionStreamType stream_type;
+  const char *state_name;
+  const char *encode_idx_name;
+  const char *video_name;
+};
+
+static const BenchCamera cameras[] = {
+  {VISION_STREAM_YUV_BACK, "roadCameraState", "roadEncodeIdx", "fcamera.hevc"},
+  {VISION_STREAM_YUV_FRONT, "driverCameraState", "driverEncodeIdx", "dcamera.hevc"},
+  {VISION_STREAM_YUV_WIDE, "wideRoadCameraState", "wideRoadEncodeIdx", "ecamera.hevc"},
+};
+
+static std::atomic<bool> do_exit = false;
+
+static double seconds_since(Clock::time_point t) {
+  return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+// Numbers that change a little every message, like sensor values do
+static void fill_struct(capnp::DynamicStruct::Builder s, uint64_t cnt, int depth) {
+  for (auto field : s.getSchema().getNonUnionFields()) {
+    capnp::Type type = field.getType();
+    uint64_t v = (cnt + field.getIndex() * 7) % 100;
+    switch (type.which()) {
+      case capnp::schema::Type::BOOL: s.set(field, v % 2 == 0); break;
+      case capnp::schema::Type::INT8: case capnp::schema::Type::INT16: case capnp::schema::Type::INT32:
+      case capnp::schema::Type::INT64: s.set(field, (int64_t)v); break;
+      case capnp::schema::Type::UINT8: case capnp::schema::Type::UINT16: case capnp::schema::Type::UINT32:
+      case capnp::schema::Type::UINT64: s.set(field, v); break;
+      case capnp::schema::Type::FLOAT32: case capnp::schema::Type::FLOAT64: s.set(field, sin(cnt * 0.01 + v)); break;
+      case capnp::schema::Type::TEXT: s.set(field, "benchmark"); break;
+      case capnp::schema::Type::DATA: s.init(field, 16); break;
+      case capnp::schema::Type::STRUCT:
+        if (depth < 2) fill_struct(s.init(field).as<capnp::DynamicStruct>(), cnt, depth + 1);
+        break;
+      case capnp::schema::Type::LIST: {
+        auto list = s.init(field, 4).as<capnp::DynamicList>();
+        capnp::Type elem = type.asList().getElementType();
+        for (int i = 0; i < list.size(); i++) {
+          if (elem.isStruct() && depth < 2) {
+            fill_struct(list[i].as<capnp::DynamicStruct>(), cnt + i, depth + 1);
+          } else if (elem.isFloat32() || elem.isFloat64()) {
+            list.set(i, sin(cnt * 0.01 + i));
+          } else if (elem.isUInt8() || elem.isUInt16() || elem.isUInt32() || elem.isUInt64() ||
+                     elem.isInt8() || elem.isInt16() || elem.isInt32() || elem.isInt64()) {
+            list.set(i, (cnt + i) % 100);
+          }
+        }
+        break;
+      }
+      default: break;
+    }
+  }
+}
+
+static void services_thread() {
+  std::unique_ptr<Context> ctx(Context::create());
+  capnp::StructSchema event_schema = capnp::Schema::from<cereal::Event>();
+
+  struct Pub {
+    const service *s;
+    std::unique_ptr<PubSocket> sock;
+    capnp::StructSchema::Field field;
+    double period;
+    Clock::time_point next;
+    uint64_t cnt = 0;
+  };
+  std::vector<Pub> pubs;
+  for (const auto &s : services) {
+    if (!s.should_log || s.frequency <= 0) continue;
+    // published by the cameras and loggerd itself
+    bool skip = false;
+    for (auto &c : cameras) {
+      skip = skip || strcmp(s.name, c.state_name) == 0 || strcmp(s.name, c.encode_idx_name) == 0;
+    }
+    KJ_IF_MAYBE(field, event_schema.findFieldByName(s.name)) {
+      if (!skip) {
+        pubs.push_back({.s = &s, .sock = std::unique_ptr<PubSocket>(PubSocket::create(ctx.get(), s.name)),
+                        .field = *field, .period = 1.0 / s.frequency, .next = Clock::now()});
+      }
+    }
+  }
+
+  while (!do_exit) {
+    auto next = std::min_element(pubs.begin(), pubs.end(), [](auto &a, auto &b) { return a.next < b.next; });
+    std::this_thread::sleep_until(next->next);
+
+    MessageBuilder msg;
+    auto event = capnp::toDynamic(msg.initEvent());
+    capnp::Type type = next->field.getType();
+    if (type.isStruct()) {
+      fill_struct(event.init(next->field).as<capnp::DynamicStruct>(), next->cnt, 0);
+    } else if (type.isList() || type.isData() || type.isText()) {
+      event.init(next->field, 4);
+    }
+    auto bytes = msg.toBytes();
+    next->sock->send((char *)bytes.begin(), bytes.size());
+
+    next->cnt++;
+    next->next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(next->period));
+  }
+}
+
+// Gradients with sensor noise, compresses about like a road does
+static void fill_frame(VisionBuf *buf, std::mt19937 &rng) {
+  for (size_t y = 0; y < buf->height; y++) {
+    for (size_t x = 0; x < buf->width; x++) {
+      buf->y[y * buf->width + x] = (x + y) / 8 + rng() % 8;
+    }
+  }
+  for (size_t i = 0; i < buf->width * buf->height / 4; i++) {
+    buf->u[i] = 128 + rng() % 4;
+    buf->v[i] = 128 + rng() % 4;
+  }
+}
+
+static void camera_thread(VisionIpcServer *server, const BenchCamera *cam, int fps, std::atomic<uint32_t> *frames_sent) {
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<PubSocket> state_sock(PubSocket::create(ctx.get(), cam->state_name));
+  capnp::StructSchema::Field field = capnp::Schema::from<cereal::Event>().getFieldByName(cam->state_name);
+
+  std::set<VisionBuf *> filled;
+  std::mt19937 rng(cam->stream_type);
+
+  auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+  auto next = Clock::now();
+  for (uint32_t frame_id = 1; !do_exit; frame_id++) {
+    std::this_thread::sleep_until(next);
+    next += period;
+
+    // every buffer is filled once, the encoders don't care how new the pixels are
+    VisionBuf *buf = server->get_buffer(cam->stream_type);
+    if (filled.insert(buf).second) {
+      fill_frame(buf, rng);
+    }
+    uint64_t ts = nanos_since_boot();
+    VisionIpcBufExtra extra = {.frame_id = frame_id, .timestamp_sof = ts, .timestamp_eof = ts};
+    server->send(buf, &extra, false);
+
+    MessageBuilder msg;
+    auto state = capnp::toDynamic(msg.initEvent()).init(field).as<capnp::DynamicStruct>();
+    state.set("frameId", frame_id);
+    state.set("timestampEof", ts);
+    auto bytes = msg.toBytes();
+    state_sock->send((char *)bytes.begin(), bytes.size());
+
+    *frames_sent = frame_id;
+  }
+}
+
+static std::vector<std::string> list_segments(const std::string &root) {
+  std::vector<std::string> ret;
+  if (DIR *d = opendir(root.c_str())) {
+    while (struct dirent *e = readdir(d)) {
+      if (strstr(e->d_name, "--")) ret.push_back(e->d_name);
+    }
+    closedir(d);
+  }
+  std::sort(ret.begin(), ret.end(), [](auto &a, auto &b) {
+    return atoi(strrchr(a.c_str(), '-') + 1) < atoi(strrchr(b.c_str(), '-') + 1);
+  });
+  return ret;
+}
+
+static bool exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+static uint64_t file_size(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Clock ticks of user and system time per thread name
+static std::map<std::string, uint64_t> thread_ticks(pid_t pid) {
+  std::map<std::string, uint64_t> ret;
+  std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+  if (DIR *d = opendir(task_dir.c_str())) {
+    while (struct dirent *e = readdir(d)) {
+      if (e->d_name[0] == '.') continue;
+      std::string stat = util::read_file(task_dir + "/" + e->d_name + "/stat");
+      size_t open = stat.find('('), close = stat.rfind(')');
+      if (open == std::string::npos || close == std::string::npos) continue;
+
+      // state is the first field after the name, utime and stime are the 14th and 15th
+      unsigned long utime = 0, stime = 0;
+      sscanf(stat.c_str() + close + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+      ret[stat.substr(open + 1, close - open - 1)] += utime + stime;
+    }
+    closedir(d);
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  int num_segments = argc > 1 ? atoi(argv[1]) : 5;
+  int segment_length = argc > 2 ? atoi(argv[2]) : 5;
+  int num_cameras = std::clamp(argc > 3 ? atoi(argv[3]) : 1, 1, (int)std::size(cameras));
+  int width = argc > 4 ? atoi(argv[4]) : 1928;
+  int height = argc > 5 ? atoi(argv[5]) : 1208;
+  int fps = argc > 6 ? atoi(argv[6]) : 20;
+  std::string loggerd = util::getenv_default("LOGGERD", "", "./loggerd");
+
+  char tmp[] = "/tmp/loggerd_benchmark.XXXXXX";
+  if (mkdtemp(tmp) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string root = std::string(tmp) + "/.comma/media/0/realdata";
+  printf("%d segments of %d s, %d cameras %dx%d at %d fps, logging to %s\n\n",
+         num_segments, segment_length, num_cameras, width, height, fps, root.c_str());
+
+  // before any threads are started
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setenv("HOME", tmp, 1);
+    setenv("LOGGERD_TEST", "1", 1);
+    setenv("LOGGERD_SEGMENT_LENGTH", std::to_string(segment_length).c_str(), 1);
+    execl(loggerd.c_str(), loggerd.c_str(), (char *)nullptr);
+    perror("exec loggerd");
+    _exit(1);
+  }
+
+  VisionIpcServer server("camerad");
+  for (int i = 0; i < num_cameras; i++) {
+    server.create_buffers(cameras[i].stream_type, 20, false, width, height);
+  }
+  server.start_listener();
+
+  std::vector<std::thread> threads;
+  std::atomic<uint32_t> frames_sent[std::size(cameras)] = {};
+  threads.emplace_back(services_thread);
+  for (int i = 0; i < num_cameras; i++) {
+    threads.emplace_back(camera_thread, &server, &cameras[i], fps, &frames_sent[i]);
+  }
+
+  // watch the segments appear, rotation latency is from the segment directory
+  // until the encoders of all cameras that record switched to it
+  struct SegmentTimes {
+    Clock::time_point created;
+    std::map<int, Clock::time_point> video;
+  };
+  std::map<std::string, SegmentTimes> times;
+  auto start = Clock::now();
+  auto ticks_start = thread_ticks(pid);
+  double timeout = (num_segments + 2) * segment_length + 10;
+  while (seconds_since(start) < timeout && waitpid(pid, nullptr, WNOHANG) == 0) {
+    auto segments = list_segments(root);
+    for (auto &seg : segments) {
+      if (!times.count(seg)) times[seg].created = Clock::now();
+      for (int i = 0; i < num_cameras; i++) {
+        if (!times[seg].video.count(i) && exists(root + "/" + seg + "/" + cameras[i].video_name + VIDEO_EXT)) {
+          times[seg].video[i] = Clock::now();
+        }
+      }
+    }
+    if ((int)segments.size() > num_segments) break;
+    util::sleep_for(2);
+  }
+  double duration = seconds_since(start);
+  auto ticks_end = thread_ticks(pid);
+
+  kill(pid, SIGINT);
+  waitpid(pid, nullptr, 0);
+  do_exit = true;
+  for (auto &t : threads) t.join();
+
+  // frames that made it into the videos, from the encode indices in the rlogs
+  std::vector<std::string> idx_names;
+  for (int i = 0; i < num_cameras; i++) idx_names.push_back(cameras[i].encode_idx_name);
+
+  std::map<int, std::vector<uint32_t>> encoded;
+  uint64_t log_bytes = 0, video_bytes = 0;
+  std::vector<double> rotation_ms;
+  auto segments = list_segments(root);
+  for (auto &seg : segments) {
+    std::string dir = root + "/" + seg;
+    log_bytes += file_size(dir + "/rlog.bz2") + file_size(dir + "/qlog.bz2");
+    for (int i = 0; i < num_cameras; i++) video_bytes += file_size(dir + "/" + cameras[i].video_name + VIDEO_EXT);
+
+    IndexedLogReader reader;
+    if (reader.open(dir + "/rlog.bz2")) {
+      reader.forEach(0, UINT64_MAX, idx_names, [&](cereal::Event::Reader event) {
+        for (int i = 0; i < num_cameras; i++) {
+          if (event.which() == IndexedLogReader::serviceWhich(cameras[i].encode_idx_name)) {
+            auto idx = capnp::toDynamic(event).get(cameras[i].encode_idx_name).as<capnp::DynamicStruct>();
+            encoded[i].push_back(idx.get("frameId").as<uint32_t>());
+          }
+        }
+      });
+    }
+
+    // the first segment starts with loggerd, not a rotation
+    auto &t = times[seg];
+    if (seg != segments.front() && !t.video.empty()) {
+      Clock::time_point last = t.created;
+      for (auto &[cam, tv] : t.video) last = std::max(last, tv);
+      rotation_ms.push_back(std::chrono::duration<double, std::milli>(last - t.created).count());
+    }
+  }
+
+  printf("%zu segments in %.1f s\n", segments.size(), duration);
+  for (int i = 0; i < num_cameras; i++) {
+    auto &frames = encoded[i];
+    VisionIpcBufStats vs = server.get_stats(cameras[i].stream_type);
+    if (frames.empty()) {
+      printf("%-20s not recorded, %u frames sent\n", cameras[i].state_name, frames_sent[i].load());
+      continue;
+    }
+    std::set<uint32_t> unique(frames.begin(), frames.end());
+    uint32_t expected = *unique.rbegin() - *unique.begin() + 1;
+    printf("%-20s %u frames sent, %zu encoded, %u dropped, %zu duplicated, vipc skipped %lu stolen %lu\n",
+           cameras[i].state_name, frames_sent[i].load(), frames.size(), expected - (uint32_t)unique.size(),
+           frames.size() - unique.size(), (unsigned long)vs.frames_skipped, (unsigned long)vs.frames_stolen);
+  }
+  printf("logs %.1f KB/s, video %.1f MB/s\n", log_bytes / duration / 1e3, video_bytes / duration / 1e6);
+
+  if (!rotation_ms.empty()) {
+    std::sort(rotation_ms.begin(), rotation_ms.end());
+    printf("rotation latency ms: p50 %.1f max %.1f over %zu rotations\n",
+           rotation_ms[rotation_ms.size() / 2], rotation_ms.back(), rotation_ms.size());
+  }
+
+  printf("\ncpu per thread:\n");
+  long hz = sysconf(_SC_CLK_TCK);
+  for (auto &[name, ticks] : ticks_end) {
+    double cpu = (ticks - ticks_start[name]) / (double)hz / duration * 100;
+    printf("  %-20s %5.1f%%\n", name.c_str(), cpu);
+  }
+
+  return 0;
+}
@@ -20,6 +20,7 @@
 #include "common/swaglog.h"
 
 #include "omx_encoder.h"
+#include "segment_avio.h"
 
 // Check the OMX error code and assert if an error occurred.
 #define OMX_CHECK(_expr)          \
@@ -162,6 +163,7 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
   this->width = width;
   this->height = height;
   this->fps = fps;
+  this->bitrate = bitrate;
   this->remuxing = !h265;
 
   this->downscale = downscale;
@@ -344,7 +346,7 @@ void OmxEncoder::handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf) {
 
   if (e->of) {
     //printf("write %d flags 0x%x\n", out_buf->nFilledLen, out_buf->nFlags);
-    fwrite(buf_data, out_buf->nFilledLen, 1, e->of);
+    e->of->write(buf_data, out_buf->nFilledLen);
   }
 
   if (e->remuxing) {
@@ -472,9 +474,7 @@ int OmxEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const u
   return ret;
 }
 
-void OmxEncoder::encoder_open(const char* path) {
-  int err;
-
+void OmxEncoder::encoder_open(const char* path, int segment_length) {
   snprintf(this->vid_path, sizeof(this->vid_path), "%s/%s", path, this->filename);
   LOGD("encoder_open %s remuxing:%d", this->vid_path, this->remuxing);
 
@@ -499,16 +499,18 @@ void OmxEncoder::encoder_open(const char* path) {
     this->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
     this->codec_ctx->time_base = (AVRational){ 1, this->fps };
 
-    err = avio_open(&this->ofmt_ctx->pb, this->vid_path, AVIO_FLAG_WRITE);
-    assert(err >= 0);
+    // a segment at the bitrate with some headroom
+    this->remux_file = new SegmentFile(this->vid_path, (size_t)this->bitrate / 8 * segment_length * 5 / 4, false);
+    this->ofmt_ctx->pb = segment_avio_open(this->remux_file);
+    assert(this->ofmt_ctx->pb);
 
     this->wrote_codec_config = false;
   } else {
-    this->of = fopen(this->vid_path, "wb");
-    assert(this->of);
+    // a segment at the bitrate with some headroom
+    this->of = new SegmentFile(this->vid_path, (size_t)this->bitrate / 8 * segment_length * 5 / 4, false);
 #ifndef QCOM2
     if (this->codec_config_len > 0) {
-      fwrite(this->codec_config, this->codec_config_len, 1, this->of);
+      this->of->write(this->codec_config, this->codec_config_len);
     }
 #endif
   }
@@ -523,43 +525,58 @@ void OmxEncoder::encoder_open(const char* path) {
   this->counter = 0;
 }
 
-void OmxEncoder::encoder_close() {
-  if (this->is_open) {
-    if (this->dirty) {
-      // drain output only if there could be frames in the encoder
+std::function<void()> OmxEncoder::encoder_detach() {
+  if (!this->is_open) return []{};
 
-      OMX_BUFFERHEADERTYPE* in_buf = this->free_in.pop();
-      in_buf->nFilledLen = 0;
-      in_buf->nOffset = 0;
-      in_buf->nFlags = OMX_BUFFERFLAG_EOS;
-      in_buf->nTimeStamp = this->last_t + 1000000LL/this->fps;
+  if (this->dirty) {
+    // drain output only if there could be frames in the encoder
 
-      OMX_CHECK(OMX_EmptyThisBuffer(this->handle, in_buf));
+    OMX_BUFFERHEADERTYPE* in_buf = this->free_in.pop();
+    in_buf->nFilledLen = 0;
+    in_buf->nOffset = 0;
+    in_buf->nFlags = OMX_BUFFERFLAG_EOS;
+    in_buf->nTimeStamp = this->last_t + 1000000LL/this->fps;
 
-      while (true) {
-        OMX_BUFFERHEADERTYPE *out_buf = this->done_out.pop();
+    OMX_CHECK(OMX_EmptyThisBuffer(this->handle, in_buf));
 
-        handle_out_buf(this, out_buf);
+    while (true) {
+      OMX_BUFFERHEADERTYPE *out_buf = this->done_out.pop();
 
-        if (out_buf->nFlags & OMX_BUFFERFLAG_EOS) {
-          break;
-        }
-      }
-      this->dirty = false;
-    }
+      handle_out_buf(this, out_buf);
 
-    if (this->remuxing) {
-      av_write_trailer(this->ofmt_ctx);
-      avcodec_free_context(&this->codec_ctx);
-      avio_closep(&this->ofmt_ctx->pb);
-      avformat_free_context(this->ofmt_ctx);
-    } else {
-      fclose(this->of);
-      this->of = nullptr;
+      if (out_buf->nFlags & OMX_BUFFERFLAG_EOS) {
+        break;
+      }
     }
-    unlink(this->lock_path);
+    this->dirty = false;
   }
   this->is_open = false;
+
+  std::string lock_path = this->lock_path;
+  if (this->remuxing) {
+    AVFormatContext *ofmt_ctx = this->ofmt_ctx;
+    AVCodecContext *codec_ctx = this->codec_ctx;
+    SegmentFile *remux_file = this->remux_file;
+    this->ofmt_ctx = nullptr;
+    this->codec_ctx = nullptr;
+    this->remux_file = nullptr;
+
+    return [=]() mutable {
+      av_write_trailer(ofmt_ctx);
+      avcodec_free_context(&codec_ctx);
+      segment_avio_close(&ofmt_ctx->pb);
+      delete remux_file;
+      avformat_free_context(ofmt_ctx);
+      unlink(lock_path.c_str());
+    };
+  }
+
+  SegmentFile *of = this->of;
+  this->of = nullptr;
+  return [=]() {
+    delete of;
+    unlink(lock_path.c_str());
+  };
 }
 
 OmxEncoder::~OmxEncoder() {
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string>
 #include <vector>
 #include <OMX_Component.h>
 
@@ -11,6 +12,7 @@ extern "C" {
 }
 
 #include "encoder.h"
+#include "segment_file.h"
 #include "common/queue.h"
 
 // OmxEncoder, lossey codec using hardware hevc
@@ -20,8 +22,9 @@ public:
   ~OmxEncoder();
   int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                    int in_width, int in_height, uint64_t ts);
-  void encoder_open(const char* path);
-  void encoder_close();
+  void encoder_open(const char* path, int segment_length);
+  // Drains the encoder, closing the file is left to the returned function
+  std::function<void()> encoder_detach();
 
   // OMX callbacks
   static OMX_ERRORTYPE event_handler(OMX_HANDLETYPE component, OMX_PTR app_data, OMX_EVENTTYPE event,
@@ -35,7 +38,7 @@ private:
   void wait_for_state(OMX_STATETYPE state);
   static void handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf);
 
-  int width, height, fps;
+  int width, height, fps, bitrate;
   char vid_path[1024];
   char lock_path[1024];
   bool is_open = false;
@@ -43,7 +46,8 @@ private:
   int counter = 0;
 
   const char* filename;
-  FILE *of;
+  SegmentFile *of = nullptr;
+  SegmentFile *remux_file = nullptr;
 
   size_t codec_config_len;
   uint8_t *codec_config = NULL;
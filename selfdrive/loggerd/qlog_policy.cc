@@ -0,0 +1,256 @@
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include <capnp/schema.h>
+
+#include "common/swaglog.h"
+#include "common/util.h"
+#include "cereal/gen/cpp/log.capnp.h"
+#include "services.h"
+#include "qlog_policy.h"
+
+namespace {
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+uint64_t value_bits(const capnp::DynamicValue::Reader &v);
+
+uint64_t hash_value(uint64_t h, const capnp::DynamicValue::Reader &v) {
+  switch (v.getType()) {
+    case capnp::DynamicValue::TEXT: {
+      capnp::Text::Reader text = v.as<capnp::Text>();
+      return hash_bytes(h, text.begin(), text.size());
+    }
+    case capnp::DynamicValue::DATA: {
+      capnp::Data::Reader bytes = v.as<capnp::Data>();
+      return hash_bytes(h, bytes.begin(), bytes.size());
+    }
+    case capnp::DynamicValue::LIST: {
+      capnp::DynamicList::Reader list = v.as<capnp::DynamicList>();
+      uint32_t size = list.size();
+      h = hash_bytes(h, &size, sizeof(size));
+      for (auto e : list) {
+        h = hash_value(h, e);
+      }
+      return h;
+    }
+    case capnp::DynamicValue::STRUCT: {
+      capnp::DynamicStruct::Reader r = v.as<capnp::DynamicStruct>();
+      KJ_IF_MAYBE(field, r.which()) {
+        uint32_t idx = field->getIndex();
+        h = hash_bytes(h, &idx, sizeof(idx));
+        h = hash_value(h, r.get(*field));
+      }
+      for (auto field : r.getSchema().getNonUnionFields()) {
+        h = hash_value(h, r.get(field));
+      }
+      return h;
+    }
+    default: {
+      uint64_t bits = value_bits(v);
+      return hash_bytes(h, &bits, sizeof(bits));
+    }
+  }
+}
+
+// The bits of a scalar, the rest is hashed. Reads the message in place, nothing is copied
+uint64_t value_bits(const capnp::DynamicValue::Reader &v) {
+  switch (v.getType()) {
+    case capnp::DynamicValue::BOOL:
+      return v.as<bool>();
+    case capnp::DynamicValue::INT:
+      return v.as<int64_t>();
+    case capnp::DynamicValue::UINT:
+      return v.as<uint64_t>();
+    case capnp::DynamicValue::FLOAT: {
+      double d = v.as<double>();
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(bits));
+      return bits;
+    }
+    case capnp::DynamicValue::ENUM:
+      return v.as<capnp::DynamicEnum>().getRaw();
+    case capnp::DynamicValue::TEXT:
+    case capnp::DynamicValue::DATA:
+    case capnp::DynamicValue::LIST:
+    case capnp::DynamicValue::STRUCT:
+      return hash_value(FNV_OFFSET, v);
+    default:
+      return 0;
+  }
+}
+
+bool is_union_member(const capnp::StructSchema::Field &field) {
+  return field.getProto().getDiscriminantValue() != capnp::schema::Field::NO_DISCRIMINANT;
+}
+
+} // namespace
+
+void QlogPolicy::init_decimation() {
+  states.clear();
+  for (const auto &it : services) {
+    ServiceState s;
+    s.name = it.name;
+    s.rule.every = it.decimation;
+    states.push_back(s);
+  }
+}
+
+bool QlogPolicy::init(const std::string &config_path) {
+  init_decimation();
+
+  std::string contents = util::read_file(config_path);
+  if (contents.empty()) {
+    LOGW("no qlog policy at %s, using decimation", config_path.c_str());
+    return true;
+  }
+
+  std::string err;
+  json11::Json config = json11::Json::parse(contents, err);
+  if (!err.empty() || !config.is_object()) {
+    LOGE("failed to parse qlog policy %s: %s", config_path.c_str(), err.c_str());
+    return false;
+  }
+
+  bool ok = true;
+  for (auto &[name, rule] : config.object_items()) {
+    auto it = std::find_if(states.begin(), states.end(), [&](auto &s) { return s.name == name; });
+    if (it == states.end()) {
+      LOGE("qlog policy: unknown service %s", name.c_str());
+      ok = false;
+      continue;
+    }
+    ok = parse_rule(*it, rule) && ok;
+  }
+  // half a policy could leave out what the rest of it was meant to keep
+  if (!ok) init_decimation();
+  return ok;
+}
+
+bool QlogPolicy::parse_rule(ServiceState &s, const json11::Json &config) {
+  QlogRule rule;
+  rule.every = config["every"].is_number() ? config["every"].int_value() : -1;
+  rule.max_hz = config["max_hz"].number_value();
+  rule.always = config["always"].bool_value();
+
+  capnp::StructSchema event_schema = capnp::Schema::from<cereal::Event>();
+  for (auto &path : config["on_change"].array_items()) {
+    // resolve the fields once, the path is checked against the schema here
+    std::vector<capnp::StructSchema::Field> fields;
+    KJ_IF_MAYBE(field, event_schema.findFieldByName(s.name)) {
+      fields.push_back(*field);
+    }
+    std::istringstream names(path.string_value());
+    for (std::string name; std::getline(names, name, '.');) {
+      if (fields.empty() || !fields.back().getType().isStruct()) {
+        fields.clear();
+        break;
+      }
+      KJ_IF_MAYBE(field, fields.back().getType().asStruct().findFieldByName(name)) {
+        fields.push_back(*field);
+      } else {
+        fields.clear();
+        break;
+      }
+    }
+    if (fields.size() < 2) {
+      LOGE("qlog policy: %s has no field %s", s.name.c_str(), path.string_value().c_str());
+      return false;
+    }
+    rule.on_change.push_back(fields);
+  }
+
+  s.rule = rule;
+  s.last_values.resize(rule.on_change.size());
+  return true;
+}
+
+bool QlogPolicy::changed(ServiceState &s, const char *data, size_t size) {
+  capnp::FlatArrayMessageReader msg(aligned_buf.align(data, size));
+  capnp::DynamicStruct::Reader event = msg.getRoot<capnp::DynamicStruct>(capnp::Schema::from<cereal::Event>());
+
+  bool ret = false;
+  for (int i = 0; i < s.rule.on_change.size(); i++) {
+    FieldValue value;
+    try {
+      capnp::DynamicStruct::Reader r = event;
+      auto &fields = s.rule.on_change[i];
+      for (int j = 0; j < fields.size(); j++) {
+        // an unset union member can't be read
+        if (is_union_member(fields[j])) {
+          KJ_IF_MAYBE(active, r.which()) {
+            if (*active != fields[j]) break;
+          } else {
+            break;
+          }
+        }
+        capnp::DynamicValue::Reader v = r.get(fields[j]);
+        if (j == fields.size() - 1) {
+          value.set = true;
+          value.value = value_bits(v);
+        } else {
+          r = v.as<capnp::DynamicStruct>();
+        }
+      }
+    } catch (const kj::Exception &e) {
+      LOGE("qlog policy: failed to read %s", s.name.c_str());
+    }
+
+    if (value != s.last_values[i]) {
+      s.last_values[i] = value;
+      ret = true;
+    }
+  }
+  return ret;
+}
+
+bool QlogPolicy::should_log(int idx, const char *data, size_t size, uint64_t t) {
+  ServiceState &s = states[idx];
+  const QlogRule &rule = s.rule;
+
+  bool log = rule.always;
+  if (rule.every > 0) {
+    log = log || s.counter % rule.every == 0;
+    s.counter++;
+  }
+  if (rule.max_hz > 0) {
+    log = log || !s.logged_once || (t - s.last_logged) >= 1e9 / rule.max_hz;
+  }
+  // check every message so a change isn't held back until the next one
+  if (!rule.on_change.empty()) {
+    log = changed(s, data, size) || log;
+  }
+
+  if (log) {
+    s.last_logged = t;
+    s.logged_once = true;
+  }
+  return log;
+}
+
+void QlogPolicy::account(int idx, size_t size, bool in_qlog) {
+  states[idx].rlog_bytes += size;
+  if (in_qlog) states[idx].qlog_bytes += size;
+}
+
+std::string QlogPolicy::report() {
+  std::map<std::string, json11::Json> ret;
+  for (auto &s : states) {
+    if (s.rlog_bytes == 0) continue;
+    ret[s.name] = json11::Json::object{{"rlog", (double)s.rlog_bytes}, {"qlog", (double)s.qlog_bytes}};
+    s.rlog_bytes = s.qlog_bytes = 0;
+  }
+  return json11::Json(ret).dump();
+}
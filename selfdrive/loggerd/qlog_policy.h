@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <capnp/dynamic.h>
+#include "json11.hpp"
+#include "messaging.hpp"
+
+// Decides which messages go into the qlog. Every service starts from its decimation in
+// services.h, a config file can give it other rules, a message is kept if any rule matches:
+//
+// {
+//   "controlsState": {"max_hz": 1, "on_change": ["state", "alertText1"]},
+//   "carEvents": {"always": true},
+//   "sensorEvents": {"every": 1000}
+// }
+//
+// every: every Nth message, max_hz: at most this often, on_change: when one of these
+// fields (dot separated, from the service struct) changes, always: every message.
+// Services with no rules aren't in the qlog. Scalar fields are compared by value, text,
+// data, lists and structs by a hash of their contents.
+
+#define QLOG_POLICY_DEFAULT_PATH "qlog_policy.json"
+
+struct QlogRule {
+  int every = -1;
+  double max_hz = 0;
+  bool always = false;
+  std::vector<std::vector<capnp::StructSchema::Field>> on_change;
+};
+
+class QlogPolicy {
+ public:
+  // Returns false if the config file has errors, the decimation in services.h is used then
+  bool init(const std::string &config_path);
+
+  // idx is the index of the service in services.h
+  bool should_log(int idx, const char *data, size_t size, uint64_t t);
+  // Bytes of the service written to the rlog and qlog
+  void account(int idx, size_t size, bool in_qlog);
+
+  // JSON of the rlog and qlog bytes per service since the last report
+  std::string report();
+
+ private:
+  struct FieldValue {
+    bool set = false; // an unset union member has no value
+    uint64_t value = 0;
+    bool operator!=(const FieldValue &other) const { return set != other.set || value != other.value; }
+  };
+
+  struct ServiceState {
+    std::string name;
+    QlogRule rule;
+    uint64_t counter = 0;
+    uint64_t last_logged = 0;
+    bool logged_once = false;
+    std::vector<FieldValue> last_values;
+    uint64_t rlog_bytes = 0, qlog_bytes = 0;
+  };
+
+  void init_decimation();
+  bool parse_rule(ServiceState &s, const json11::Json &config);
+  bool changed(ServiceState &s, const char *data, size_t size);
+
+  std::vector<ServiceState> states;
+  AlignedBuffer aligned_buf;
+};
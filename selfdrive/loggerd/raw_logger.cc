@@ -3,6 +3,9 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+
+#include <algorithm>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,54 +18,74 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include <libyuv.h>
+
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/util.h"
 
 #include "raw_logger.h"
+#include "segment_avio.h"
 
 RawLogger::RawLogger(const char* filename, int width, int height, int fps,
                      int bitrate, bool h265, bool downscale)
   : filename(filename),
-    fps(fps) {
+    fps(fps), width(width), height(height) {
 
   av_register_all();
   codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
   // codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
   assert(codec);
 
-  codec_ctx = avcodec_alloc_context3(codec);
-  assert(codec_ctx);
-  codec_ctx->width = width;
-  codec_ctx->height = height;
-  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  // a context per worker, every frame is a key frame so they don't share state
+  for (int i = 0; i < RAW_LOGGER_THREADS; i++) {
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    assert(codec_ctx);
+    codec_ctx->width = width;
+    codec_ctx->height = height;
+    codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_ctx->thread_count = 1;
 
-  // codec_ctx->thread_count = 2;
+    // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
+    // codec_ctx->gop_size = 0;
 
-  // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
-  // codec_ctx->gop_size = 0;
+    codec_ctx->time_base = (AVRational){ 1, fps };
 
-  codec_ctx->time_base = (AVRational){ 1, fps };
+    int err = avcodec_open2(codec_ctx, codec, NULL);
+    assert(err >= 0);
+    codec_ctxs.push_back(codec_ctx);
+  }
 
-  int err = avcodec_open2(codec_ctx, codec, NULL);
-  assert(err >= 0);
+  frames.resize(RAW_LOGGER_QUEUE);
+  for (auto &f : frames) {
+    f.yuv.resize(width * height * 3 / 2);
+    av_init_packet(&f.pkt);
+    f.pkt.data = NULL;
+    f.pkt.size = 0;
+    free_frames.push_back(&f);
+  }
 
-  frame = av_frame_alloc();
-  assert(frame);
-  frame->format = codec_ctx->pix_fmt;
-  frame->width = width;
-  frame->height = height;
-  frame->linesize[0] = width;
-  frame->linesize[1] = width/2;
-  frame->linesize[2] = width/2;
+  for (int i = 0; i < RAW_LOGGER_THREADS; i++) {
+    workers.push_back(std::thread(&RawLogger::worker_thread, this, i));
+  }
 }
 
 RawLogger::~RawLogger() {
-  av_frame_free(&frame);
-  avcodec_close(codec_ctx);
-  av_free(codec_ctx);
+  encoder_close();
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    exit = true;
+  }
+  cv_work.notify_all();
+  for (auto &t : workers) t.join();
+
+  for (auto &codec_ctx : codec_ctxs) {
+    avcodec_close(codec_ctx);
+    av_free(codec_ctx);
+  }
 }
 
-void RawLogger::encoder_open(const char* path) {
+void RawLogger::encoder_open(const char* path, int segment_length) {
   vid_path = util::string_format("%s/%s.mkv", path, filename);
 
   // create camera lock file
@@ -85,11 +108,13 @@ void RawLogger::encoder_open(const char* path) {
   stream->time_base = (AVRational){ 1, fps };
   // codec_ctx->time_base = stream->time_base;
 
-  int err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+  int err = avcodec_parameters_from_context(stream->codecpar, codec_ctxs[0]);
   assert(err >= 0);
 
-  err = avio_open(&format_ctx->pb, vid_path.c_str(), AVIO_FLAG_WRITE);
-  assert(err >= 0);
+  // about half of the raw frames of a segment. mkv seeks back to finish the header, so no O_DIRECT
+  file = new SegmentFile(vid_path.c_str(), (size_t)width * height * 3 / 4 * fps * segment_length, false);
+  format_ctx->pb = segment_avio_open(file);
+  assert(format_ctx->pb);
 
   err = avformat_write_header(format_ctx, NULL);
   assert(err >= 0);
@@ -98,55 +123,172 @@ void RawLogger::encoder_open(const char* path) {
   counter = 0;
 }
 
-void RawLogger::encoder_close() {
-  if (!is_open) return;
-
-  int err = av_write_trailer(format_ctx);
-  assert(err == 0);
+std::function<void()> RawLogger::encoder_detach() {
+  if (!is_open) return []{};
 
-  avcodec_close(stream->codec);
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    cv_muxed.wait(lk, [&]{ return next_mux_seq == next_seq; });
+  }
 
-  err = avio_closep(&format_ctx->pb);
-  assert(err == 0);
+  RawLoggerStats st = get_stats();
+  LOGD("%s: %lu frames, encode %.2f ms avg %.2f ms max, %d queued max, %lu stalls", filename, st.frames,
+       st.frames ? st.encode_ms_total / st.frames : 0., st.encode_ms_max, st.max_queued, st.stalls);
 
-  avformat_free_context(format_ctx);
+  AVFormatContext *old_format_ctx = format_ctx;
+  AVStream *old_stream = stream;
+  SegmentFile *old_file = file;
+  std::string old_lock_path = lock_path;
   format_ctx = NULL;
-
-  unlink(lock_path.c_str());
+  stream = NULL;
+  file = NULL;
   is_open = false;
+
+  return [=]() mutable {
+    int err = av_write_trailer(old_format_ctx);
+    assert(err == 0);
+
+    avcodec_close(old_stream->codec);
+
+    segment_avio_close(&old_format_ctx->pb);
+    delete old_file;
+
+    avformat_free_context(old_format_ctx);
+
+    unlink(old_lock_path.c_str());
+  };
 }
 
 int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                             int in_width, int in_height, uint64_t ts) {
-  AVPacket pkt;
-  av_init_packet(&pkt);
-  pkt.data = NULL;
-  pkt.size = 0;
-
-  frame->data[0] = (uint8_t*)y_ptr;
-  frame->data[1] = (uint8_t*)u_ptr;
-  frame->data[2] = (uint8_t*)v_ptr;
-  frame->pts = ts;
-
-  int ret = counter;
-
-  int got_output = 0;
-  int err = avcodec_encode_video2(codec_ctx, &pkt, frame, &got_output);
-  if (err) {
-    LOGE("encoding error\n");
-    ret = -1;
-  } else if (got_output) {
-    av_packet_rescale_ts(&pkt, codec_ctx->time_base, stream->time_base);
-    pkt.stream_index = 0;
-
-    err = av_interleaved_write_frame(format_ctx, &pkt);
-    if (err < 0) {
-      LOGE("encoder writer error\n");
-      ret = -1;
-    } else {
-      counter++;
+  Frame *f;
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    if (free_frames.empty()) {
+      stats.stalls++;
+      cv_free.wait(lk, [&]{ return !free_frames.empty(); });
     }
+    f = free_frames.front();
+    free_frames.pop_front();
+  }
+
+  // the vipc buffer is released on the next recv, so the frame is copied.
+  // qcamera is downscaled on the way
+  size_t y_size = width * height;
+  uint8_t *y = f->yuv.data(), *u = y + y_size, *v = u + y_size / 4;
+  if (in_width != width || in_height != height) {
+    libyuv::I420Scale(y_ptr, in_width,
+                      u_ptr, in_width/2,
+                      v_ptr, in_width/2,
+                      in_width, in_height,
+                      y, width,
+                      u, width/2,
+                      v, width/2,
+                      width, height,
+                      libyuv::kFilterNone);
+  } else {
+    memcpy(y, y_ptr, y_size);
+    memcpy(u, u_ptr, y_size / 4);
+    memcpy(v, v_ptr, y_size / 4);
+  }
+  f->ts = ts;
+
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    f->seq = next_seq++;
+    work.push_back(f);
+    stats.queued = RAW_LOGGER_QUEUE - free_frames.size();
+    stats.max_queued = std::max(stats.max_queued, stats.queued);
   }
+  cv_work.notify_one();
+
+  return counter++;
+}
+
+void RawLogger::worker_thread(int idx) {
+  AVCodecContext *codec_ctx = codec_ctxs[idx];
+  AVFrame *frame = av_frame_alloc();
+  assert(frame);
+  frame->format = codec_ctx->pix_fmt;
+  frame->width = width;
+  frame->height = height;
+  frame->linesize[0] = width;
+  frame->linesize[1] = width/2;
+  frame->linesize[2] = width/2;
+
+  while (true) {
+    Frame *f;
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      cv_work.wait(lk, [&]{ return exit || !work.empty(); });
+      if (work.empty()) break;
+      f = work.front();
+      work.pop_front();
+    }
+
+    double t1 = millis_since_boot();
+    frame->data[0] = f->yuv.data();
+    frame->data[1] = frame->data[0] + width * height;
+    frame->data[2] = frame->data[1] + width * height / 4;
+    frame->pts = f->ts;
+
+    int got_output = 0;
+    int err = avcodec_encode_video2(codec_ctx, &f->pkt, frame, &got_output);
+    f->ok = !err && got_output;
+    if (err) {
+      LOGE("encoding error\n");
+    }
+    double dt = millis_since_boot() - t1;
+
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      encoded[f->seq] = f;
+      stats.frames++;
+      stats.encode_ms_total += dt;
+      stats.encode_ms_max = std::max(stats.encode_ms_max, dt);
+    }
+    mux_encoded();
+  }
+
+  av_frame_free(&frame);
+}
+
+// Writes the encoded frames that are next in order. Only one thread muxes at a time
+void RawLogger::mux_encoded() {
+  std::unique_lock<std::mutex> mux_lk(mux_lock);
+  while (true) {
+    Frame *f;
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      auto it = encoded.find(next_mux_seq);
+      if (it == encoded.end()) break;
+      f = it->second;
+      encoded.erase(it);
+    }
+
+    if (f->ok) {
+      av_packet_rescale_ts(&f->pkt, codec_ctxs[0]->time_base, stream->time_base);
+      f->pkt.stream_index = 0;
+
+      int err = av_interleaved_write_frame(format_ctx, &f->pkt);
+      if (err < 0) {
+        LOGE("encoder writer error\n");
+      }
+    }
+    av_packet_unref(&f->pkt);
+
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      next_mux_seq++;
+      free_frames.push_back(f);
+      stats.queued = RAW_LOGGER_QUEUE - free_frames.size();
+    }
+    cv_free.notify_one();
+    cv_muxed.notify_all();
+  }
+}
 
-  return ret;
+RawLoggerStats RawLogger::get_stats() {
+  std::unique_lock<std::mutex> lk(lock);
+  return stats;
 }
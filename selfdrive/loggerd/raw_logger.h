@@ -3,7 +3,12 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -13,30 +18,67 @@ extern "C" {
 }
 
 #include "encoder.h"
+#include "segment_file.h"
+
+// FFVHUFF frames are intra only, so frames are encoded in parallel by workers with
+// their own codec context and written out in order.
+#define RAW_LOGGER_THREADS 2
+// Frames copied out of VisionIPC waiting for or being encoded before encode_frame blocks
+#define RAW_LOGGER_QUEUE 8
+
+struct RawLoggerStats {
+  uint64_t frames;
+  int queued, max_queued;
+  uint64_t stalls;        // encode_frame calls that waited for a free frame
+  double encode_ms_total, encode_ms_max;
+};
 
 class RawLogger : public VideoEncoder {
 public:
   RawLogger(const char* filename, int width, int height, int fps,
             int bitrate, bool h265, bool downscale);
   ~RawLogger();
+  // Queues the frame and returns its index in the segment, it is encoded and written later
   int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                    int in_width, int in_height, uint64_t ts);
-  void encoder_open(const char* path);
-  void encoder_close();
+  void encoder_open(const char* path, int segment_length);
+  // Waits for the queued frames to be written, the trailer is written by the returned function
+  std::function<void()> encoder_detach();
+  RawLoggerStats get_stats();
 
 private:
+  struct Frame {
+    std::vector<uint8_t> yuv;
+    uint64_t ts, seq;
+    AVPacket pkt;
+    bool ok;
+  };
+
+  void worker_thread(int idx);
+  void mux_encoded();
+
   const char* filename;
-  int fps;
+  int fps, width, height;
   int counter = 0;
   bool is_open = false;
 
   std::string vid_path, lock_path;
 
   AVCodec *codec = NULL;
-  AVCodecContext *codec_ctx = NULL;
+  std::vector<AVCodecContext *> codec_ctxs;
 
   AVStream *stream = NULL;
   AVFormatContext *format_ctx = NULL;
+  SegmentFile *file = NULL;
+
+  std::vector<Frame> frames;
+  std::deque<Frame *> free_frames, work;
+  std::map<uint64_t, Frame *> encoded;
+  uint64_t next_seq = 0, next_mux_seq = 0;
+  bool exit = false;
+  RawLoggerStats stats = {};
 
-  AVFrame *frame = NULL;
+  std::mutex lock, mux_lock;
+  std::condition_variable cv_free, cv_work, cv_muxed;
+  std::vector<std::thread> workers;
 };
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "segment_file.h"
+
+#define SEGMENT_AVIO_BUF_SIZE (64 * 1024)
+
+// Lets the muxers write through a SegmentFile. Seeking needs a buffered file
+inline AVIOContext *segment_avio_open(SegmentFile *file) {
+  auto write_packet = [](void *opaque, uint8_t *buf, int buf_size) -> int {
+    return ((SegmentFile *)opaque)->write(buf, buf_size) ? buf_size : AVERROR(EIO);
+  };
+  int64_t (*seek)(void *, int64_t, int) = [](void *opaque, int64_t offset, int whence) -> int64_t {
+    SegmentFile *f = (SegmentFile *)opaque;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) return -1;
+    if (whence == SEEK_CUR) offset += f->tell();
+    if (whence != SEEK_SET && whence != SEEK_CUR) return -1;
+    return f->seek(offset) ? offset : -1;
+  };
+
+  uint8_t *buf = (uint8_t *)av_malloc(SEGMENT_AVIO_BUF_SIZE);
+  return avio_alloc_context(buf, SEGMENT_AVIO_BUF_SIZE, 1, file, NULL, write_packet,
+                            file->is_direct() ? NULL : seek);
+}
+
+inline void segment_avio_close(AVIOContext **pb) {
+  if (*pb == NULL) return;
+  avio_flush(*pb);
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+}
@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "common/swaglog.h"
+#include "segment_file.h"
+
+SegmentFile::SegmentFile(const char *path, size_t expected_size, bool direct) : path(path), direct(direct) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef __linux__
+  if (direct) {
+    fd = open(path, flags | O_DIRECT, 0664);
+    // not every filesystem does O_DIRECT, tmpfs for one
+    if (fd < 0 && errno == EINVAL) {
+      this->direct = false;
+    }
+  }
+#else
+  this->direct = false;
+#endif
+  if (fd < 0) {
+    fd = open(path, flags, 0664);
+  }
+  assert(fd >= 0);
+
+  if (this->direct) {
+    int err = posix_memalign((void **)&buf, SEGMENT_FILE_ALIGN, SEGMENT_FILE_BUF_SIZE);
+    assert(err == 0);
+  }
+
+#ifdef __linux__
+  // keep the size, readers shouldn't see the preallocated zeros
+  if (expected_size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected_size) != 0 && errno != EOPNOTSUPP) {
+    LOGW("fallocate %s failed, errno=%d", path, errno);
+  }
+#endif
+}
+
+SegmentFile::~SegmentFile() {
+  if (direct) {
+    flush_direct(true);
+    free(buf);
+  }
+  // drops the padding of the last direct write and the preallocation that wasn't used
+  if (ftruncate(fd, end) != 0) {
+    LOGE("ftruncate %s failed, errno=%d", path.c_str(), errno);
+  }
+  int err = close(fd);
+  assert(err == 0);
+
+  LOGD("%s: %lu writes, %.1f MB, write ms avg %.2f max %.2f", path.c_str(), write_stats.writes,
+       write_stats.bytes / 1e6, write_stats.writes ? write_stats.total_ms / write_stats.writes : 0., write_stats.max_ms);
+}
+
+bool SegmentFile::pwrite_timed(const void *data, size_t size, uint64_t offset) {
+  auto t1 = std::chrono::steady_clock::now();
+  ssize_t written = 0;
+  while (written < size) {
+    ssize_t ret = pwrite(fd, (const char *)data + written, size - written, offset + written);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) break;
+    written += ret;
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+
+  write_stats.writes++;
+  write_stats.bytes += std::max(written, (ssize_t)0);
+  write_stats.total_ms += ms;
+  write_stats.max_ms = std::max(write_stats.max_ms, ms);
+
+  if (written != size) {
+    if (!error_logged) {
+      LOGE("write %s failed, errno=%d", path.c_str(), errno);
+      error_logged = true;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool SegmentFile::write(const void *data, size_t size) {
+  if (!direct) {
+    bool ok = pwrite_timed(data, size, pos);
+    pos += size;
+    end = std::max(end, pos);
+    if (end - synced >= SEGMENT_FILE_SYNC_SIZE) {
+      start_writeback();
+    }
+    return ok;
+  }
+
+  bool ok = true;
+  const char *p = (const char *)data;
+  while (size > 0) {
+    size_t n = std::min(size, (size_t)SEGMENT_FILE_BUF_SIZE - buf_len);
+    memcpy(buf + buf_len, p, n);
+    buf_len += n;
+    p += n;
+    size -= n;
+    pos += n;
+    if (buf_len == SEGMENT_FILE_BUF_SIZE) {
+      ok = flush_direct(false) && ok;
+    }
+  }
+  end = pos;
+  return ok;
+}
+
+bool SegmentFile::seek(uint64_t offset) {
+  if (direct) return false;
+  pos = offset;
+  return true;
+}
+
+// The staging buffer starts at an aligned offset, the last write is padded to the alignment
+bool SegmentFile::flush_direct(bool last) {
+  if (buf_len == 0) return true;
+
+  size_t size = buf_len;
+  if (last) {
+    size = (buf_len + SEGMENT_FILE_ALIGN - 1) / SEGMENT_FILE_ALIGN * SEGMENT_FILE_ALIGN;
+    memset(buf + buf_len, 0, size - buf_len);
+  }
+  bool ok = pwrite_timed(buf, size, pos - buf_len);
+  buf_len = 0;
+  return ok;
+}
+
+void SegmentFile::start_writeback() {
+#ifdef __linux__
+  // the previous range had a whole SEGMENT_FILE_SYNC_SIZE of writes to get to disk, this rarely waits
+  if (synced > waited) {
+    sync_file_range(fd, waited, synced - waited, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, waited, synced - waited, POSIX_FADV_DONTNEED);
+    waited = synced;
+  }
+  sync_file_range(fd, synced, end - synced, SYNC_FILE_RANGE_WRITE);
+#endif
+  synced = end;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// File sink for everything loggerd writes into a segment. The expected size is
+// preallocated so the file doesn't fragment and metadata isn't updated on every write.
+//
+// Direct files are appended to with O_DIRECT through an aligned staging buffer and
+// never fill the page cache. Buffered files can seek, their dirty pages are handed
+// to writeback as they are written and dropped once on disk, so the kernel doesn't
+// flush a whole segment at once. Where O_DIRECT isn't supported direct files fall
+// back to buffered. Logs are direct, written from their own thread. Video is buffered,
+// an encoder thread shouldn't wait on the disk.
+
+#define SEGMENT_FILE_ALIGN 4096
+#define SEGMENT_FILE_BUF_SIZE (1024 * 1024)       // direct: written to disk in pieces this big
+#define SEGMENT_FILE_SYNC_SIZE (4 * 1024 * 1024)  // buffered: writeback started every this many bytes
+
+struct SegmentFileStats {
+  uint64_t writes;   // write syscalls
+  uint64_t bytes;
+  double total_ms, max_ms;
+};
+
+class SegmentFile {
+ public:
+  SegmentFile(const char *path, size_t expected_size, bool direct = true);
+  // Writes the rest and trims the file to its size
+  ~SegmentFile();
+
+  bool write(const void *data, size_t size);
+  // Only for buffered files
+  bool seek(uint64_t offset);
+  uint64_t tell() const { return pos; }
+  bool is_direct() const { return direct; }
+  const SegmentFileStats &stats() const { return write_stats; }
+
+ private:
+  bool pwrite_timed(const void *data, size_t size, uint64_t offset);
+  bool flush_direct(bool last);
+  void start_writeback();
+
+  std::string path;
+  int fd = -1;
+  bool direct;
+  bool error_logged = false;
+
+  uint64_t pos = 0, end = 0;
+  // direct
+  char *buf = nullptr;
+  size_t buf_len = 0;
+  // buffered: [synced, end) is dirty, [waited, synced) is in writeback
+  uint64_t synced = 0, waited = 0;
+
+  SegmentFileStats write_stats = {};
+};
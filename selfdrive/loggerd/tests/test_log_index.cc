@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.hpp"
+#include "selfdrive/loggerd/log_reader.h"
+#include "selfdrive/loggerd/log_writer.h"
+
+static const uint64_t NS = 1000000000ULL;
+
+static std::string log_path() {
+  return "/tmp/test_log_index_" + std::to_string(getpid()) + ".bz2";
+}
+
+// 60 s of carState and can at 100 Hz
+static void write_log(const std::string &path) {
+  AsyncBZFile f(path.c_str(), true);
+  for (uint64_t t = 0; t < 6000; t++) {
+    for (bool car_state : {true, false}) {
+      MessageBuilder msg;
+      auto event = msg.initEvent();
+      event.setLogMonoTime(NS + t * 10000000ULL);
+      if (car_state) {
+        event.initCarState().setVEgo(t);
+      } else {
+        event.initCan(8);
+      }
+      auto bytes = msg.toBytes();
+      f.write(bytes.begin(), bytes.size());
+    }
+  }
+}
+
+static std::string read_file(const std::string &path) {
+  std::string data;
+  FILE *f = fopen(path.c_str(), "rb");
+  char buf[64 * 1024];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+  fclose(f);
+  return data;
+}
+
+static void write_file(const std::string &path, const std::string &data) {
+  FILE *f = fopen(path.c_str(), "wb");
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+TEST_CASE("Indexed log round trips through the writer and reader") {
+  std::string path = log_path();
+  write_log(path);
+
+  IndexedLogReader reader;
+  REQUIRE(reader.open(path));
+  REQUIRE(reader.chunks().size() > 1);
+
+  // 30 to 35 s, only the chunks around it are decoded
+  int n = 0;
+  int decoded = reader.forEach(NS + 30 * NS, NS + 35 * NS, {"carState"}, [&](cereal::Event::Reader event) {
+    REQUIRE(event.which() == cereal::Event::CAR_STATE);
+    REQUIRE(event.getCarState().getVEgo() == 3000 + n);
+    n++;
+  });
+  REQUIRE(n == 501);
+  REQUIRE((size_t)decoded < reader.chunks().size());
+
+  REQUIRE(reader.findChunks(0, UINT64_MAX, {"initData"}).empty());
+  REQUIRE(reader.findChunks(0, UINT64_MAX).size() == reader.chunks().size());
+
+  unlink(path.c_str());
+}
+
+TEST_CASE("Corrupt indexes are rejected") {
+  std::string path = log_path();
+  write_log(path);
+  std::string good = read_file(path);
+
+  LogIndexFooter footer;
+  memcpy(&footer, good.data() + good.size() - sizeof(footer), sizeof(footer));
+  LogChunkIndex chunk;
+  memcpy(&chunk, good.data() + footer.index_offset, sizeof(chunk));
+
+  std::string bad = good;
+  SECTION("num_chunks past the end of the file") {
+    footer.num_chunks += 1000000;
+    memcpy(&bad[bad.size() - sizeof(footer)], &footer, sizeof(footer));
+  }
+  SECTION("index_offset past the end of the file") {
+    footer.index_offset = UINT64_MAX;
+    memcpy(&bad[bad.size() - sizeof(footer)], &footer, sizeof(footer));
+  }
+  SECTION("chunk overlapping the index") {
+    chunk.offset = footer.index_offset - 10;
+    memcpy(&bad[footer.index_offset], &chunk, sizeof(chunk));
+  }
+  SECTION("chunk raw_size over the limit") {
+    chunk.raw_size = UINT32_MAX;
+    memcpy(&bad[footer.index_offset], &chunk, sizeof(chunk));
+  }
+  SECTION("truncated chunks") {
+    bad.erase(footer.index_offset - 100, 100);
+  }
+
+  write_file(path, bad);
+  IndexedLogReader reader;
+  REQUIRE_FALSE(reader.open(path));
+
+  unlink(path.c_str());
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+import bz2
+import os
+import signal
+import subprocess
+import time
+import unittest
+
+import numpy as np
+
+import cereal.messaging as messaging
+from cereal import log
+from cereal.visionipc.visionipc_pyx import VisionIpcServer, VisionStreamType  # pylint: disable=no-name-in-module, import-error
+from common.basedir import BASEDIR
+from selfdrive.loggerd.config import ROOT
+
+FPS = 20
+SEGMENT_LENGTH = 1
+ROTATIONS = 100
+W, H = 1164, 874
+
+
+class TestLoggerdRotation(unittest.TestCase):
+  def setUp(self):
+    os.environ["LOGGERD_TEST"] = "1"
+    os.environ["LOGGERD_SEGMENT_LENGTH"] = str(SEGMENT_LENGTH)
+    os.makedirs(ROOT, exist_ok=True)
+    self.existing = set(os.listdir(ROOT))
+    self.loggerd = None
+
+  def tearDown(self):
+    self._stop_loggerd()
+    del os.environ["LOGGERD_TEST"]
+    del os.environ["LOGGERD_SEGMENT_LENGTH"]
+
+  # loggerd is only in managed_processes with OpkrEnableLogger set, so it's started directly
+  def _start_loggerd(self):
+    self.loggerd = subprocess.Popen(["./loggerd"], cwd=os.path.join(BASEDIR, "selfdrive/loggerd"))
+
+  def _stop_loggerd(self):
+    if self.loggerd is not None and self.loggerd.poll() is None:
+      self.loggerd.send_signal(signal.SIGINT)
+      self.loggerd.wait(timeout=30)
+
+  def _new_segments(self):
+    segments = [d for d in os.listdir(ROOT) if d not in self.existing and "--" in d]
+    return sorted(segments, key=lambda d: int(d.rsplit("--", 1)[1]))
+
+  def test_no_frames_lost_across_rotations(self):
+    pm = messaging.PubMaster(["roadCameraState"])
+    vipc_server = VisionIpcServer("camerad")
+    vipc_server.create_buffers(VisionStreamType.VISION_STREAM_YUV_BACK, 40, False, W, H)
+    vipc_server.start_listener()
+
+    self._start_loggerd()
+    time.sleep(2)
+
+    frame = np.random.randint(0, 256, W * H * 3 // 2, dtype=np.uint8).tobytes()
+    num_frames = (ROTATIONS + 1) * SEGMENT_LENGTH * FPS
+    for frame_id in range(1, num_frames + 1):
+      t = int(time.monotonic() * 1e9)
+      vipc_server.send(VisionStreamType.VISION_STREAM_YUV_BACK, frame, frame_id, t, t)
+
+      msg = messaging.new_message("roadCameraState")
+      msg.roadCameraState.frameId = frame_id
+      pm.send("roadCameraState", msg)
+      time.sleep(1. / FPS)
+
+    time.sleep(1)
+    self.assertIsNone(self.loggerd.poll(), "loggerd exited")
+    self._stop_loggerd()
+    self.assertEqual(self.loggerd.returncode, 0)
+
+    segments = self._new_segments()
+    self.assertGreaterEqual(len(segments), ROTATIONS)
+
+    encoded = []
+    for n, segment in enumerate(segments):
+      path = os.path.join(ROOT, segment)
+      for video in ("fcamera.hevc.mkv", "qcamera.ts.mkv"):
+        self.assertTrue(os.path.exists(os.path.join(path, video)), f"no {video} in {segment}")
+
+      with open(os.path.join(path, "rlog.bz2"), "rb") as f:
+        events = log.Event.read_multiple_bytes(bz2.decompress(f.read()))
+      idxs = [e.roadEncodeIdx for e in events if e.which() == "roadEncodeIdx"]
+      if n < len(segments) - 1:
+        self.assertGreater(len(idxs), 0, f"no frames in {segment}")
+
+      # every segment starts its own video and the frames in it are contiguous
+      for i, idx in enumerate(idxs):
+        self.assertEqual(idx.segmentNum, n)
+        self.assertEqual(idx.segmentId, i)
+      encoded += [idx.frameId for idx in idxs]
+
+    # frames run on across the segment boundaries, none dropped or encoded twice
+    self.assertGreater(len(encoded), 0)
+    self.assertEqual(encoded, list(range(encoded[0], encoded[0] + len(encoded))))
+    self.assertGreaterEqual(encoded[-1], num_frames - FPS)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.hpp"
+#include "cereal/services.h"
+#include "selfdrive/loggerd/qlog_policy.h"
+
+static const uint64_t MS = 1000000ULL;
+
+static int service_idx(const char *name) {
+  for (int i = 0; i < sizeof(services) / sizeof(services[0]); i++) {
+    if (strcmp(services[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+static std::string write_policy(const std::string &config) {
+  std::string path = "/tmp/test_qlog_policy_" + std::to_string(getpid()) + ".json";
+  FILE *f = fopen(path.c_str(), "wb");
+  fwrite(config.data(), 1, config.size(), f);
+  fclose(f);
+  return path;
+}
+
+static bool init_policy(QlogPolicy &policy, const std::string &config) {
+  std::string path = write_policy(config);
+  bool ok = policy.init(path);
+  unlink(path.c_str());
+  return ok;
+}
+
+struct CarState {
+  float v_ego = 0;
+  bool cruise_enabled = false;
+  cereal::CarState::GearShifter gear = cereal::CarState::GearShifter::PARK;
+};
+
+static bool log_car_state(QlogPolicy &policy, const CarState &cs, uint64_t t = 0) {
+  MessageBuilder msg;
+  auto car_state = msg.initEvent().initCarState();
+  car_state.setVEgo(cs.v_ego);
+  car_state.initCruiseState().setEnabled(cs.cruise_enabled);
+  car_state.setGearShifter(cs.gear);
+  auto bytes = msg.toBytes();
+  return policy.should_log(service_idx("carState"), (const char *)bytes.begin(), bytes.size(), t);
+}
+
+// Indices of the messages out of n carState messages sent every dt that go into the qlog
+static std::vector<int> logged(QlogPolicy &policy, int n, uint64_t dt) {
+  std::vector<int> ret;
+  for (int i = 0; i < n; i++) {
+    if (log_car_state(policy, CarState(), i * dt)) ret.push_back(i);
+  }
+  return ret;
+}
+
+TEST_CASE("Services without a policy use their decimation") {
+  QlogPolicy policy;
+  REQUIRE(policy.init("/tmp/no_such_qlog_policy.json"));
+  REQUIRE(logged(policy, 25, 10 * MS) == std::vector<int>{0, 10, 20});
+}
+
+TEST_CASE("every keeps every Nth message") {
+  QlogPolicy policy;
+  REQUIRE(init_policy(policy, R"({"carState": {"every": 3}})"));
+  REQUIRE(logged(policy, 8, 10 * MS) == std::vector<int>{0, 3, 6});
+}
+
+TEST_CASE("max_hz limits the rate") {
+  QlogPolicy policy;
+  REQUIRE(init_policy(policy, R"({"carState": {"max_hz": 2}})"));
+  REQUIRE(logged(policy, 12, 100 * MS) == std::vector<int>{0, 5, 10});
+}
+
+TEST_CASE("always keeps every message") {
+  QlogPolicy policy;
+  REQUIRE(init_policy(policy, R"({"carState": {"always": true}})"));
+  REQUIRE(logged(policy, 5, 10 * MS) == std::vector<int>{0, 1, 2, 3, 4});
+}
+
+TEST_CASE("on_change keeps messages where a field changed") {
+  QlogPolicy policy;
+  REQUIRE(init_policy(policy, R"({"carState": {"on_change": ["gearShifter", "cruiseState.enabled"]}})"));
+
+  CarState cs;
+  REQUIRE(log_car_state(policy, cs));
+  REQUIRE_FALSE(log_car_state(policy, cs));
+
+  // other fields don't count
+  cs.v_ego = 10;
+  REQUIRE_FALSE(log_car_state(policy, cs));
+
+  cs.gear = cereal::CarState::GearShifter::DRIVE;
+  REQUIRE(log_car_state(policy, cs));
+  REQUIRE_FALSE(log_car_state(policy, cs));
+
+  cs.cruise_enabled = true;
+  REQUIRE(log_car_state(policy, cs));
+  REQUIRE_FALSE(log_car_state(policy, cs));
+}
+
+TEST_CASE("on_change compares text and lists") {
+  QlogPolicy policy;
+  REQUIRE(init_policy(policy, R"({"controlsState": {"on_change": ["alertText1"]},
+                                  "driverMonitoringState": {"on_change": ["events"]}})"));
+
+  auto controls_state = [&](const char *text) {
+    MessageBuilder msg;
+    msg.initEvent().initControlsState().setAlertText1(text);
+    auto bytes = msg.toBytes();
+    return policy.should_log(service_idx("controlsState"), (const char *)bytes.begin(), bytes.size(), 0);
+  };
+  REQUIRE(controls_state("TAKE CONTROL"));
+  REQUIRE_FALSE(controls_state("TAKE CONTROL"));
+  REQUIRE(controls_state("TAKE CONTROL IMMEDIATELY"));
+
+  auto driver_monitoring = [&](std::vector<cereal::CarEvent::EventName> names) {
+    MessageBuilder msg;
+    auto events = msg.initEvent().initDriverMonitoringState().initEvents(names.size());
+    for (int i = 0; i < names.size(); i++) {
+      events[i].setName(names[i]);
+      events[i].setWarning(true);
+    }
+    auto bytes = msg.toBytes();
+    return policy.should_log(service_idx("driverMonitoringState"), (const char *)bytes.begin(), bytes.size(), 0);
+  };
+  REQUIRE(driver_monitoring({}));
+  REQUIRE_FALSE(driver_monitoring({}));
+  REQUIRE(driver_monitoring({cereal::CarEvent::EventName::DOOR_OPEN}));
+  REQUIRE_FALSE(driver_monitoring({cereal::CarEvent::EventName::DOOR_OPEN}));
+  REQUIRE(driver_monitoring({cereal::CarEvent::EventName::SEATBELT_NOT_LATCHED}));
+  REQUIRE(driver_monitoring({cereal::CarEvent::EventName::SEATBELT_NOT_LATCHED, cereal::CarEvent::EventName::DOOR_OPEN}));
+}
+
+TEST_CASE("The shipped policy is valid") {
+  // Run from selfdrive/loggerd like loggerd, a missing file would pass as decimation only
+  REQUIRE(access(QLOG_POLICY_DEFAULT_PATH, R_OK) == 0);
+  QlogPolicy policy;
+  REQUIRE(policy.init(QLOG_POLICY_DEFAULT_PATH));
+}
+
+TEST_CASE("Invalid policies fall back to decimation") {
+  QlogPolicy policy;
+  REQUIRE_FALSE(init_policy(policy, R"({"carState": {"always": true, "on_change": ["noSuchField"]}})"));
+  REQUIRE(logged(policy, 25, 10 * MS) == std::vector<int>{0, 10, 20});
+
+  REQUIRE_FALSE(init_policy(policy, R"({"noSuchService": {"always": true}, "carState": {"always": true}})"));
+  REQUIRE(logged(policy, 25, 10 * MS) == std::vector<int>{0, 10, 20});
+
+  REQUIRE_FALSE(init_policy(policy, "{"));
+  REQUIRE(logged(policy, 25, 10 * MS) == std::vector<int>{0, 10, 20});
+}
@@ -3,6 +3,7 @@
 #include <sys/resource.h>
 
 #include "visionipc_client.h"
+#include "frame_trace.h"
 #include "common/swaglog.h"
 #include "common/util.h"
 
@@ -24,11 +25,14 @@ void run_model(DMonitoringModelState &model, VisionIpcClient &vipc_client) {
     if (buf == nullptr) continue;
 
     double t1 = millis_since_boot();
+    frame_trace(FRAME_TRACE_MODEL_START, buf->type, extra.frame_id);
     DMonitoringResult res = dmonitoring_eval_frame(&model, buf->addr, buf->width, buf->height);
+    frame_trace(FRAME_TRACE_MODEL_END, buf->type, extra.frame_id);
     double t2 = millis_since_boot();
 
     // send dm packet
     dmonitoring_publish(pm, extra.frame_id, res, (t2 - t1) / 1000.0, model.output);
+    frame_trace(FRAME_TRACE_MODEL_PUBLISH, buf->type, extra.frame_id);
 
     //printf("dmonitoring process: %.2fms, from last %.2fms\n", t2 - t1, t1 - last);
     last = t1;
@@ -4,6 +4,7 @@
 #include <eigen3/Eigen/Dense>
 
 #include "visionipc_client.h"
+#include "frame_trace.h"
 #include "common/swaglog.h"
 #include "common/clutil.h"
 #include "common/util.h"
@@ -105,8 +106,10 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
       }
 
       double mt1 = millis_since_boot();
+      frame_trace(FRAME_TRACE_MODEL_START, buf->type, extra.frame_id);
       ModelDataRaw model_buf = model_eval_frame(&model, buf->buf_cl, buf->width, buf->height,
                                                 model_transform, vec_desire);
+      frame_trace(FRAME_TRACE_MODEL_END, buf->type, extra.frame_id);
       double mt2 = millis_since_boot();
       float model_execution_time = (mt2 - mt1) / 1000.0;
 
@@ -123,6 +126,7 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
       model_publish(pm, extra.frame_id, frame_id, frame_drop_ratio, model_buf, extra.timestamp_eof, model_execution_time,
                     kj::ArrayPtr<const float>(model.output.data(), model.output.size()));
       posenet_publish(pm, extra.frame_id, vipc_dropped_frames, model_buf, extra.timestamp_eof);
+      frame_trace(FRAME_TRACE_MODEL_PUBLISH, buf->type, extra.frame_id);
 
       //printf("model process: %.2fms, from last %.2fms, vipc_frame_id %u, frame_id, %u, frame_drop %.3f\n", mt2 - mt1, mt1 - last, extra.frame_id, frame_id, frame_drop_ratio);
       last = mt1;
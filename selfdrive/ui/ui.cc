@@ -7,6 +7,7 @@
 #include "common/util.h"
 #include "common/swaglog.h"
 #include "common/visionimg.h"
+#include "frame_trace.h"
 #include "ui.hpp"
 #include "paint.hpp"
 #include "dashcam.h"
@@ -389,8 +390,10 @@ static void update_vision(UIState *s) {
   }
 
   if (s->vipc_client->connected){
-    VisionBuf * buf = s->vipc_client->recv();
+    VisionIpcBufExtra extra = {};
+    VisionBuf * buf = s->vipc_client->recv(&extra);
     if (buf != nullptr){
+      frame_trace(FRAME_TRACE_UI_RECV, buf->type, extra.frame_id);
       s->last_frame = buf;
     } else {
 #if defined(QCOM) || defined(QCOM2)